@@ -109,7 +109,45 @@ enum sock_flags {
 	/** @brief UNIX Domain Socket*/
 	SOCK_FLAG_UNIX		= 1 << 3,
 	/** @brief Multicast Socket*/
-	SOCK_FLAG_MCAST		= 1 << 4
+	SOCK_FLAG_MCAST		= 1 << 4,
+	/** @brief UDP segmentation offload is used by socketwrite_gso()*/
+	SOCK_FLAG_GSO		= 1 << 5,
+	/** @brief UDP receive coalescing returned by socketread_gro()*/
+	SOCK_FLAG_GRO		= 1 << 6
+};
+
+/** @brief Reason passed to the socket timeout callback.
+  * @ingroup LIB-Sock-Timer*/
+enum sock_timeout {
+	/** @brief No read or write for the idle time.*/
+	SOCK_TIMEOUT_IDLE	= 1,
+	/** @brief No data read for the read time.*/
+	SOCK_TIMEOUT_READ	= 2,
+	/** @brief No data read within the handshake time of starting.*/
+	SOCK_TIMEOUT_HANDSHAKE	= 3
+};
+
+/** @brief Directions encrypted by the kernel returned by socket_ktls()
+  * @ingroup LIB-Sock-SSL*/
+enum sock_ktls {
+	/** @brief Records sent are encrypted by the kernel.*/
+	SOCK_KTLS_TX	= 1 << 0,
+	/** @brief Records received are decrypted by the kernel.*/
+	SOCK_KTLS_RX	= 1 << 1
+};
+
+/** @brief Options supplied to socketserver_multi()
+  * @ingroup LIB-Sock*/
+enum socket_multi_flags {
+	/** @brief Accept connections on the listener matching the CPU that received the packet.*/
+	SOCKET_MULTI_CPU	= 1 << 0
+};
+
+/** @brief Options supplied to create_ringbuffer() the default is a single producer single consumer ring.
+  * @ingroup LIB-OBJ-Ring*/
+enum ring_buffer_flags {
+	/** @brief Allow multiple threads to add to the ring buffer there may still only be one consumer.*/
+	RING_BUFFER_MPSC	= 1 << 0
 };
 
 /** @brief Options supplied to framework_mkthread all defaults are unset
@@ -121,7 +159,28 @@ enum thread_option_flags {
         /** @brief Create the the thread joinable only do this if you will be joining it cancelable threads are best detached.*/
         THREAD_OPTION_JOINABLE		= 1 << 1,
         /** @brief Return reference to thread this must be unreferenced.*/
-        THREAD_OPTION_RETURN		= 1 << 2
+        THREAD_OPTION_RETURN		= 1 << 2,
+        /** @brief Bind the thread and its memory allocations to thread_attr::numa_node.*/
+        THREAD_OPTION_NUMA		= 1 << 3,
+        /** @brief Apply thread_attr::policy and thread_attr::priority.*/
+        THREAD_OPTION_SCHED		= 1 << 4
+};
+
+/** @brief Extended thread attributes passed to framework_mkthread_attr()
+  * @ingroup LIB-Thread
+  * @note Zero the structure before use unused fields are ignored.*/
+struct thread_attr {
+	/** @brief Thread name shown in top -H and perf truncated to 15 characters.*/
+	const char *name;
+	/** @brief CPU list the thread is pinned too in taskset format ie "0-3,8".*/
+	const char *cpulist;
+	/** @brief NUMA node to allocate memory from and run on requires @ref THREAD_OPTION_NUMA.
+	  * @note If cpulist is not set the thread is pinned to the CPU's of the node.*/
+	int numa_node;
+	/** @brief Scheduling policy SCHED_OTHER, SCHED_FIFO or SCHED_RR requires @ref THREAD_OPTION_SCHED.*/
+	int policy;
+	/** @brief Scheduling priority for policy.*/
+	int priority;
 };
 
 
@@ -148,6 +207,77 @@ struct fwsocket {
 	struct fwsocket *parent;
 	/** @brief We are the parent this is a list of spawn.*/
 	struct bucket_list *children;
+	/** @brief Buffers held until sent by socketwrite_zc().*/
+	struct sock_zerocopy *zerocopy;
+	/** @brief Output queue filled by socket_queue().*/
+	struct sock_outq *outq;
+	/** @brief Traffic counters if enabled with socket_stats_enable().*/
+	struct sock_stats *stats;
+	/** @brief Timeouts and limits set with socket_settimeout() and socket_setlimits().*/
+	struct sock_timer *timer;
+};
+
+/** @brief Number of buckets in the callback time histogram.
+  * @ingroup LIB-Sock*/
+#define SOCK_STATS_HIST	16
+
+/** @brief Socket traffic counters.
+  * @see socket_stats_enable()
+  * @ingroup LIB-Sock*/
+struct sock_stats {
+	/** @brief Bytes read.*/
+	uint64_t bytes_in;
+	/** @brief Bytes written.*/
+	uint64_t bytes_out;
+	/** @brief Reads or datagrams received.*/
+	uint64_t pkts_in;
+	/** @brief Writes or datagrams sent.*/
+	uint64_t pkts_out;
+	/** @brief Read system calls.*/
+	uint64_t reads;
+	/** @brief Write system calls.*/
+	uint64_t writes;
+	/** @brief Reads and writes that returned EAGAIN.*/
+	uint64_t eagain;
+	/** @brief Connections accepted on a listening socket.*/
+	uint64_t accepts;
+	/** @brief Callbacks dispatched.*/
+	uint64_t callbacks;
+	/** @brief Time spent in callbacks in us.*/
+	uint64_t cb_usec;
+	/** @brief Callbacks by time taken bucket n counts callbacks taking less than 2^(n+1)us
+	  * the last bucket counts all longer.*/
+	uint64_t cb_hist[SOCK_STATS_HIST];
+	/** @brief Time spent in SSL_read() in us.*/
+	uint64_t ssl_read_usec;
+	/** @brief Time spent in SSL_write() in us.*/
+	uint64_t ssl_write_usec;
+};
+
+/** @brief Engines available to socketloop_init_engine()
+  * @ingroup LIB-Sock-Loop*/
+enum socket_loop_engine {
+	/** @brief Use epoll.*/
+	SOCKLOOP_ENGINE_EPOLL	= 0,
+	/** @brief Use io_uring poll requests falling back to epoll.*/
+	SOCKLOOP_ENGINE_URING	= 1
+};
+
+/** @brief Default size of buffers returned by socketread_buf().
+  * @ingroup LIB-Sock*/
+#define SOCKBUF_DEFAULT	4096
+
+/** @brief Datagram passed to socketread_batch() and socketwrite_batch()
+  * @ingroup LIB-Sock*/
+struct sock_datagram {
+	/** @brief Buffer to read into or send from.*/
+	void *buf;
+	/** @brief Size of the buffer used when reading.*/
+	int size;
+	/** @brief Length of data received or to be sent.*/
+	int len;
+	/** @brief Address received from or to send too ignored if the family is not set.*/
+	union sockstruct addr;
 };
 
 /**@brief Configuration category entry
@@ -251,6 +381,55 @@ typedef void    *(*threadfunc)(void *);
   * @param data Reference of thread data.*/
 typedef int     (*threadsighandler)(int, void *);
 
+/** @brief Forward decleration of structure.
+  * @ingroup LIB-Thread*/
+typedef struct future future;
+
+/** @brief Result of future_all()
+  * @ingroup LIB-Thread*/
+struct future_results {
+	/** @brief Number of results.*/
+	int cnt;
+	/** @brief Array of result references in the order the futures were supplied.*/
+	void **results;
+};
+
+/** @brief Callback run when a future completes.
+  *
+  * @ingroup LIB-Thread
+  * @see future_then()
+  * @param result Result of the completed future (may be NULL).
+  * @param data Reference to data supplied to future_then().
+  * @returns Reference passed to the future returned by future_then().*/
+typedef void    *(*futurefunc)(void *, void *);
+
+/** @brief Runtime statistics of a thread.
+  * @ingroup LIB-Thread
+  * @see thread_stats_dump()*/
+struct thread_stats {
+	/** @brief Thread name.*/
+	char name[16];
+	/** @brief Label set with thread_setlabel().*/
+	char label[32];
+	/** @brief Time the thread was created.*/
+	struct timeval created;
+	/** @brief CPU time used in microseconds.*/
+	uint64_t cputime;
+	/** @brief Number of wakeups (calls to framework_threadok()).*/
+	uint64_t wakeups;
+	/** @brief Number of callbacks dispatched.*/
+	uint64_t callbacks;
+	/** @brief Thread is running.*/
+	int running;
+};
+
+/** @brief Callback called for each thread by thread_stats_dump()
+  *
+  * @ingroup LIB-Thread
+  * @param stats Statistics of the thread valid only for the duration of the call.
+  * @param data Reference to data supplied to thread_stats_dump().*/
+typedef void    (*thread_statscb)(struct thread_stats *, void *);
+
 /** @brief Callback function to register with a socket that will be called when there is data available.
   *
   * @ingroup LIB-Sock
@@ -258,6 +437,23 @@ typedef int     (*threadsighandler)(int, void *);
   * @param data Reference to data held by client/server thread.*/
 typedef void	(*socketrecv)(struct fwsocket *, void *);
 
+/** @brief Callback called for each socket by socket_stats_dump()
+  *
+  * @ingroup LIB-Sock
+  * @param sock Socket the stats belong too.
+  * @param stats Copy of the sockets counters.
+  * @param data Reference to data passed to socket_stats_dump().*/
+typedef void	(*socket_statscb)(struct fwsocket *, struct sock_stats *, void *);
+
+/** @brief Callback called before a socket that has timed out is closed.
+  *
+  * @ingroup LIB-Sock-Timer
+  * @param sock Socket that timed out.
+  * @param reason Timeout that expired.
+  * @see sock_timeout
+  * @param data Reference to data held by client/server thread.*/
+typedef void	(*sockettimeout)(struct fwsocket *, int, void *);
+
 /** @ingroup LIB-OBJ
   * @brief Callback used to clean data of a reference object when it is to be freed.
   * @param data Data held by reference about to be freed.*/
@@ -354,6 +550,21 @@ void printgnu(const char *pname, int year, const char *dev, const char *email, c
 void daemonize();
 int lockpidfile(const char *runfile);
 extern struct thread_pvt *framework_mkthread(threadfunc, threadcleanup, threadsighandler, void *data, int flags);
+extern struct thread_pvt *framework_mkthread_attr(threadfunc, threadcleanup, threadsighandler, void *data, int flags, const struct thread_attr *attr);
+extern int framework_mkthread_spread(int count, threadfunc, threadcleanup, threadsighandler, void *data, int flags, const char *name);
+extern int framework_cpucount(void);
+extern void thread_setlabel(const char *label);
+extern void thread_stats_dump(thread_statscb cb, void *data);
+/* Futures */
+extern struct future *future_new(void);
+extern void future_set(struct future *future, void *result);
+extern int future_done(struct future *future);
+extern void *future_wait(struct future *future);
+extern void *future_wait_timeout(struct future *future, int msec);
+extern struct future *future_then(struct future *future, futurefunc func, void *data);
+extern struct future *future_all(struct future **futures, int cnt);
+extern struct future *future_any(struct future **futures, int cnt);
+extern struct future *future_run(threadfunc func, void *data);
 /* UNIX Socket*/
 extern struct fwsocket *unixsocket_server(const char *sock, int protocol, int mask, socketrecv read, void *data);
 extern struct fwsocket *unixsocket_client(const char *sock, int protocol, socketrecv read, void *data);
@@ -374,6 +585,7 @@ extern int objsize(void *data);
 extern int objunref(void *data);
 extern int objref(void *data);
 extern void *objalloc(int size, objdestroy);
+extern void *objalloc_buf(int size);
 void *objchar(const char *orig);
 
 /*
@@ -393,6 +605,16 @@ extern struct bucket_loop *init_bucket_loop(struct bucket_list *blist);
 extern void *next_bucket_loop(struct bucket_loop *bloop);
 extern void remove_bucket_loop(struct bucket_loop *bloop);
 
+/*
+ * lock free ring buffers
+ */
+extern struct ring_buffer *create_ringbuffer(int bits, int flags);
+extern int ringbuffer_push(struct ring_buffer *ring, void *data);
+extern int ringbuffer_push_batch(struct ring_buffer *ring, void **data, int cnt);
+extern void *ringbuffer_pop(struct ring_buffer *ring);
+extern int ringbuffer_pop_batch(struct ring_buffer *ring, void **data, int cnt);
+extern int ringbuffer_count(struct ring_buffer *ring);
+
 /*include jenkins hash burttlebob*/
 extern uint32_t hashlittle(const void *key, size_t length, uint32_t initval);
 
@@ -442,12 +664,20 @@ extern char *b64enc_buf(const char *message, uint32_t len, int nonl);
 extern struct fwsocket *make_socket(int family, int type, int proto, void *ssl);
 extern struct fwsocket *accept_socket(struct fwsocket *sock);
 extern struct fwsocket *sockconnect(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl);
+extern struct fwsocket *sockconnect_timeout(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl, int timeout);
 extern struct fwsocket *udpconnect(const char *ipaddr, const char *port, void *ssl);
+extern struct fwsocket *udpconnect_flags(const char *ipaddr, const char *port, void *ssl, int flags);
 extern struct fwsocket *tcpconnect(const char *ipaddr, const char *port, void *ssl);
+extern struct fwsocket *tcpconnect_timeout(const char *ipaddr, const char *port, void *ssl, int timeout);
 extern struct fwsocket *sockbind(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl, int backlog);
 extern struct fwsocket *udpbind(const char *ipaddr, const char *port, void *ssl);
+extern struct fwsocket *udpbind_flags(const char *ipaddr, const char *port, void *ssl, int flags);
 extern struct fwsocket *tcpbind(const char *ipaddr, const char *port, void *ssl, int backlog);
 extern void close_socket(struct fwsocket *sock);
+extern int socket_stats_enable(struct fwsocket *sock);
+extern int socket_stats_get(struct fwsocket *sock, struct sock_stats *stats);
+extern int socket_stats_total(struct fwsocket *sock, struct sock_stats *stats);
+extern void socket_stats_dump(struct fwsocket *sock, socket_statscb cb, void *data);
 
 int score_ipv4(struct sockaddr_in *sa4, char *ipaddr, int iplen);
 int score_ipv6(struct sockaddr_in6 *sa6, char *ipaddr, int iplen);
@@ -461,6 +691,35 @@ int inet_lookup(int family, const char *host, void *addr, socklen_t len);
 
 extern void socketclient(struct fwsocket *sock, void *data, socketrecv read, threadcleanup cleanup);
 extern void socketserver(struct fwsocket *sock, socketrecv connectfunc, socketrecv acceptfunc, threadcleanup cleanup, void *data);
+extern int socketserver_multi(int nthreads, struct fwsocket *sock, socketrecv read, socketrecv acceptfunc, threadcleanup cleanup, void *data, int flags);
+#ifndef __WIN32
+extern int socketread_batch(struct fwsocket *sock, struct sock_datagram *dgrams, int cnt);
+extern int socketwrite_batch(struct fwsocket *sock, struct sock_datagram *dgrams, int cnt);
+extern int socketwrite_gso(struct fwsocket *sock, const void *buf, int num, int segsize, union sockstruct *addr);
+extern int socketread_gro(struct fwsocket *sock, void *buf, int num, union sockstruct *addr, int *segsize);
+extern int socketwrite_zc(struct fwsocket *sock, void *buf, int num);
+extern ssize_t socket_sendfile(struct fwsocket *sock, int fd, off_t *offset, size_t count);
+extern int socket_proxy(struct fwsocket *a, struct fwsocket *b);
+extern int socket_queue(struct fwsocket *sock, const void *buf, int num);
+extern int socket_flush(struct fwsocket *sock);
+extern size_t socket_queued(struct fwsocket *sock);
+extern void socket_sethwm(struct fwsocket *sock, size_t hwm);
+extern int socketloop_init(int loops);
+extern int socketloop_init_engine(int loops, int engine);
+extern int socketloop_engine(void);
+extern void socketloop_close(void);
+extern struct sockpool *sockpool_new(int maxidle, int idletime);
+extern struct fwsocket *sockpool_acquire(struct sockpool *pool, const char *host, const char *port, void *ssl, int timeout);
+extern void sockpool_release(struct sockpool *pool, struct fwsocket *sock, int reuse);
+extern void sockpool_purge(struct sockpool *pool);
+extern struct addrinfo *resolver_lookup(const char *host, const char *port, const struct addrinfo *hint);
+extern struct future *resolver_async(const char *host, const char *port, const struct addrinfo *hint);
+extern int resolver_init(int ttl, int negttl);
+extern void resolver_close(void);
+extern void resolver_flush(void);
+extern int socket_settimeout(struct fwsocket *sock, int idle, int read, int handshake, sockettimeout cb);
+extern int socket_setlimits(struct fwsocket *sock, int maxchildren, int maxperip);
+#endif
 struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip, const char *port, int flags);
 const char *sockaddr2ip(union sockstruct *addr, char *buf, int len);
 
@@ -596,19 +855,37 @@ extern unsigned char *radius_attr_next(struct radius_packet *packet, unsigned ch
 /*SSL Socket utilities*/
 extern void sslstartup(void);
 extern void *tlsv1_init(const char *cacert, const char *cert, const char *key, int verify);
+extern void *tls_init(const char *cacert, const char *cert, const char *key, int verify, int minver, int maxver);
 extern void *sslv2_init(const char *cacert, const char *cert, const char *key, int verify);
 extern void *sslv3_init(const char *cacert, const char *cert, const char *key, int verify);
 extern void *dtlsv1_init(const char *cacert, const char *cert, const char *key, int verify);
+extern int ssl_sessioncache(void *data, int size, int timeout, const char *path);
+extern int ssl_ticketkeys(void *data, int rotate);
+extern void ssl_ticketrotate(void *data);
+extern int ssl_sessionreuse(int size);
+extern int ssl_ktls(void *data, int enable);
+extern int socket_ktls(struct fwsocket *sock);
+extern int ssl_ciphers(void *data, const char *ciphers, const char *suites);
+extern int ssl_curves(void *data, const char *curves);
+extern int ssl_earlydata(void *data, int size);
+extern int ssl_offload(void *data, int threads);
+extern int ssl_reload(void *data, const char *cacert, const char *cert, const char *key);
+extern int ssl_reloadwatch(void *data, const char *cacert, const char *cert, const char *key);
 
 extern int socketread(struct fwsocket *sock, void *buf, int num);
+extern void *socketread_buf(struct fwsocket *sock, int size, int *len);
+extern void *socketread_buf_d(struct fwsocket *sock, int size, int *len, union sockstruct *addr);
 extern int socketwrite(struct fwsocket *sock, const void *buf, int num);
+extern int socketwrite_early(struct fwsocket *sock, const void *buf, int num);
 /*the following are only needed on server side of a dgram connection*/
 extern int socketread_d(struct fwsocket *sock, void *buf, int num, union sockstruct *addr);
 extern int socketwrite_d(struct fwsocket *sock, const void *buf, int num, union sockstruct *addr);
 
 extern void ssl_shutdown(void *ssl, int sock);
 extern void tlsaccept(struct fwsocket *sock, struct ssldata *orig);
+extern void tlsconnect(struct fwsocket *sock, struct ssldata *orig);
 extern struct fwsocket *dtls_listenssl(struct fwsocket *sock);
+extern int dtls_demux(struct fwsocket *sock, int maxpeers);
 extern void startsslclient(struct fwsocket *sock);
 
 /*config file parsing functions*/
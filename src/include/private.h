@@ -30,11 +30,81 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 void dtsl_serveropts(struct fwsocket *sock);
 void dtlshandltimeout(struct fwsocket *sock);
 
+/*DTLS servers reading all peers on one socket from sslutil.c*/
+#define DTLS_DEMUX_NONE	0
+#define DTLS_DEMUX_NEW	1
+#define DTLS_DEMUX_DATA	2
+#define DTLS_DEMUX_BUDGET	16
+int dtls_demuxed(struct fwsocket *sock);
+int dtls_demux_read(struct fwsocket *sock, struct fwsocket **peerp);
+int dtls_demux_next(struct fwsocket *sock, struct fwsocket *peer);
+void dtls_demux_close(struct fwsocket *sock, struct fwsocket *peer);
+
+/** @brief Socket handling thread data.*/
+struct socket_handler {
+	/** @brief Socket this thread manages.*/
+	struct fwsocket *sock;
+	/** @brief Reference to data passed in callbacks*/
+	void *data;
+	/** @brief Callback called when the socket is ready to read*/
+	socketrecv	client;
+	/** @brief Callback to call when the thread closes to allow
+	  * additional cleanup*/
+	threadcleanup	cleanup;
+	/** @brief If a client connects to a bound port this callback is
+	  * called on connect*/
+	socketrecv	connect;
+	/** @brief SOCK_FLAG_BIND is set if connections are accepted on the socket
+	  * SOCK_HANDLER_LOOP if it is run by a event loop*/
+	int		flags;
+};
+
+/*socket handler flag outside the range of sock_flags*/
+#define SOCK_HANDLER_LOOP	(1 << 16)
+
+/*socket flags outside the range of sock_flags the handler is run when the
+ * socket can be written and not when it can be read (socket_proxy())*/
+#define SOCK_FLAG_POLLOUT	(1 << 16)
+#define SOCK_FLAG_NOREAD	(1 << 17)
+
+/*from socket.c shared with the event loop*/
+void socket_handler_clean(void *data);
+void socket_handler_read(struct socket_handler *sockh);
+void socket_handler_close(struct socket_handler *sockh);
+int ssl_pending(struct fwsocket *sock);
+int ssl_established(struct fwsocket *sock);
+int ssl_handshake(struct fwsocket *sock);
+void tlsaccept_defer(struct fwsocket *sock, struct ssldata *orig);
+int ssl_handshake_offload(struct fwsocket *sock, struct socket_handler *sockh);
+int ssl_offloaded(struct fwsocket *sock);
+struct fwsocket *socket_peer(struct fwsocket *sock, union sockstruct *addr);
+
+/*socket stats from socket.c*/
+#define SOCK_STATS_IN	0
+#define SOCK_STATS_OUT	1
+void sockstats_io(struct fwsocket *sock, int dir, ssize_t bytes, int pkts);
+void sockstats_ssl(struct fwsocket *sock, int dir, struct timeval *start);
+#ifndef __WIN32
+int socketloop_add(struct socket_handler *sockh);
+int socketloop_wake(struct socket_handler *sockh);
+int socketloop_pollout(struct fwsocket *sock);
+void sockio_udpoffload(struct fwsocket *sock, int flags);
+int sockio_zcready(struct fwsocket *sock);
+int socktimer_accept(struct fwsocket *sock, struct fwsocket *newsock);
+void socktimer_start(struct fwsocket *sock, void *data);
+void socktimer_stop(struct fwsocket *sock);
+void socktimer_activity(struct fwsocket *sock, int dir);
+ssize_t ssl_sendfile(struct fwsocket *sock, int fd, off_t *offset, size_t count);
+#endif
+
 /*for main.c*/
 int startthreads(void);
 void jointhreads(void);
 int thread_signal(int sig);
 
+/*thread stats for callbacks*/
+void thread_countcb(void);
+
 #ifdef HAVE_LINUX_IP_H
 union l4hdr {
 	struct tcphdr tcp;
@@ -527,7 +527,7 @@ int inet_lookup(int family, const char *host, void *addr, socklen_t len) {
 	memset(&hint, 0, sizeof(hint));
 	hint.ai_family = family;
 
-	if (getaddrinfo(host, NULL, &hint, &result) || !result) {
+	if (!(result = resolver_lookup(host, NULL, &hint))) {
 		return ret;
 	}
 
@@ -552,6 +552,6 @@ int inet_lookup(int family, const char *host, void *addr, socklen_t len) {
 			break;
 		}
 	}
-	freeaddrinfo(result);
+	objunref(result);
 	return ret;
 }
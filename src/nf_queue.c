@@ -134,6 +134,7 @@ static void *nfqueue_thread(void *data) {
 		if ((FD_ISSET(nfq->fd, &act_set)) &&
 				((len = recv(nfq->fd, buf, sizeof(buf), 0)) >= 0)) {
 			objlock(nfq);
+			thread_countcb();
 			nfq_handle_packet(nfq->h, buf, len);
 			objunlock(nfq);
 		}
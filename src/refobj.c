@@ -53,6 +53,9 @@ struct ref_obj {
 	objdestroy	destroy;
 	/** @brief Pointer to the data referenced.*/
 	void		*data;
+	/** @brief Buffer pool size class plus one 0 if not pooled.
+	  * @see objalloc_buf()*/
+	int		pool;
 };
 
 /** @}*/
@@ -113,11 +116,235 @@ struct bucket_loop {
 	struct blist_obj *cur;
 };
 
+/** @ingroup LIB-OBJ-Ring
+  * @brief Size of a cache line used to pad the ring buffer indexes.*/
+#define RING_CACHELINE	64
+
+/** @ingroup LIB-OBJ-Ring
+  * @brief Slot in a ring buffer.*/
+struct ring_slot {
+	/** @brief Sequence number of the slot the producer sets this to one past
+	  * the position when filled and the consumer to the position of the next lap when emptied.*/
+	uint32_t	seq;
+	/** @brief Reference held in the slot.*/
+	void		*data;
+};
+
+/** @ingroup LIB-OBJ-Ring
+  * @brief Bounded ring buffer of references.
+  *
+  * The producer and consumer indexes are kept on seperate cache lines
+  * to prevent false sharing between the threads.*/
+struct ring_buffer {
+	/** @brief Number of slots 2^n*/
+	uint32_t	size;
+	/** @brief Mask applied to a position to obtain the slot*/
+	uint32_t	mask;
+	/** @brief Ring buffer flags.
+	  * @see ring_buffer_flags*/
+	int		flags;
+	/** @brief Array of slots*/
+	struct		ring_slot *slots;
+	/** @brief Padding to place head on its own cache line*/
+	char		pad0[RING_CACHELINE];
+	/** @brief Next position to be filled by a producer*/
+	uint32_t	head;
+	/** @brief Padding to place tail on its own cache line*/
+	char		pad1[RING_CACHELINE - sizeof(uint32_t)];
+	/** @brief Next position to be emptied by the consumer*/
+	uint32_t	tail;
+	/** @brief Padding to keep the slots off the tail cache line*/
+	char		pad2[RING_CACHELINE - sizeof(uint32_t)];
+};
+
+/** @ingroup LIB-OBJ-Buf
+  * @brief Number of buffer size classes.*/
+#define OBJBUF_CLASSES	5
+/** @ingroup LIB-OBJ-Buf
+  * @brief Smallest buffer size class as bits (256 bytes) each class is 4 times the last.*/
+#define OBJBUF_MINBITS	8
+/** @ingroup LIB-OBJ-Buf
+  * @brief Number of free buffers per class held by each thread.*/
+#define OBJBUF_CACHE	16
+/** @ingroup LIB-OBJ-Buf
+  * @brief Number of free buffers per class held in the shared pool.*/
+#define OBJBUF_SHARED	256
+
+/** @ingroup LIB-OBJ-Buf
+  * @brief Shared list of free buffers of a size class.*/
+struct objbuf_class {
+	/** @brief Lock protecting the list.*/
+	pthread_mutex_t	lock;
+	/** @brief Number of buffers in the list.*/
+	int		count;
+	/** @brief First free buffer the next is stored in the data area.*/
+	struct		ref_obj *free;
+};
+
+/** @ingroup LIB-OBJ-Buf
+  * @brief Free buffers held by a thread.*/
+struct objbuf_cache {
+	/** @brief Number of buffers held per class.*/
+	int		count[OBJBUF_CLASSES];
+	/** @brief Buffers held per class.*/
+	struct		ref_obj *free[OBJBUF_CLASSES][OBJBUF_CACHE];
+};
+
 /** @addtogroup LIB-OBJ
   * @{*/
 
 /** @brief The size of ref_obj is the offset for the data*/
-#define refobj_offset	sizeof(struct ref_obj);
+#define refobj_offset	sizeof(struct ref_obj)
+
+/** @}*/
+
+/** @addtogroup LIB-OBJ-Buf
+  * @{*/
+
+static struct objbuf_class objbuf_classes[OBJBUF_CLASSES] = {
+	{PTHREAD_MUTEX_INITIALIZER, 0, NULL},
+	{PTHREAD_MUTEX_INITIALIZER, 0, NULL},
+	{PTHREAD_MUTEX_INITIALIZER, 0, NULL},
+	{PTHREAD_MUTEX_INITIALIZER, 0, NULL},
+	{PTHREAD_MUTEX_INITIALIZER, 0, NULL}
+};
+static pthread_key_t objbuf_key;
+static pthread_once_t objbuf_once = PTHREAD_ONCE_INIT;
+
+/*the link to the next free buffer is kept in the data area*/
+#define objbuf_next(ref)	(*(struct ref_obj **)((char *)(ref) + refobj_offset))
+#define objbuf_size(cls)	(1 << (OBJBUF_MINBITS + ((cls) * 2)))
+
+static void objbuf_release(struct ref_obj *ref) {
+	struct objbuf_class *bc = &objbuf_classes[ref->pool - 1];
+
+	pthread_mutex_lock(&bc->lock);
+	if (bc->count < OBJBUF_SHARED) {
+		objbuf_next(ref) = bc->free;
+		bc->free = ref;
+		bc->count++;
+		ref = NULL;
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	if (ref) {
+		pthread_mutex_destroy(&ref->lock);
+		free(ref);
+	}
+}
+
+/*the thread is exiting give its buffers to the shared pool*/
+static void objbuf_thread_exit(void *data) {
+	struct objbuf_cache *cache = data;
+	int cls, cnt;
+
+	for(cls = 0; cls < OBJBUF_CLASSES; cls++) {
+		for(cnt = 0; cnt < cache->count[cls]; cnt++) {
+			objbuf_release(cache->free[cls][cnt]);
+		}
+	}
+	free(cache);
+}
+
+static void objbuf_init(void) {
+	pthread_key_create(&objbuf_key, objbuf_thread_exit);
+}
+
+static struct objbuf_cache *objbuf_getcache(void) {
+	struct objbuf_cache *cache;
+
+	pthread_once(&objbuf_once, objbuf_init);
+	if (!(cache = pthread_getspecific(objbuf_key)) &&
+			(cache = calloc(1, sizeof(*cache)))) {
+		pthread_setspecific(objbuf_key, cache);
+	}
+	return (cache);
+}
+
+/*place a buffer in the thread cache or the shared pool returns 0 if it must be freed*/
+static int objbuf_recycle(struct ref_obj *ref) {
+	struct objbuf_cache *cache;
+	struct objbuf_class *bc = &objbuf_classes[ref->pool - 1];
+	int cls = ref->pool - 1;
+
+	if ((cache = objbuf_getcache()) && (cache->count[cls] < OBJBUF_CACHE)) {
+		cache->free[cls][cache->count[cls]++] = ref;
+		return (1);
+	}
+
+	pthread_mutex_lock(&bc->lock);
+	if (bc->count < OBJBUF_SHARED) {
+		objbuf_next(ref) = bc->free;
+		bc->free = ref;
+		bc->count++;
+		pthread_mutex_unlock(&bc->lock);
+		return (1);
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	return (0);
+}
+
+static struct ref_obj *objbuf_get(int cls) {
+	struct objbuf_cache *cache;
+	struct objbuf_class *bc = &objbuf_classes[cls];
+	struct ref_obj *ref = NULL;
+
+	if ((cache = objbuf_getcache()) && cache->count[cls]) {
+		return (cache->free[cls][--cache->count[cls]]);
+	}
+
+	pthread_mutex_lock(&bc->lock);
+	if ((ref = bc->free)) {
+		bc->free = objbuf_next(ref);
+		bc->count--;
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	return (ref);
+}
+
+/** @brief Allocate a referenced buffer from the buffer pool.
+  *
+  * The size is rounded up to a size class (256, 1k, 4k, 16k and 64k)
+  * the buffer is returned to the pool on the last objunref() for reuse
+  * first by the thread that released it. Buffers larger than the biggest
+  * class are allocated with objalloc().
+  * @note The buffer is not zeroed use objsize() for the usable size.
+  * @param size Minimum size of the buffer.
+  * @returns Reference to a buffer at least size bytes.*/
+extern void *objalloc_buf(int size) {
+	struct ref_obj *ref;
+	int cls, asize;
+
+	for(cls = 0; (cls < OBJBUF_CLASSES) && (size > objbuf_size(cls)); cls++);
+
+	if (cls == OBJBUF_CLASSES) {
+		return objalloc(size, NULL);
+	}
+	asize = objbuf_size(cls) + refobj_offset;
+
+	if (!(ref = objbuf_get(cls))) {
+		if (!(ref = malloc(asize))) {
+			return NULL;
+		}
+		memset(ref, 0, sizeof(*ref));
+		pthread_mutex_init(&ref->lock, NULL);
+		ref->pool = cls + 1;
+	}
+
+	ref->magic = REFOBJ_MAGIC;
+	ref->cnt = 1;
+	ref->data = (char *)ref + refobj_offset;
+	ref->size = asize;
+	ref->destroy = NULL;
+	return (ref->data);
+}
+
+/** @}*/
+
+/** @addtogroup LIB-OBJ
+  * @{*/
 
 /** @brief Allocate a referenced lockable object.
   *
@@ -207,6 +434,10 @@ extern int objunref(void *data) {
 				ref->destroy(data);
 			}
 			pthread_mutex_unlock(&ref->lock);
+			/*pooled buffers keep there lock for reuse*/
+			if (ref->pool && objbuf_recycle(ref)) {
+				return (ret);
+			}
 			pthread_mutex_destroy(&ref->lock);
 			free(ref);
 		} else {
@@ -754,3 +985,187 @@ extern void remove_bucket_loop(struct bucket_loop *bloop) {
 }
 
 /** @}*/
+
+/** @addtogroup LIB-OBJ-Ring
+  * @{*/
+
+static void empty_ringbuf(void *data) {
+	struct ring_buffer *ring = data;
+	uint32_t pos;
+
+	/*the last reference is gone drop any references still queued*/
+	for(pos = ring->tail; pos != ring->head; pos++) {
+		if (ring->slots[pos & ring->mask].data) {
+			objunref(ring->slots[pos & ring->mask].data);
+		}
+	}
+}
+
+/** @brief Create a bounded lock free ring buffer.
+  *
+  * The ring buffer passes references between threads without taking a lock
+  * there may only ever be one consumer and one producer unless RING_BUFFER_MPSC
+  * is specified in which case multiple threads may add to it.
+  * @note Unreferencing the ring buffer will release any references still held.
+  * @param bits Number of slots to allocate 2^bits.
+  * @param flags Ring buffer flags.
+  * @see ring_buffer_flags
+  * @returns Reference to a empty ring buffer.*/
+extern struct ring_buffer *create_ringbuffer(int bits, int flags) {
+	struct ring_buffer *ring;
+	uint32_t cnt, size;
+
+	if ((bits < 1) || (bits > 24)) {
+		return NULL;
+	}
+	size = (1 << bits);
+
+	if (!(ring = objalloc(sizeof(*ring) + (sizeof(struct ring_slot) * size), empty_ringbuf))) {
+		return NULL;
+	}
+
+	ring->size = size;
+	ring->mask = size - 1;
+	ring->flags = flags;
+	ring->slots = (void *)((char *)ring + sizeof(*ring));
+	for(cnt = 0; cnt < size; cnt++) {
+		ring->slots[cnt].seq = cnt;
+	}
+
+	return (ring);
+}
+
+/*reserve up to cnt slots returning the first position and number reserved*/
+static int ringbuffer_reserve(struct ring_buffer *ring, int cnt, uint32_t *start) {
+	uint32_t head, tail, space;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	do {
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		space = ring->size - (head - tail);
+		if (!space) {
+			return (0);
+		}
+		if ((uint32_t)cnt > space) {
+			cnt = space;
+		}
+		if (!(ring->flags & RING_BUFFER_MPSC)) {
+			__atomic_store_n(&ring->head, head + cnt, __ATOMIC_RELAXED);
+			break;
+		}
+	} while (!__atomic_compare_exchange_n(&ring->head, &head, head + cnt, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*start = head;
+	return (cnt);
+}
+
+/** @brief Add a batch of references to a ring buffer.
+  *
+  * Ownership of the references added is passed to the ring buffer the
+  * consumer will own them once removed, references that could not be added
+  * remain the callers.
+  * @param ring Ring buffer to add too.
+  * @param data Array of references to add.
+  * @param cnt Number of references in the array.
+  * @returns Number of references added from the start of the array.*/
+extern int ringbuffer_push_batch(struct ring_buffer *ring, void **data, int cnt) {
+	struct ring_slot *slot;
+	uint32_t pos;
+	int i;
+
+	if (!ring || !data || (cnt <= 0)) {
+		return (0);
+	}
+
+	if (!(cnt = ringbuffer_reserve(ring, cnt, &pos))) {
+		return (0);
+	}
+
+	for(i = 0; i < cnt; i++) {
+		slot = &ring->slots[(pos + i) & ring->mask];
+		slot->data = data[i];
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	return (cnt);
+}
+
+/** @brief Add a reference to a ring buffer.
+  *
+  * @see ringbuffer_push_batch()
+  * @param ring Ring buffer to add too.
+  * @param data Reference to pass to the consumer.
+  * @returns 1 if the reference was added 0 if the ring is full.*/
+extern int ringbuffer_push(struct ring_buffer *ring, void *data) {
+	return (ringbuffer_push_batch(ring, &data, 1));
+}
+
+/** @brief Remove a batch of references from a ring buffer.
+  *
+  * This must only be called from the consumer thread.
+  * @note The caller owns the references returned and must unreference them.
+  * @param ring Ring buffer to empty.
+  * @param data Array to place the references in.
+  * @param cnt Maximum number to remove.
+  * @returns Number of references placed in the array.*/
+extern int ringbuffer_pop_batch(struct ring_buffer *ring, void **data, int cnt) {
+	struct ring_slot *slot;
+	uint32_t pos;
+	int i;
+
+	if (!ring || !data || (cnt <= 0)) {
+		return (0);
+	}
+
+	pos = ring->tail;
+	for(i = 0; i < cnt; i++) {
+		slot = &ring->slots[(pos + i) & ring->mask];
+		/*a producer may have reserved but not yet filled the slot*/
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i + 1) {
+			break;
+		}
+		data[i] = slot->data;
+		slot->data = NULL;
+		slot->seq = pos + i + ring->size;
+	}
+
+	if (i) {
+		__atomic_store_n(&ring->tail, pos + i, __ATOMIC_RELEASE);
+	}
+
+	return (i);
+}
+
+/** @brief Remove a reference from a ring buffer.
+  *
+  * @see ringbuffer_pop_batch()
+  * @param ring Ring buffer to remove from.
+  * @returns Reference that must be unreferenced or NULL if empty.*/
+extern void *ringbuffer_pop(struct ring_buffer *ring) {
+	void *data;
+
+	if (!ringbuffer_pop_batch(ring, &data, 1)) {
+		return (NULL);
+	}
+	return (data);
+}
+
+/** @brief Return the number of references queued.
+  *
+  * @note The count is only a snapshot and may change immediately.
+  * @param ring Ring buffer.
+  * @returns Number of references in the ring buffer.*/
+extern int ringbuffer_count(struct ring_buffer *ring) {
+	uint32_t head, tail;
+
+	if (!ring) {
+		return (0);
+	}
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	return (head - tail);
+}
+
+/** @}*/
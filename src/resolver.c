@@ -0,0 +1,515 @@
+/*
+Copyright (C) 2012  Gregory Nietsky <gregory@distrotetch.co.za>
+        http://www.distrotech.co.za
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @addtogroup LIB-Sock-Resolv
+  * @{
+  *
+  * @file
+  * @brief Cache of getaddrinfo() results with a helper thread for lookups.
+  *
+  * Results are copied into a single reference counted block so a cached
+  * result can be used by many callers at once, failed lookups are cached
+  * for a shorter time. The socket functions use resolver_lookup() so once
+  * resolver_init() has been called connecting to a host already looked up
+  * does not block.*/
+
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "include/dtsapp.h"
+
+/** @brief Maximum number of entries in the cache.*/
+#define RESOLV_MAX	1024
+/** @brief Number of lookups that can be queued for the helper thread as bits (256).*/
+#define RESOLV_QUEUE	8
+
+/** @brief Resolver flags.*/
+enum resolver_flags {
+	/** @brief The helper thread has been asked to stop.*/
+	RESOLV_FLAG_STOP	= 1 << 0
+};
+
+/** @brief Cached lookup.*/
+struct resolv_entry {
+	/** @brief Key made of the hints host and port.*/
+	char *name;
+	/** @brief Reference to the result NULL if the lookup failed.*/
+	struct addrinfo *result;
+	/** @brief Monotonic time the entry expires.*/
+	time_t expires;
+};
+
+/** @brief Lookup queued for the helper thread.*/
+struct resolv_req {
+	/** @brief Host to lookup.*/
+	char *host;
+	/** @brief Port or service.*/
+	char *port;
+	/** @brief Lookup hints.*/
+	struct addrinfo hint;
+	/** @brief Future completed with the result.*/
+	struct future *future;
+};
+
+/** @brief Resolver cache and helper thread.*/
+struct resolver {
+	/** @brief Bucket list of cached entries.*/
+	struct bucket_list *cache;
+	/** @brief Lookups waiting for the helper thread.*/
+	struct ring_buffer *queue;
+	/** @brief Seconds a result is cached.*/
+	int ttl;
+	/** @brief Seconds a failed lookup is cached.*/
+	int negttl;
+	/** @brief Resolver flags.
+	  * @see resolver_flags*/
+	int flags;
+	/** @brief Lock protecting the condition.*/
+	pthread_mutex_t lock;
+	/** @brief Signaled when a lookup is queued.*/
+	pthread_cond_t cond;
+};
+
+static struct resolver *resolver = NULL;
+
+static time_t resolv_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+static int32_t hash_entry(const void *data, int key) {
+	const struct resolv_entry *ent = data;
+	const char *name = (key) ? data : ent->name;
+
+	return jenhash(name, strlen(name), 0);
+}
+
+static void free_entry(void *data) {
+	struct resolv_entry *ent = data;
+
+	if (ent->name) {
+		free(ent->name);
+	}
+	if (ent->result) {
+		objunref(ent->result);
+	}
+}
+
+static void free_req(void *data) {
+	struct resolv_req *req = data;
+
+	if (req->host) {
+		free(req->host);
+	}
+	if (req->port) {
+		free(req->port);
+	}
+	if (req->future) {
+		objunref(req->future);
+	}
+}
+
+static void free_resolver(void *data) {
+	struct resolver *res = data;
+
+	if (res->queue) {
+		objunref(res->queue);
+	}
+	if (res->cache) {
+		objunref(res->cache);
+	}
+	pthread_cond_destroy(&res->cond);
+	pthread_mutex_destroy(&res->lock);
+}
+
+/*copy the list into one block the addresses following the array*/
+static struct addrinfo *resolv_copy(struct addrinfo *result) {
+	struct addrinfo *rp, *ai;
+	struct sockaddr_storage *sa;
+	int cnt, i;
+
+	for(cnt = 0, rp = result; rp; rp = rp->ai_next) {
+		cnt++;
+	}
+
+	if (!cnt || !(ai = objalloc((sizeof(*ai) + sizeof(*sa)) * cnt, NULL))) {
+		return NULL;
+	}
+	sa = (struct sockaddr_storage *)&ai[cnt];
+
+	for(i = 0, rp = result; rp; rp = rp->ai_next, i++) {
+		ai[i] = *rp;
+		ai[i].ai_canonname = NULL;
+		ai[i].ai_addrlen = (rp->ai_addrlen > sizeof(*sa)) ? sizeof(*sa) : rp->ai_addrlen;
+		ai[i].ai_addr = (struct sockaddr *)&sa[i];
+		memcpy(ai[i].ai_addr, rp->ai_addr, ai[i].ai_addrlen);
+		ai[i].ai_next = (i + 1 < cnt) ? &ai[i + 1] : NULL;
+	}
+
+	return (ai);
+}
+
+static void resolv_key(char *buf, int len, const char *host, const char *port, const struct addrinfo *hint) {
+	snprintf(buf, len, "%i/%i/%i/%i/%s/%s", hint->ai_family, hint->ai_socktype, hint->ai_protocol,
+				hint->ai_flags, (host) ? host : "", (port) ? port : "");
+}
+
+/*find a entry that has not expired a expired entry is removed*/
+static struct resolv_entry *resolv_find(struct resolver *res, const char *name) {
+	struct resolv_entry *ent;
+
+	if (!(ent = bucket_list_find_key(res->cache, name))) {
+		return NULL;
+	}
+
+	if (ent->expires <= resolv_now()) {
+		remove_bucket_item(res->cache, ent);
+		objunref(ent);
+		return NULL;
+	}
+	return (ent);
+}
+
+static void resolv_expire(struct resolver *res) {
+	struct resolv_entry *ent;
+	struct bucket_loop *bloop;
+	time_t now = resolv_now();
+
+	bloop = init_bucket_loop(res->cache);
+	while(bloop && (ent = next_bucket_loop(bloop))) {
+		if (ent->expires <= now) {
+			remove_bucket_loop(bloop);
+		}
+		objunref(ent);
+	}
+	objunref(bloop);
+}
+
+static void resolv_add(struct resolver *res, const char *name, struct addrinfo *result) {
+	struct resolv_entry *ent, *old;
+	int ttl = (result) ? res->ttl : res->negttl;
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	if (bucket_list_cnt(res->cache) >= RESOLV_MAX) {
+		resolv_expire(res);
+		if (bucket_list_cnt(res->cache) >= RESOLV_MAX) {
+			return;
+		}
+	}
+
+	if (!(ent = objalloc(sizeof(*ent), free_entry))) {
+		return;
+	}
+
+	if (!(ent->name = strdup(name))) {
+		objunref(ent);
+		return;
+	}
+	ent->result = (result && objref(result)) ? result : NULL;
+	ent->expires = resolv_now() + ttl;
+
+	/*a concurrent lookup may have added the same key*/
+	if ((old = bucket_list_find_key(res->cache, name))) {
+		remove_bucket_item(res->cache, old);
+		objunref(old);
+	}
+	addtobucket(res->cache, ent);
+	objunref(ent);
+}
+
+static struct addrinfo *resolv_getaddrinfo(const char *host, const char *port, const struct addrinfo *hint) {
+	struct addrinfo *result, *ai;
+
+	if (getaddrinfo(host, port, hint, &result) || !result) {
+		return NULL;
+	}
+
+	ai = resolv_copy(result);
+	freeaddrinfo(result);
+
+	return (ai);
+}
+
+/** @brief Lookup a host and port using the cache.
+  *
+  * This is a replacement for getaddrinfo() if the cache is running
+  * (resolver_init()) and has a result it is returned without blocking
+  * else getaddrinfo() is called and the result cached. A failure is cached
+  * for a shorter time.
+  * @note ai_canonname is not available.
+  * @param host Host name or address may be NULL with AI_PASSIVE.
+  * @param port Port or service name.
+  * @param hint Lookup hints as for getaddrinfo() may be NULL.
+  * @returns Reference to a addrinfo list that must be unreferenced or NULL on failure.*/
+extern struct addrinfo *resolver_lookup(const char *host, const char *port, const struct addrinfo *hint) {
+	struct resolver *res;
+	struct resolv_entry *ent;
+	struct addrinfo nohint, *ai;
+	char name[320];
+
+	if (!hint) {
+		memset(&nohint, 0, sizeof(nohint));
+		nohint.ai_family = PF_UNSPEC;
+		hint = &nohint;
+	}
+
+	if (!(res = (objref(resolver)) ? resolver : NULL)) {
+		return resolv_getaddrinfo(host, port, hint);
+	}
+
+	resolv_key(name, sizeof(name), host, port, hint);
+	if ((ent = resolv_find(res, name))) {
+		ai = (ent->result && objref(ent->result)) ? ent->result : NULL;
+		objunref(ent);
+		objunref(res);
+		return (ai);
+	}
+
+	ai = resolv_getaddrinfo(host, port, hint);
+	resolv_add(res, name, ai);
+	objunref(res);
+
+	return (ai);
+}
+
+static void resolv_complete(struct resolv_req *req) {
+	struct addrinfo *ai;
+
+	ai = resolver_lookup(req->host, req->port, &req->hint);
+	future_set(req->future, ai);
+	if (ai) {
+		objunref(ai);
+	}
+}
+
+static void *resolv_thread(void *data) {
+	struct resolver *res = data;
+	struct resolv_req *req;
+	struct timespec ts;
+	struct timeval tv;
+
+	while(framework_threadok() && !testflag(res, RESOLV_FLAG_STOP)) {
+		if ((req = ringbuffer_pop(res->queue))) {
+			resolv_complete(req);
+			objunref(req);
+			continue;
+		}
+
+		/*wake at least once a second to check if we must stop*/
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + 1;
+		ts.tv_nsec = tv.tv_usec * 1000;
+
+		pthread_mutex_lock(&res->lock);
+		if (!ringbuffer_count(res->queue) && !testflag(res, RESOLV_FLAG_STOP)) {
+			pthread_cond_timedwait(&res->cond, &res->lock, &ts);
+		}
+		pthread_mutex_unlock(&res->lock);
+	}
+
+	return NULL;
+}
+
+/*complete what is left in the queue with no result*/
+static void resolv_clean(void *data) {
+	struct resolver *res = data;
+	struct resolv_req *req;
+
+	while((req = ringbuffer_pop(res->queue))) {
+		future_set(req->future, NULL);
+		objunref(req);
+	}
+}
+
+/** @brief Start the resolver cache and its helper thread.
+  *
+  * @note If the cache is running the TTL's are updated.
+  * @param ttl Seconds a result is cached.
+  * @param negttl Seconds a failed lookup is cached 0 to not cache failures.
+  * @returns 0 on failure.*/
+extern int resolver_init(int ttl, int negttl) {
+	struct resolver *res;
+	struct thread_attr attr;
+	struct thread_pvt *thread;
+
+	if ((res = (objref(resolver)) ? resolver : NULL)) {
+		objlock(res);
+		res->ttl = ttl;
+		res->negttl = negttl;
+		objunlock(res);
+		objunref(res);
+		return (1);
+	}
+
+	if (!(res = objalloc(sizeof(*res), free_resolver))) {
+		return (0);
+	}
+	pthread_mutex_init(&res->lock, NULL);
+	pthread_cond_init(&res->cond, NULL);
+	res->ttl = ttl;
+	res->negttl = negttl;
+
+	if (!(res->cache = create_bucketlist(6, hash_entry)) ||
+			!(res->queue = create_ringbuffer(RESOLV_QUEUE, RING_BUFFER_MPSC))) {
+		objunref(res);
+		return (0);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.name = "resolver";
+
+	/*the thread holds its own reference*/
+	if (!(thread = framework_mkthread_attr(resolv_thread, resolv_clean, NULL, res, THREAD_OPTION_RETURN, &attr))) {
+		objunref(res);
+		return (0);
+	}
+	objunref(thread);
+
+	resolver = res;
+	return (1);
+}
+
+/** @brief Stop the helper thread and drop the cache.
+  *
+  * Lookups still queued complete with no result.*/
+extern void resolver_close(void) {
+	struct resolver *res;
+	int drop = 0;
+
+	if (!(res = (objref(resolver)) ? resolver : NULL)) {
+		return;
+	}
+
+	objlock(res);
+	if (resolver == res) {
+		resolver = NULL;
+		drop = 1;
+	}
+	objunlock(res);
+
+	if (drop) {
+		objunref(res);
+	}
+
+	setflag(res, RESOLV_FLAG_STOP);
+	pthread_mutex_lock(&res->lock);
+	pthread_cond_signal(&res->cond);
+	pthread_mutex_unlock(&res->lock);
+	objunref(res);
+}
+
+/** @brief Remove all entries from the cache.*/
+extern void resolver_flush(void) {
+	struct resolver *res;
+	struct resolv_entry *ent;
+	struct bucket_loop *bloop;
+
+	if (!(res = (objref(resolver)) ? resolver : NULL)) {
+		return;
+	}
+
+	bloop = init_bucket_loop(res->cache);
+	while(bloop && (ent = next_bucket_loop(bloop))) {
+		remove_bucket_loop(bloop);
+		objunref(ent);
+	}
+	objunref(bloop);
+	objunref(res);
+}
+
+/** @brief Lookup a host and port on the helper thread.
+  *
+  * A cached result completes the future immediately else the lookup
+  * is done by the resolver thread and cached.
+  * @see future_wait()
+  * @see future_then()
+  * @param host Host name or address.
+  * @param port Port or service name.
+  * @param hint Lookup hints as for getaddrinfo() may be NULL.
+  * @returns Reference to a future completed with a addrinfo reference or NULL on failure.*/
+extern struct future *resolver_async(const char *host, const char *port, const struct addrinfo *hint) {
+	struct resolver *res;
+	struct resolv_entry *ent;
+	struct resolv_req *req;
+	struct future *future;
+	char name[320];
+
+	if (!(res = (objref(resolver)) ? resolver : NULL)) {
+		return NULL;
+	}
+
+	if (!(future = future_new())) {
+		objunref(res);
+		return NULL;
+	}
+
+	if (!(req = objalloc(sizeof(*req), free_req))) {
+		objunref(future);
+		objunref(res);
+		return NULL;
+	}
+
+	if (hint) {
+		req->hint = *hint;
+		req->hint.ai_addr = NULL;
+		req->hint.ai_canonname = NULL;
+		req->hint.ai_next = NULL;
+	} else {
+		req->hint.ai_family = PF_UNSPEC;
+	}
+
+	resolv_key(name, sizeof(name), host, port, &req->hint);
+	if ((ent = resolv_find(res, name))) {
+		future_set(future, ent->result);
+		objunref(ent);
+		objunref(req);
+		objunref(res);
+		return (future);
+	}
+
+	req->host = (host) ? strdup(host) : NULL;
+	req->port = (port) ? strdup(port) : NULL;
+	req->future = (objref(future)) ? future : NULL;
+
+	if ((host && !req->host) || (port && !req->port) || !ringbuffer_push(res->queue, req)) {
+		objunref(req);
+		objunref(future);
+		objunref(res);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&res->lock);
+	pthread_cond_signal(&res->cond);
+	pthread_mutex_unlock(&res->lock);
+	objunref(res);
+
+	return (future);
+}
+
+/** @}*/
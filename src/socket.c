@@ -29,7 +29,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #ifndef __WIN32__
 #include <netdb.h>
+#include <poll.h>
+#include <linux/filter.h>
 #endif
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -47,21 +50,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "include/dtsapp.h"
 #include "include/private.h"
 
-/** @brief Socket handling thread data.*/
-struct socket_handler {
-	/** @brief Socket this thread manages.*/
-	struct fwsocket *sock;
-	/** @brief Reference to data passed in callbacks*/
-	void *data;
-	/** @brief Callback called when the socket is ready to read*/
-	socketrecv	client;
-	/** @brief Callback to call when the thread closes to allow
-	  * additional cleanup*/
-	threadcleanup	cleanup;
-	/** @brief If a client connects to a bound port this callback is
-	  * called on connect*/
-	socketrecv	connect;
-};
+/** @brief Delay in ms before the next address is tried while connecting (RFC 8305).*/
+#define CONNECT_ATTEMPT_DELAY	250
+/** @brief Maximum number of addresses tried while connecting.*/
+#define CONNECT_MAX_ATTEMPTS	16
+/** @brief Interval in ms the DTLS timers of a server thread are run.*/
+#define SOCKET_DTLS_TICK	20
+
+/*lookups use the resolver cache where it is available*/
+static int _getaddrinfo(const char *host, const char *port, const struct addrinfo *hint, struct addrinfo **result) {
+#ifndef __WIN32__
+	return (!(*result = resolver_lookup(host, port, hint)));
+#else
+	return (getaddrinfo(host, port, hint, result) || !*result);
+#endif
+}
+
+static void _freeaddrinfo(struct addrinfo *result) {
+#ifndef __WIN32__
+	objunref(result);
+#else
+	freeaddrinfo(result);
+#endif
+}
 
 static int32_t hash_socket(const void *data, int key) {
 	int ret;
@@ -73,6 +84,77 @@ static int32_t hash_socket(const void *data, int key) {
 	return (ret);
 }
 
+static uint64_t sockstats_since(struct timeval *start) {
+	struct timeval now;
+	int64_t usec;
+
+	gettimeofday(&now, NULL);
+	usec = ((int64_t)(now.tv_sec - start->tv_sec) * 1000000) + (now.tv_usec - start->tv_usec);
+
+	return ((usec > 0) ? usec : 0);
+}
+
+/*count a read or write the error is taken from errno if bytes is negative*/
+void sockstats_io(struct fwsocket *sock, int dir, ssize_t bytes, int pkts) {
+	struct sock_stats *st = sock->stats;
+
+#ifndef __WIN32
+	/*activity resets the socket timeouts*/
+	if (sock->timer && (bytes > 0)) {
+		socktimer_activity(sock, dir);
+	}
+#endif
+
+	if (!st) {
+		return;
+	}
+
+	__atomic_fetch_add((dir == SOCK_STATS_OUT) ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+	if (bytes < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			__atomic_fetch_add(&st->eagain, 1, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+
+	if (dir == SOCK_STATS_OUT) {
+		__atomic_fetch_add(&st->bytes_out, bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->pkts_out, pkts, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&st->bytes_in, bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->pkts_in, pkts, __ATOMIC_RELAXED);
+	}
+}
+
+/*time spent in SSL start is not set if stats were enabled after the call*/
+void sockstats_ssl(struct fwsocket *sock, int dir, struct timeval *start) {
+	struct sock_stats *st = sock->stats;
+
+	if (!st || !start->tv_sec) {
+		return;
+	}
+
+	__atomic_fetch_add((dir == SOCK_STATS_OUT) ? &st->ssl_write_usec : &st->ssl_read_usec,
+				sockstats_since(start), __ATOMIC_RELAXED);
+}
+
+static void sockstats_callback(struct fwsocket *sock, struct timeval *start) {
+	struct sock_stats *st = sock->stats;
+	uint64_t usec;
+	int bucket;
+
+	if (!st || !start->tv_sec) {
+		return;
+	}
+
+	usec = sockstats_since(start);
+	for(bucket = 0; (bucket < SOCK_STATS_HIST - 1) && (usec >> (bucket + 1)); bucket++);
+
+	__atomic_fetch_add(&st->callbacks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->cb_usec, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->cb_hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
 /** @brief Mark the socket for closure and release the reference.
   *
   * @param sock Socket to close.*/
@@ -103,6 +185,22 @@ static void clean_fwsocket(void *data) {
 		objunref(sock->children);
 	}
 
+	if (sock->stats) {
+		objunref(sock->stats);
+	}
+
+	if (sock->zerocopy) {
+		objunref(sock->zerocopy);
+	}
+
+	if (sock->outq) {
+		objunref(sock->outq);
+	}
+
+	if (sock->timer) {
+		objunref(sock->timer);
+	}
+
 	if (sock->sock >= 0) {
 		close(sock->sock);
 	}
@@ -138,10 +236,30 @@ extern struct fwsocket *make_socket(int family, int type, int proto, void *ssl)
 	return (si);
 }
 
-/** @brief Create and return a socket structure from accept()
-  * @param sock Reference to the socket its accepted on.
+/** @brief Create a socket for a peer that shares the socket of its server.
+  *
+  * The socket has no descriptor datagrams to and from the peer are
+  * sent and received on the servers socket.
+  * @param sock Server socket.
+  * @param addr Address of the peer.
   * @return Reference to new socket.*/
-extern struct fwsocket *accept_socket(struct fwsocket *sock) {
+struct fwsocket *socket_peer(struct fwsocket *sock, union sockstruct *addr) {
+	struct fwsocket *si;
+
+	if (!(si = objalloc(sizeof(*si),clean_fwsocket))) {
+		return NULL;
+	}
+
+	si->sock = -1;
+	si->type = sock->type;
+	si->proto = sock->proto;
+	memcpy(&si->addr, addr, sizeof(si->addr));
+
+	return (si);
+}
+
+/*the handler defers the TLS handshake direct callers block in SSL_accept()*/
+static struct fwsocket *_accept_socket(struct fwsocket *sock, int defer) {
 	struct fwsocket *si;
 	socklen_t salen = sizeof(si->addr);
 
@@ -159,7 +277,9 @@ extern struct fwsocket *accept_socket(struct fwsocket *sock) {
 	si->type = sock->type;
 	si->proto = sock->proto;
 
-	if (sock->ssl) {
+	if (sock->ssl && defer) {
+		tlsaccept_defer(si, sock->ssl);
+	} else if (sock->ssl) {
 		tlsaccept(si, sock->ssl);
 	}
 	objunlock(sock);
@@ -167,7 +287,150 @@ extern struct fwsocket *accept_socket(struct fwsocket *sock) {
 	return (si);
 }
 
-static struct fwsocket *_opensocket(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl, int ctype, int backlog) {
+/** @brief Create and return a socket structure from accept()
+  *
+  * The TLS handshake of a SSL server completes before returning.
+  * @param sock Reference to the socket its accepted on.
+  * @return Reference to new socket.*/
+extern struct fwsocket *accept_socket(struct fwsocket *sock) {
+	return (_accept_socket(sock, 0));
+}
+
+#ifndef __WIN32__
+/*start a non blocking connect returns 1 if connected 0 in progress -1 failed*/
+static int _connect_start(struct addrinfo *rp, struct fwsocket **sockp) {
+	struct fwsocket *sock;
+
+	*sockp = NULL;
+	if (!(sock = make_socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol, NULL))) {
+		return (-1);
+	}
+
+	fcntl(sock->sock, F_SETFL, fcntl(sock->sock, F_GETFL) | O_NONBLOCK);
+
+	if (!connect(sock->sock, rp->ai_addr, rp->ai_addrlen)) {
+		*sockp = sock;
+		return (1);
+	} else if (errno == EINPROGRESS) {
+		*sockp = sock;
+		return (0);
+	}
+
+	objunref(sock);
+	return (-1);
+}
+
+static int _connect_elapsed(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (((now.tv_sec - start->tv_sec) * 1000) + ((now.tv_usec - start->tv_usec) / 1000));
+}
+
+/* race connections to the addresses alternating address families
+ * starting a new attempt every CONNECT_ATTEMPT_DELAY ms (RFC 8305)*/
+static struct fwsocket *_connect_race(struct addrinfo *result, int timeout) {
+	struct addrinfo *pref[CONNECT_MAX_ATTEMPTS], *other[CONNECT_MAX_ATTEMPTS];
+	struct addrinfo *cand[CONNECT_MAX_ATTEMPTS], *rp;
+	struct fwsocket *socks[CONNECT_MAX_ATTEMPTS];
+	struct pollfd pfd[CONNECT_MAX_ATTEMPTS];
+	struct fwsocket *sock = NULL;
+	struct timeval start, next;
+	int pcnt = 0, ocnt = 0, cnt = 0, started = 0, active = 0;
+	int i, wait, err, elapsed;
+	socklen_t errlen;
+
+	/*interleave the families starting with the preferred (first) one*/
+	for(rp = result; rp; rp = rp->ai_next) {
+		if ((rp->ai_family == result->ai_family) && (pcnt < CONNECT_MAX_ATTEMPTS)) {
+			pref[pcnt++] = rp;
+		} else if ((rp->ai_family != result->ai_family) && (ocnt < CONNECT_MAX_ATTEMPTS)) {
+			other[ocnt++] = rp;
+		}
+	}
+	for(i = 0; (cnt < CONNECT_MAX_ATTEMPTS) && ((i < pcnt) || (i < ocnt)); i++) {
+		if (i < pcnt) {
+			cand[cnt++] = pref[i];
+		}
+		if ((i < ocnt) && (cnt < CONNECT_MAX_ATTEMPTS)) {
+			cand[cnt++] = other[i];
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	next = start;
+	while(!sock) {
+		/*start the next attempt if its time or nothing is in progress*/
+		if ((started < cnt) && (!active || (_connect_elapsed(&next) >= CONNECT_ATTEMPT_DELAY))) {
+			switch(_connect_start(cand[started], &socks[started])) {
+				case 1:
+					sock = socks[started];
+					socks[started] = NULL;
+					break;
+				case 0:
+					active++;
+					break;
+			}
+			pfd[started].fd = (socks[started]) ? socks[started]->sock : -1;
+			pfd[started].events = POLLOUT;
+			pfd[started].revents = 0;
+			started++;
+			gettimeofday(&next, NULL);
+			continue;
+		}
+
+		if (!active) {
+			break;
+		}
+
+		elapsed = _connect_elapsed(&start);
+		if ((timeout >= 0) && (elapsed >= timeout)) {
+			break;
+		}
+		wait = (started < cnt) ? CONNECT_ATTEMPT_DELAY - _connect_elapsed(&next) : -1;
+		if ((timeout >= 0) && ((wait < 0) || (wait > (timeout - elapsed)))) {
+			wait = timeout - elapsed;
+		}
+		if (wait < 0 && (started < cnt)) {
+			wait = 0;
+		}
+
+		if (poll(pfd, started, wait) <= 0) {
+			continue;
+		}
+
+		for(i = 0; i < started; i++) {
+			if (!socks[i] || !pfd[i].revents) {
+				continue;
+			}
+			errlen = sizeof(err);
+			if (!sock && !getsockopt(socks[i]->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) && !err) {
+				sock = socks[i];
+			} else {
+				objunref(socks[i]);
+			}
+			socks[i] = NULL;
+			pfd[i].fd = -1;
+			active--;
+		}
+	}
+
+	/*close the attempts that lost*/
+	for(i = 0; i < started; i++) {
+		if (socks[i]) {
+			objunref(socks[i]);
+		}
+	}
+
+	if (sock) {
+		fcntl(sock->sock, F_SETFL, fcntl(sock->sock, F_GETFL) & ~O_NONBLOCK);
+	}
+
+	return (sock);
+}
+#endif
+
+static struct fwsocket *_opensocket(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl, int ctype, int backlog, int timeout) {
 	struct	addrinfo hint, *result, *rp;
 	struct fwsocket *sock = NULL;
 	socklen_t salen = sizeof(union sockstruct);
@@ -180,12 +443,30 @@ static struct fwsocket *_opensocket(int family, int stype, int proto, const char
 	hint.ai_socktype = stype;
 	hint.ai_protocol = proto;
 
-	if (getaddrinfo(ipaddr, port, &hint, &result) || !result) {
+	/*the socket takes the reference to ssl it is released on failure*/
+	if (_getaddrinfo(ipaddr, port, &hint, &result)) {
+		if (ssl) {
+			objunref(ssl);
+		}
 		return (NULL);
 	}
 
-	for(rp = result; rp; rp = result->ai_next) {
-		if (!(sock = make_socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol, ssl))) {
+#ifndef __WIN32__
+	if (!ctype) {
+		sock = _connect_race(result, timeout);
+		_freeaddrinfo(result);
+		if (sock) {
+			sock->ssl = ssl;
+			getsockname(sock->sock, &sock->addr.sa, &salen);
+		} else if (ssl) {
+			objunref(ssl);
+		}
+		return (sock);
+	}
+#endif
+
+	for(rp = result; rp; rp = rp->ai_next) {
+		if (!(sock = make_socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol, NULL))) {
 			continue;
 		}
 		if (ctype) {
@@ -211,15 +492,20 @@ static struct fwsocket *_opensocket(int family, int stype, int proto, const char
 		if (sock) {
 			objunref(sock);
 		}
-		freeaddrinfo(result);
+		if (ssl) {
+			objunref(ssl);
+		}
+		_freeaddrinfo(result);
 
 		return (NULL);
 	}
 
+	/*only the socket used takes the ssl reference*/
+	sock->ssl = ssl;
 
 	if (ctype) {
 		sock->flags |= SOCK_FLAG_BIND;
-		memcpy(&sock->addr.ss, rp->ai_addr, sizeof(sock->addr.ss));
+		memcpy(&sock->addr.ss, rp->ai_addr, rp->ai_addrlen);
 		switch(sock->type) {
 			case SOCK_STREAM:
 			case SOCK_SEQPACKET:
@@ -232,7 +518,7 @@ static struct fwsocket *_opensocket(int family, int stype, int proto, const char
 		getsockname(sock->sock, &sock->addr.sa, &salen);
 	}
 
-	freeaddrinfo(result);
+	_freeaddrinfo(result);
 	return (sock);
 }
 
@@ -248,7 +534,26 @@ static struct fwsocket *_opensocket(int family, int stype, int proto, const char
   * @param ssl SSL structure to associate with socket.
   * @returns Reference to socket structure.*/
 extern struct fwsocket *sockconnect(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl) {
-	return(_opensocket(family, stype, proto, ipaddr, port, ssl, 0, 0));
+	return(_opensocket(family, stype, proto, ipaddr, port, ssl, 0, 0, -1));
+}
+
+/** @brief Generic client socket with a connect timeout.
+  *
+  * Connections are attempted to each address the host resolves too
+  * alternating between IPv6 and IPv4 starting a new attempt every 250ms
+  * until one connects, the first to connect is returned (RFC 8305).
+  * @note On Win32 the addresses are tried in turn without a timeout.
+  * @see sockconnect
+  * @param family Protocol family.
+  * @param stype Socket type.
+  * @param proto Socket protocol.
+  * @param ipaddr Ipaddr to connect too.
+  * @param port Port to connect too.
+  * @param ssl SSL structure to associate with socket.
+  * @param timeout Time in ms to wait for a connection -1 to wait for the kernel to give up.
+  * @returns Reference to socket structure.*/
+extern struct fwsocket *sockconnect_timeout(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl, int timeout) {
+	return(_opensocket(family, stype, proto, ipaddr, port, ssl, 0, 0, timeout));
 }
 
 /** @brief UDP Socket client.
@@ -260,7 +565,27 @@ extern struct fwsocket *sockconnect(int family, int stype, int proto, const char
   * @param ssl SSL structure to associate with socket.
   * @returns Reference to socket structure.*/
 extern struct fwsocket *udpconnect(const char *ipaddr, const char *port, void *ssl) {
-	return (_opensocket(PF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP, ipaddr, port, ssl, 0, 0));
+	return (_opensocket(PF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP, ipaddr, port, ssl, 0, 0, -1));
+}
+
+/** @brief UDP Socket client with segmentation offload.
+  *
+  * @see udpconnect
+  * @see socketwrite_gso
+  * @see socketread_gro
+  * @param ipaddr Ipaddr to connect too.
+  * @param port Port to connect too.
+  * @param ssl SSL structure to associate with socket.
+  * @param flags SOCK_FLAG_GSO and or SOCK_FLAG_GRO (Linux only).
+  * @returns Reference to socket structure.*/
+extern struct fwsocket *udpconnect_flags(const char *ipaddr, const char *port, void *ssl, int flags) {
+	struct fwsocket *sock;
+
+	sock = _opensocket(PF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP, ipaddr, port, ssl, 0, 0, -1);
+#ifndef __WIN32
+	sockio_udpoffload(sock, flags);
+#endif
+	return (sock);
 }
 
 /** @brief TCP Socket client.
@@ -272,7 +597,20 @@ extern struct fwsocket *udpconnect(const char *ipaddr, const char *port, void *s
   * @param ssl SSL structure to associate with socket.
   * @returns Reference to socket structure.*/
 extern struct fwsocket *tcpconnect(const char *ipaddr, const char *port, void *ssl) {
-	return (_opensocket(PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, ipaddr, port, ssl, 0, 0));
+	return (_opensocket(PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, ipaddr, port, ssl, 0, 0, -1));
+}
+
+/** @brief TCP Socket client with a connect timeout.
+  *
+  * @see sockconnect_timeout
+  * @see tcpconnect
+  * @param ipaddr Ipaddr to connect too.
+  * @param port Port to connect too.
+  * @param ssl SSL structure to associate with socket.
+  * @param timeout Time in ms to wait for a connection -1 to wait for the kernel to give up.
+  * @returns Reference to socket structure.*/
+extern struct fwsocket *tcpconnect_timeout(const char *ipaddr, const char *port, void *ssl, int timeout) {
+	return (_opensocket(PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, ipaddr, port, ssl, 0, 0, timeout));
 }
 
 /** @brief Generic server socket.
@@ -288,7 +626,7 @@ extern struct fwsocket *tcpconnect(const char *ipaddr, const char *port, void *s
   * @param backlog Connection backlog passed to listen.
   * @returns Reference to socket structure.*/
 extern struct fwsocket *sockbind(int family, int stype, int proto, const char *ipaddr, const char *port, void *ssl, int backlog) {
-	return(_opensocket(family, stype, proto, ipaddr, port, ssl, 1, backlog));
+	return(_opensocket(family, stype, proto, ipaddr, port, ssl, 1, backlog, -1));
 }
 
 /** @brief UDP server socket.
@@ -300,7 +638,27 @@ extern struct fwsocket *sockbind(int family, int stype, int proto, const char *i
   * @param ssl SSL structure to associate with socket.
   * @returns Reference to socket structure.*/
 extern struct fwsocket *udpbind(const char *ipaddr, const char *port, void *ssl) {
-	return (_opensocket(PF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP, ipaddr, port, ssl, 1, 0));
+	return (_opensocket(PF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP, ipaddr, port, ssl, 1, 0, -1));
+}
+
+/** @brief UDP server socket with segmentation offload.
+  *
+  * @see udpbind
+  * @see socketwrite_gso
+  * @see socketread_gro
+  * @param ipaddr Ipaddr to connect too.
+  * @param port Port to connect too.
+  * @param ssl SSL structure to associate with socket.
+  * @param flags SOCK_FLAG_GSO and or SOCK_FLAG_GRO (Linux only).
+  * @returns Reference to socket structure.*/
+extern struct fwsocket *udpbind_flags(const char *ipaddr, const char *port, void *ssl, int flags) {
+	struct fwsocket *sock;
+
+	sock = _opensocket(PF_UNSPEC, SOCK_DGRAM, IPPROTO_UDP, ipaddr, port, ssl, 1, 0, -1);
+#ifndef __WIN32
+	sockio_udpoffload(sock, flags);
+#endif
+	return (sock);
 }
 
 /** @brief Generic server socket.
@@ -313,10 +671,12 @@ extern struct fwsocket *udpbind(const char *ipaddr, const char *port, void *ssl)
   * @param backlog Connection backlog passed to listen.
   * @returns Reference to socket structure.*/
 extern struct fwsocket *tcpbind(const char *ipaddr, const char *port, void *ssl, int backlog) {
-	return (_opensocket(PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, ipaddr, port, ssl, 1, backlog));
+	return (_opensocket(PF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, ipaddr, port, ssl, 1, backlog, -1));
 }
 
-static void _socket_handler_clean(void *data) {
+/** @brief Call the cleanup callback and release the data reference.
+  * @param data Socket handler.*/
+void socket_handler_clean(void *data) {
 	struct socket_handler *fwsel = data;
 
 	/*call cleanup and remove refs to data*/
@@ -328,85 +688,170 @@ static void _socket_handler_clean(void *data) {
 	}
 }
 
-static void *_socket_handler(void *data) {
-	struct socket_handler *sockh = data;
-	struct fwsocket *sock = sockh->sock;
-	struct fwsocket *newsock;
-	struct	timeval	tv;
-	fd_set	rd_set, act_set;
-	int selfd, sockfd, type, flags;
-	struct bucket_loop *bloop;
-#ifdef __WIN32
-	int errcode;
-#endif
-	objlock(sock);
-	FD_ZERO(&rd_set);
-	sockfd = sock->sock;
-	type = sock->type;
-	if ((sock->flags & SOCK_FLAG_BIND) && (sock->ssl || !(sock->type == SOCK_DGRAM))) {
-		flags = (SOCK_FLAG_BIND & sock->flags);
-	} else {
-		flags = 0;
+static void _start_socket_handler(struct fwsocket *sock, socketrecv read,
+								  socketrecv acceptfunc, threadcleanup cleanup, void *data);
+
+/*call the read callback for the socket*/
+static void socket_handler_client(struct socket_handler *sockh, struct fwsocket *sock) {
+	struct timeval start = {0, 0};
+
+	thread_countcb();
+	if (sock->stats) {
+		gettimeofday(&start, NULL);
 	}
-	FD_SET(sockfd, &rd_set);
-	objunlock(sock);
+	sockh->client(sock, sockh->data);
+	sockstats_callback(sock, &start);
+}
 
-	while (framework_threadok() && !testflag(sock, SOCK_FLAG_CLOSE)) {
-		act_set = rd_set;
-		tv.tv_sec = 0;
-		tv.tv_usec = 20000;
+/*read a datagram for a DTLS server sharing its socket with its peers
+ * returns a peer that has completed its handshake*/
+static struct fwsocket *socket_handler_demux(struct socket_handler *sockh) {
+	struct fwsocket *sock = sockh->sock;
+	struct fwsocket *peer;
+	int budget = 0;
+
+	switch(dtls_demux_read(sock, &peer)) {
+		case DTLS_DEMUX_NEW:
+			return (peer);
+		case DTLS_DEMUX_DATA:
+			do {
+				socket_handler_client(sockh, peer);
+			} while (!testflag(peer, SOCK_FLAG_CLOSE) && (++budget < DTLS_DEMUX_BUDGET) &&
+					 (dtls_demux_next(sock, peer) == DTLS_DEMUX_DATA));
+			if (testflag(peer, SOCK_FLAG_CLOSE)) {
+				dtls_demux_close(sock, peer);
+			}
+			objunref(peer);
+			break;
+	}
+	return (NULL);
+}
 
-		selfd = select(sockfd + 1, &act_set, NULL, NULL, &tv);
+/** @brief Handle a socket that is ready to read.
+  *
+  * Bound sockets accept the connection and start the client
+  * otherwise the read callback is called. TLS connections accepted
+  * run the handshake as data arrives calling connect when it completes.
+  * @param sockh Socket handler.*/
+void socket_handler_read(struct socket_handler *sockh) {
+	struct fwsocket *sock = sockh->sock;
+	struct fwsocket *newsock;
 
-		/*returned due to interupt continue or timed out*/
 #ifndef __WIN32
-		if ((selfd < 0 && errno == EINTR) || (!selfd)) {
-#else
-		errcode = WSAGetLastError();
-		if (((selfd == SOCKET_ERROR) && (errcode == WSAEINTR)) || (!selfd)) {
+	/*zero copy completions wake the socket with no data*/
+	if (sock->zerocopy && !sockio_zcready(sock)) {
+		return;
+	}
 #endif
-			if ((type == SOCK_DGRAM) && (flags & SOCK_FLAG_BIND)) {
-				dtlshandltimeout(sock);
+
+	if (sockh->flags & SOCK_FLAG_BIND) {
+		switch (sock->type) {
+			case SOCK_STREAM:
+			case SOCK_SEQPACKET:
+				newsock = _accept_socket(sock, 1);
+				break;
+			case SOCK_DGRAM:
+				newsock = (dtls_demuxed(sock)) ? socket_handler_demux(sockh) : dtls_listenssl(sock);
+				break;
+			default:
+				newsock = NULL;
+				break;
+		}
+#ifndef __WIN32
+		/*over the servers limits*/
+		if (newsock && !socktimer_accept(sock, newsock)) {
+			if (dtls_demuxed(newsock)) {
+				dtls_demux_close(sock, newsock);
 			}
-			continue;
-		} else if (selfd < 0) {
-			break;
+			close_socket(newsock);
+			newsock = NULL;
 		}
-
-		if (FD_ISSET(sockfd, &act_set)) {
-			if (flags & SOCK_FLAG_BIND) {
-				switch (type) {
-					case SOCK_STREAM:
-					case SOCK_SEQPACKET:
-						newsock = accept_socket(sock);
-						break;
-					case SOCK_DGRAM:
-						newsock = dtls_listenssl(sock);
-						break;
-					default:
-						newsock = NULL;
-						break;
+#endif
+		if (newsock) {
+			if (sock->stats) {
+				__atomic_fetch_add(&sock->stats->accepts, 1, __ATOMIC_RELAXED);
+				socket_stats_enable(newsock);
+			}
+			objref(sock);
+			newsock->parent = sock;
+			if (dtls_demuxed(newsock)) {
+				/*peers are read by the server and kept by address not in its children*/
+#ifndef __WIN32
+				socktimer_start(newsock, sockh->data);
+#endif
+				if (sockh->connect) {
+					thread_countcb();
+					sockh->connect(newsock, sockh->data);
 				}
-				if (newsock) {
-					objref(sock);
-					newsock->parent = sock;
-					addtobucket(sock->children, newsock);
-					socketclient(newsock, sockh->data, sockh->client, NULL);
-					if (sockh->connect) {
-						sockh->connect(newsock, sockh->data);
-					}
-					objunref(newsock); /*pass ref to thread*/
+				if (ssl_pending(newsock)) {
+					socket_handler_client(sockh, newsock);
 				}
+			} else if (sockh->connect && newsock->ssl && (newsock->type == SOCK_STREAM)) {
+				/*connect is called by the client once the TLS handshake completes*/
+				addtobucket(sock->children, newsock);
+				_start_socket_handler(newsock, sockh->client, sockh->connect, NULL, sockh->data);
 			} else {
-				sockh->client(sockh->sock, sockh->data);
+				addtobucket(sock->children, newsock);
+				socketclient(newsock, sockh->data, sockh->client, NULL);
+				if (sockh->connect) {
+					thread_countcb();
+					sockh->connect(newsock, sockh->data);
+				}
+			}
+			objunref(newsock); /*pass ref to thread*/
+		}
+	} else {
+		/*the client is called once the TLS handshake completes
+		 * loops may pass it to the servers crypto workers*/
+		if (sock->ssl) {
+			switch((sockh->flags & SOCK_HANDLER_LOOP) ? ssl_handshake_offload(sock, sockh) : ssl_handshake(sock)) {
+				case 1:
+					break;
+				case 2:
+					if (sockh->connect) {
+						thread_countcb();
+						sockh->connect(sock, sockh->data);
+					}
+					/*read early data that is waiting*/
+					if (!ssl_pending(sock)) {
+						return;
+					}
+					break;
+				default:
+					return;
 			}
 		}
+		socket_handler_client(sockh, sock);
 	}
+}
 
+/** @brief Shutdown the socket close its children and release the reference.
+  *
+  * A connection is removed from its server so it is freed once closed.
+  * @param sockh Socket handler.*/
+void socket_handler_close(struct socket_handler *sockh) {
+	struct fwsocket *sock = sockh->sock;
+	struct fwsocket *newsock, *parent;
+	struct bucket_loop *bloop;
+
+#ifndef __WIN32
+	socktimer_stop(sock);
+#endif
 	if (sock->ssl) {
 		ssl_shutdown(sock->ssl, sock->sock);
 	}
 
+	/*the server holds a reference in its list of children*/
+	objlock(sock);
+	parent = (sock->parent && objref(sock->parent)) ? sock->parent : NULL;
+	objunlock(sock);
+	if (parent) {
+		if (parent->children) {
+			remove_bucket_item(parent->children, sock);
+		}
+		objunref(parent);
+	}
+
 	/*close children*/
 	if (sock->children) {
 		bloop = init_bucket_loop(sock->children);
@@ -424,12 +869,67 @@ static void *_socket_handler(void *data) {
 	}
 
 	objunref(sock);
+}
+
+static void *_socket_handler(void *data) {
+	struct socket_handler *sockh = data;
+	struct fwsocket *sock = sockh->sock;
+	struct	timeval	tv, tick;
+	fd_set	act_set, wr_set;
+	int selfd, sockfd, type, flags;
+#ifdef __WIN32
+	int errcode;
+#endif
+	objlock(sock);
+	sockfd = sock->sock;
+	type = sock->type;
+	objunlock(sock);
+	gettimeofday(&tick, NULL);
+
+	while (framework_threadok() && !testflag(sock, SOCK_FLAG_CLOSE)) {
+		/*the socket may be waiting to be written in place of read (socket_proxy())*/
+		flags = testflag(sock, (SOCK_FLAG_NOREAD | SOCK_FLAG_POLLOUT));
+		FD_ZERO(&act_set);
+		FD_ZERO(&wr_set);
+		if (!(flags & SOCK_FLAG_NOREAD)) {
+			FD_SET(sockfd, &act_set);
+		}
+		if (flags & SOCK_FLAG_POLLOUT) {
+			FD_SET(sockfd, &wr_set);
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = SOCKET_DTLS_TICK * 1000;
+
+		selfd = select(sockfd + 1, &act_set, &wr_set, NULL, &tv);
+
+		/*returned due to interupt or timed out*/
+#ifndef __WIN32
+		if ((selfd < 0) && (errno != EINTR)) {
+#else
+		errcode = WSAGetLastError();
+		if ((selfd == SOCKET_ERROR) && (errcode != WSAEINTR)) {
+#endif
+			break;
+		} else if ((selfd > 0) && (FD_ISSET(sockfd, &act_set) || FD_ISSET(sockfd, &wr_set))) {
+			socket_handler_read(sockh);
+		}
+
+		/*a busy server never times out run the timers on time*/
+		if ((type == SOCK_DGRAM) && (sockh->flags & SOCK_FLAG_BIND) &&
+				(sockstats_since(&tick) >= SOCKET_DTLS_TICK * 1000)) {
+			gettimeofday(&tick, NULL);
+			dtlshandltimeout(sock);
+		}
+	}
+
+	socket_handler_close(sockh);
 
 	return NULL;
 }
 
-static void _start_socket_handler(struct fwsocket *sock, socketrecv read,
-								  socketrecv acceptfunc, threadcleanup cleanup, void *data) {
+/*a handler started with attr runs in its own thread even if event loops are running*/
+static void _start_socket_handler_attr(struct fwsocket *sock, socketrecv read, socketrecv acceptfunc,
+									   threadcleanup cleanup, void *data, struct thread_attr *attr) {
 	struct socket_handler *sockh;
 
 	if (!sock || !read || !(sockh = objalloc(sizeof(*sockh), NULL))) {
@@ -442,13 +942,55 @@ static void _start_socket_handler(struct fwsocket *sock, socketrecv read,
 	sockh->connect = acceptfunc;
 	sockh->data = data;
 
+	objlock(sock);
+	if ((sock->flags & SOCK_FLAG_BIND) && (sock->ssl || !(sock->type == SOCK_DGRAM))) {
+		sockh->flags = SOCK_FLAG_BIND;
+	}
+	objunlock(sock);
+
 	/* grab ref for data and pass sockh*/
 	objref(data);
 	objref(sock);
-	framework_mkthread(_socket_handler, _socket_handler_clean, NULL, sockh, 0);
+#ifndef __WIN32
+	if (!sockh->flags) {
+		socktimer_start(sock, data);
+	}
+
+	/*hand the socket to the event loop if running*/
+	if (!attr && socketloop_add(sockh)) {
+		objunref(sockh);
+		return;
+	}
+#endif
+	framework_mkthread_attr(_socket_handler, socket_handler_clean, NULL, sockh, 0, attr);
 	objunref(sockh);
 }
 
+static void _start_socket_handler(struct fwsocket *sock, socketrecv read,
+								  socketrecv acceptfunc, threadcleanup cleanup, void *data) {
+	_start_socket_handler_attr(sock, read, acceptfunc, cleanup, data, NULL);
+}
+
+/*attr starts the server in a thread with these attributes*/
+static void _socketserver(struct fwsocket *sock, socketrecv read, socketrecv acceptfunc,
+						  threadcleanup cleanup, void *data, struct thread_attr *attr) {
+	objlock(sock);
+	if (sock->flags & SOCK_FLAG_BIND) {
+		if (sock->ssl || !(sock->type == SOCK_DGRAM)) {
+			sock->children = create_bucketlist(6, hash_socket);
+		}
+		if (sock->ssl && (sock->type == SOCK_DGRAM)) {
+			objunlock(sock);
+			dtsl_serveropts(sock);
+		} else {
+			objunlock(sock);
+		}
+	} else {
+		objunlock(sock);
+	}
+	_start_socket_handler_attr(sock, read, acceptfunc, cleanup, data, attr);
+}
+
 /** @brief Create a server thread with a socket that has been created with
   * sockbind udpbind or tcpbind.
   *
@@ -462,22 +1004,151 @@ static void _start_socket_handler(struct fwsocket *sock, socketrecv read,
   * @param data to send to the callbacks in paramaters.*/
 extern void socketserver(struct fwsocket *sock, socketrecv read,
 						 socketrecv acceptfunc, threadcleanup cleanup, void *data) {
+	_socketserver(sock, read, acceptfunc, cleanup, data, NULL);
+}
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/*steer connections to the listener with the index of the CPU that received them*/
+static int reuseport_cpubpf(struct fwsocket *sock) {
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_RET | BPF_A, 0, 0, 0}
+	};
+	struct sock_fprog prog;
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	return (setsockopt(sock->sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)));
+}
+
+/*run the listener on the CPU its connections are steered from*/
+static struct thread_attr *reuseport_cpuattr(struct thread_attr *attr, char *name, char *cpulist, int cpu) {
+	memset(attr, 0, sizeof(*attr));
+	snprintf(name, 32, "listen/%i", cpu);
+	snprintf(cpulist, 16, "%i", cpu);
+	attr->name = name;
+	attr->cpulist = cpulist;
+
+	return (attr);
+}
+#endif
+
+/** @brief Create a server with a number of listeners sharing the address of sock.
+  *
+  * Additional sockets are bound to the same address as sock with SO_REUSEPORT
+  * the kernel will balance connections between them, each is started with
+  * socketserver() and so has its own thread or is added to the next event loop.
+  * With SOCKET_MULTI_CPU each listener runs in its own thread pinned to the CPU
+  * its connections arrive on even if event loops are running.
+  * The additional listeners are children of sock and are closed with it.
+  * @note The cleanup function is only called when sock closes.
+  * @note Stats, timeouts and limits set on sock before calling this are
+  * shared by all the listeners.
+  * @note Additional TCP listeners are created with a backlog of SOMAXCONN.
+  * @see socketserver
+  * @see socketloop_init
+  * @param nthreads Number of listeners including sock 0 starts one per CPU.
+  * @param sock Reference to a bound socket.
+  * @param read Callback to handle data when ready to read.
+  * @param acceptfunc Function to call on connection accept.
+  * @param cleanup Thread cleanup function for when the socket closes.
+  * @param data to send to the callbacks in paramaters.
+  * @param flags Options from socket_multi_flags.
+  * @returns Number of listeners started.*/
+extern int socketserver_multi(int nthreads, struct fwsocket *sock, socketrecv read,
+							  socketrecv acceptfunc, threadcleanup cleanup, void *data, int flags) {
+	struct fwsocket *lsock;
+	struct thread_attr attr, *pin = NULL;
+	char name[32], cpulist[16];
+	socklen_t salen;
+	int cnt;
+#ifndef __WIN32__
+	int on = 1;
+#endif
+
+	if (!sock || !testflag(sock, SOCK_FLAG_BIND)) {
+		return (0);
+	}
+
+	if (nthreads <= 0) {
+		nthreads = framework_cpucount();
+	}
+
+	salen = (sock->addr.ss.ss_family == PF_INET6) ? sizeof(sock->addr.sa6) : sizeof(sock->addr.sa4);
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	/*the program applies to the group the listeners join in order of bind*/
+	if ((flags & SOCKET_MULTI_CPU) && (nthreads > 1) && !reuseport_cpubpf(sock)) {
+		pin = reuseport_cpuattr(&attr, name, cpulist, 0);
+	}
+#endif
+
+	_socketserver(sock, read, acceptfunc, cleanup, data, pin);
 
 	objlock(sock);
-	if (sock->flags & SOCK_FLAG_BIND) {
-		if (sock->ssl || !(sock->type == SOCK_DGRAM)) {
-			sock->children = create_bucketlist(6, hash_socket);
+	if (!sock->children) {
+		sock->children = create_bucketlist(6, hash_socket);
+	}
+	objunlock(sock);
+
+	for(cnt = 1; cnt < nthreads; cnt++) {
+		if (sock->ssl) {
+			objref(sock->ssl);
 		}
-		if (sock->ssl && (sock->type == SOCK_DGRAM)) {
-			objunlock(sock);
-			dtsl_serveropts(sock);
-		} else {
-			objunlock(sock);
+		if (!(lsock = make_socket(sock->addr.ss.ss_family, sock->type, sock->proto, sock->ssl))) {
+			if (sock->ssl) {
+				objunref(sock->ssl);
+			}
+			break;
+		}
+#ifndef __WIN32__
+		setsockopt(lsock->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+		setsockopt(lsock->sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+#endif
+		if (bind(lsock->sock, &sock->addr.sa, salen)) {
+			objunref(lsock);
+			break;
+		}
+		lsock->flags |= SOCK_FLAG_BIND;
+		memcpy(&lsock->addr, &sock->addr, sizeof(lsock->addr));
+
+		/*connections are counted and limited for the server as a whole
+		 * a plain UDP socket is not a server its timer is its own*/
+		objlock(sock);
+		if (sock->stats && objref(sock->stats)) {
+			lsock->stats = sock->stats;
+		}
+		if (sock->timer && (sock->ssl || (sock->type != SOCK_DGRAM)) && objref(sock->timer)) {
+			lsock->timer = sock->timer;
 		}
-	} else {
 		objunlock(sock);
+		switch(lsock->type) {
+			case SOCK_STREAM:
+			case SOCK_SEQPACKET:
+				listen(lsock->sock, SOMAXCONN);
+				/* no break */
+			default:
+				break;
+		}
+
+		/*close with the parent*/
+		objref(sock);
+		lsock->parent = sock;
+		addtobucket(sock->children, lsock);
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+		if (pin) {
+			reuseport_cpuattr(pin, name, cpulist, cnt);
+		}
+#endif
+		_socketserver(lsock, read, acceptfunc, NULL, data, pin);
+		objunref(lsock);
 	}
-	_start_socket_handler(sock, read, acceptfunc, cleanup, data);
+
+	return (cnt);
 }
 
 /** @brief Create a server thread with a socket that has been created with
@@ -536,6 +1207,7 @@ const char *sockaddr2ip(union sockstruct *addr, char *buff, int blen) {
 struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip, const char *port, int flags) {
 	struct fwsocket *fws;
 	struct  addrinfo hint, *result, *rp;
+	union sockstruct bindaddr;
 	struct in_addr *srcif;
 	const char *srcip;
 	int ifidx;
@@ -557,7 +1229,7 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
                 return NULL;
 	}
 
-        if (getaddrinfo(srcip, port, &hint, &result) || !result) {
+        if (_getaddrinfo(srcip, port, &hint, &result)) {
 		free((void*)srcip);
                 return NULL;
         }
@@ -569,14 +1241,14 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
 	ifidx = ifinf->idx;
 
 	srcip = (family == AF_INET) ? ifinf->ipv4addr : ifinf->ipv6addr;
-        if (!srcip || (getaddrinfo(srcip, port, &hint, &result) || !result)) {
+        if (!srcip || _getaddrinfo(srcip, port, &hint, &result)) {
 		objunref(ifinf);
                 return NULL;
         }
 	objunref(ifinf);
 #endif
 
-	for(rp = result; rp; rp = result->ai_next) {
+	for(rp = result; rp; rp = rp->ai_next) {
 		if (!(fws = make_socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol, NULL))) {
 			continue;
 		}
@@ -584,13 +1256,17 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
 	}
 
 	if (!rp || !fws) {
-		freeaddrinfo(result);
+		_freeaddrinfo(result);
 		return NULL;
 	}
 
+	/*the lookup result may be shared take a copy to modify*/
+	memset(&bindaddr, 0, sizeof(bindaddr));
+	memcpy(&bindaddr, rp->ai_addr, rp->ai_addrlen);
+
 	if(setsockopt(fws->sock, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on))) {
 		objunref(fws);
-		freeaddrinfo(result);
+		_freeaddrinfo(result);
 		return NULL;
 	}
 
@@ -599,16 +1275,16 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
 		struct ip_mreq mg;
 		struct sockaddr_in *src_ip;
 
-		src_ip = (struct sockaddr_in*)rp->ai_addr;
+		src_ip = &bindaddr.sa4;
 
 		if (setsockopt(fws->sock, IPPROTO_IP, IP_MULTICAST_TTL, (char*)&ttl, sizeof(ttl))) {
 			objunref(fws);
-			freeaddrinfo(result);
+			_freeaddrinfo(result);
 			return NULL;
 		}
 
 		if (flags && setsockopt(fws->sock, IPPROTO_IP, IP_MULTICAST_LOOP, (char*)&off, sizeof(off))) {
-			freeaddrinfo(result);
+			_freeaddrinfo(result);
 			objunref(fws);
 			return NULL;
 		}
@@ -624,14 +1300,14 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
 		mg.imr_interface.s_addr = src_ip->sin_addr.s_addr;
 		if (setsockopt(fws->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mg, sizeof(mg))) {
 			objunref(fws);
-			freeaddrinfo(rp);
+			_freeaddrinfo(result);
 			return NULL;
 		}
 
 		memset(&srcif, 0, sizeof(srcif));
 		srcif = &src_ip->sin_addr;
 		if(setsockopt(fws->sock, IPPROTO_IP, IP_MULTICAST_IF, (char*)srcif, sizeof(*srcif))) {
-			freeaddrinfo(rp);
+			_freeaddrinfo(result);
 			objunref(fws);
 			return NULL;
 		}
@@ -644,16 +1320,16 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
 #ifndef __WIN32
 		ifidx = get_iface_index(iface);
 #endif
-		src_ip = (struct sockaddr_in6*)rp->ai_addr;
+		src_ip = &bindaddr.sa6;
 
 		if (setsockopt(fws->sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char*)&ttl, sizeof(ttl))) {
 			objunref(fws);
-			freeaddrinfo(result);
+			_freeaddrinfo(result);
 			return NULL;
 		}
 
 		if (flags && setsockopt(fws->sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (char*)&off, sizeof(off))) {
-			freeaddrinfo(result);
+			_freeaddrinfo(result);
 			objunref(fws);
 			return NULL;
 		}
@@ -669,30 +1345,164 @@ struct fwsocket *mcast_socket(const char *iface, int family, const char *mcastip
 		mg.ipv6mr_interface = ifidx;
 		if (setsockopt(fws->sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char*)&mg, sizeof(mg))) {
 			objunref(fws);
-			freeaddrinfo(rp);
+			_freeaddrinfo(result);
 			return NULL;
 		}
 
 		if (setsockopt(fws->sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (char*)&ifidx, sizeof(ifidx))) {
-			objref(fws);
-			freeaddrinfo(rp);
+			objunref(fws);
+			_freeaddrinfo(result);
 			return NULL;
 		}
 
 		src_ip->sin6_addr = mcastip6;
 	}
 
-	if (bind(fws->sock, (struct sockaddr*)rp->ai_addr, sizeof(struct sockaddr_storage))) {
-		freeaddrinfo(result);
+	if (bind(fws->sock, &bindaddr.sa, rp->ai_addrlen)) {
+		_freeaddrinfo(result);
 		objunref(fws);
 		return NULL;
 	}
 
 	getsockname(fws->sock, &fws->addr.sa, &slen);
-	freeaddrinfo(result);
+	_freeaddrinfo(result);
 	fws->flags |= SOCK_FLAG_MCAST;
 
 	return fws;
 }
 
+/** @brief Start counting traffic on a socket.
+  *
+  * Connections accepted on a listening socket with stats enabled have
+  * there stats enabled.
+  * @see socket_stats_get()
+  * @param sock Socket to count traffic on.
+  * @returns 0 on failure.*/
+extern int socket_stats_enable(struct fwsocket *sock) {
+	struct sock_stats *stats;
+
+	if (!sock) {
+		return (0);
+	}
 
+	objlock(sock);
+	if (!sock->stats && (stats = objalloc(sizeof(*stats), NULL))) {
+		sock->stats = stats;
+	}
+	objunlock(sock);
+
+	return ((sock->stats) ? 1 : 0);
+}
+
+static void sockstats_add(struct sock_stats *total, struct sock_stats *stats) {
+	int cnt;
+
+	total->bytes_in += stats->bytes_in;
+	total->bytes_out += stats->bytes_out;
+	total->pkts_in += stats->pkts_in;
+	total->pkts_out += stats->pkts_out;
+	total->reads += stats->reads;
+	total->writes += stats->writes;
+	total->eagain += stats->eagain;
+	total->accepts += stats->accepts;
+	total->callbacks += stats->callbacks;
+	total->cb_usec += stats->cb_usec;
+	total->ssl_read_usec += stats->ssl_read_usec;
+	total->ssl_write_usec += stats->ssl_write_usec;
+	for(cnt = 0; cnt < SOCK_STATS_HIST; cnt++) {
+		total->cb_hist[cnt] += stats->cb_hist[cnt];
+	}
+}
+
+/** @brief Copy the counters of a socket.
+  *
+  * @param sock Socket to return stats for.
+  * @param stats Structure to copy the counters too.
+  * @returns 0 if stats are not enabled on the socket.*/
+extern int socket_stats_get(struct fwsocket *sock, struct sock_stats *stats) {
+	if (!sock || !stats || !sock->stats) {
+		return (0);
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	sockstats_add(stats, sock->stats);
+	return (1);
+}
+
+/*the listeners added by socketserver_multi() share the counters of the server
+ * only there connections are counted*/
+static void sockstats_children(struct fwsocket *sock, struct sock_stats *stats) {
+	struct bucket_loop *bloop;
+	struct fwsocket *child;
+
+	if (!sock->children) {
+		return;
+	}
+
+	bloop = init_bucket_loop(sock->children);
+	while(bloop && (child = next_bucket_loop(bloop))) {
+		if (testflag(child, SOCK_FLAG_BIND)) {
+			sockstats_children(child, stats);
+		} else if (child->stats) {
+			sockstats_add(stats, child->stats);
+		}
+		objunref(child);
+	}
+	objunref(bloop);
+}
+
+/** @brief Add the counters of a server socket and all its connections.
+  *
+  * @note Connections already closed are not counted.
+  * @param sock Server socket.
+  * @param stats Structure to return the totals in.
+  * @returns 0 if stats are not enabled on the socket.*/
+extern int socket_stats_total(struct fwsocket *sock, struct sock_stats *stats) {
+	if (!socket_stats_get(sock, stats)) {
+		return (0);
+	}
+
+	sockstats_children(sock, stats);
+	return (1);
+}
+
+static void sockstats_dump(struct fwsocket *sock, socket_statscb cb, void *data) {
+	struct bucket_loop *bloop;
+	struct fwsocket *child;
+	struct sock_stats stats;
+
+	if (!sock->children) {
+		return;
+	}
+
+	bloop = init_bucket_loop(sock->children);
+	while(bloop && (child = next_bucket_loop(bloop))) {
+		if (testflag(child, SOCK_FLAG_BIND)) {
+			sockstats_dump(child, cb, data);
+		} else if (socket_stats_get(child, &stats)) {
+			cb(child, &stats, data);
+		}
+		objunref(child);
+	}
+	objunref(bloop);
+}
+
+/** @brief Call a function with the counters of a socket and each of its connections.
+  *
+  * This allows finding busy or slow clients of a server.
+  * @param sock Socket to report on.
+  * @param cb Callback called with a copy of the counters of each socket with stats enabled.
+  * @param data Reference to data passed to the callback.*/
+extern void socket_stats_dump(struct fwsocket *sock, socket_statscb cb, void *data) {
+	struct sock_stats stats;
+
+	if (!sock || !cb) {
+		return;
+	}
+
+	if (socket_stats_get(sock, &stats)) {
+		cb(sock, &stats, data);
+	}
+
+	sockstats_dump(sock, cb, data);
+}
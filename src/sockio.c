@@ -0,0 +1,1189 @@
+/*
+Copyright (C) 2012  Gregory Nietsky <gregory@distrotetch.co.za>
+        http://www.distrotech.co.za
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @addtogroup LIB-Sock
+  * @{
+  *
+  * @file
+  * @brief Linux specific socket I/O moving more than one buffer per system call.*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "include/dtsapp.h"
+#include "include/private.h"
+
+/** @brief Maximum number of datagrams passed to the kernel in one call.*/
+#define SOCK_BATCH_MAX	64
+/** @brief Maximum number of segments the kernel accepts in a GSO send.*/
+#define SOCK_GSO_SEGS	64
+/** @brief Largest UDP payload that can be sent in one call.*/
+#define SOCK_GSO_MAX	65507
+/** @brief Size of the buffers small writes are joined into the largest SSL record.*/
+#define SOCK_OUTQ_CHUNK	16384
+/** @brief Default high water mark of the output queue.*/
+#define SOCK_OUTQ_HWM	65536
+/** @brief Number of buffers passed to writev.*/
+#define SOCK_OUTQ_IOV	64
+/** @brief Largest splice from a socket into a proxy pipe.*/
+#define SOCK_PROXY_CHUNK	65536
+
+/** @brief Buffer held until the kernel has sent it.*/
+struct zc_pending {
+	/** @brief Notification id of the send.*/
+	uint32_t seq;
+	/** @brief Reference to the buffer.*/
+	void *data;
+	/** @brief Next buffer sent.*/
+	struct zc_pending *next;
+};
+
+/** @brief Zero copy state of a socket.*/
+struct sock_zerocopy {
+	/** @brief Zero copy has been enabled with SO_ZEROCOPY.*/
+	int enabled;
+	/** @brief Id the kernel will assign the next send.*/
+	uint32_t next;
+	/** @brief Oldest buffer awaiting completion.*/
+	struct zc_pending *head;
+	/** @brief Last buffer sent.*/
+	struct zc_pending *tail;
+};
+
+/** @brief Buffer in the output queue.*/
+struct outq_chunk {
+	/** @brief Next buffer in the queue.*/
+	struct outq_chunk *next;
+	/** @brief Size of the buffer.*/
+	int size;
+	/** @brief Length of the data in the buffer.*/
+	int len;
+	/** @brief Offset of the data not yet written.*/
+	int off;
+	/** @brief Data allocated after the structure.*/
+	char *data;
+};
+
+/** @brief Output queue of a socket.*/
+struct sock_outq {
+	/** @brief First buffer to be written.*/
+	struct outq_chunk *head;
+	/** @brief Last buffer new data is added too.*/
+	struct outq_chunk *tail;
+	/** @brief Number of bytes queued.*/
+	size_t pending;
+	/** @brief Number of bytes above which socket_queue() reports the queue full.*/
+	size_t hwm;
+	/** @brief A flush is in progress.*/
+	int flushing;
+	/** @brief TCP_NODELAY has been set.*/
+	int nodelay;
+};
+
+/** @brief Data flowing from one side of a proxy to the other.*/
+struct proxy_dir {
+	/** @brief Pipe data is spliced through.*/
+	int pipe[2];
+	/** @brief Bytes in the pipe not yet written.*/
+	size_t pending;
+	/** @brief The source has closed and the peer write side has been shutdown.*/
+	int eof;
+};
+
+/** @brief Two sockets data is spliced between.
+  *
+  * Direction n carries data read from sock[n] to the other socket.*/
+struct sock_proxy {
+	/** @brief Reference to the sockets.*/
+	struct fwsocket *sock[2];
+	/** @brief State of each direction.*/
+	struct proxy_dir dir[2];
+	/** @brief SOCK_FLAG_CLOSE is set once the proxy has stopped.*/
+	int flags;
+};
+
+/*the socket is gone flag it for closing*/
+static void sockio_error(struct fwsocket *sock) {
+	switch(errno) {
+		case EBADF:
+		case EPIPE:
+		case ENOTCONN:
+		case ENOTSOCK:
+			sock->flags |= SOCK_FLAG_CLOSE;
+			break;
+	}
+}
+
+/** @brief Read a number of datagrams from a socket with one system call.
+  *
+  * The call blocks until at least one datagram is available then returns
+  * as many as are waiting up to cnt. The remote address of each is placed
+  * in sock_datagram::addr and its length in sock_datagram::len.
+  * @note This is not supported on SSL (DTLS) sockets.
+  * @param sock Socket to read from.
+  * @param dgrams Array of datagrams with buf and size set.
+  * @param cnt Number of entries in the array.
+  * @returns Number of datagrams read or -1 on error.*/
+extern int socketread_batch(struct fwsocket *sock, struct sock_datagram *dgrams, int cnt) {
+	struct mmsghdr msgs[SOCK_BATCH_MAX];
+	struct iovec iovs[SOCK_BATCH_MAX];
+	ssize_t bytes;
+	int i, ret;
+
+	if (!sock || !dgrams || (cnt <= 0) || sock->ssl || testflag(sock, SOCK_FLAG_SSL)) {
+		return (-1);
+	}
+
+	if (cnt > SOCK_BATCH_MAX) {
+		cnt = SOCK_BATCH_MAX;
+	}
+
+	memset(msgs, 0, sizeof(msgs[0]) * cnt);
+	for(i = 0; i < cnt; i++) {
+		iovs[i].iov_base = dgrams[i].buf;
+		iovs[i].iov_len = dgrams[i].size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &dgrams[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(dgrams[i].addr);
+	}
+
+	objlock(sock);
+	if ((ret = recvmmsg(sock->sock, msgs, cnt, MSG_WAITFORONE, NULL)) < 0) {
+		sockio_error(sock);
+	}
+	objunlock(sock);
+
+	for(i = 0, bytes = 0; i < ret; i++) {
+		dgrams[i].len = msgs[i].msg_len;
+		bytes += msgs[i].msg_len;
+		if (!msgs[i].msg_hdr.msg_namelen) {
+			dgrams[i].addr.ss.ss_family = 0;
+		}
+	}
+	sockstats_io(sock, SOCK_STATS_IN, (ret < 0) ? ret : bytes, ret);
+
+	return (ret);
+}
+
+/** @brief Write a number of datagrams to a socket with one system call.
+  *
+  * Each datagram is sent to sock_datagram::addr if the family is set otherwise
+  * it is sent to the connected peer (or multicast group), sock_datagram::len
+  * bytes of sock_datagram::buf are sent.
+  * @note This is not supported on SSL (DTLS) sockets.
+  * @param sock Socket to write too.
+  * @param dgrams Array of datagrams to send.
+  * @param cnt Number of entries in the array.
+  * @returns Number of datagrams sent or -1 on error.*/
+extern int socketwrite_batch(struct fwsocket *sock, struct sock_datagram *dgrams, int cnt) {
+	struct mmsghdr msgs[SOCK_BATCH_MAX];
+	struct iovec iovs[SOCK_BATCH_MAX];
+	union sockstruct *addr;
+	ssize_t bytes;
+	int i, ret, sent = 0;
+
+	if (!sock || !dgrams || (cnt <= 0) || sock->ssl || testflag(sock, SOCK_FLAG_SSL)) {
+		return (-1);
+	}
+
+	objlock(sock);
+	while(sent < cnt) {
+		memset(msgs, 0, sizeof(msgs));
+		for(i = 0; (i < SOCK_BATCH_MAX) && (sent + i < cnt); i++) {
+			iovs[i].iov_base = dgrams[sent + i].buf;
+			iovs[i].iov_len = dgrams[sent + i].len;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+
+			if (sock->flags & SOCK_FLAG_MCAST) {
+				addr = &sock->addr;
+			} else if (dgrams[sent + i].addr.ss.ss_family) {
+				addr = &dgrams[sent + i].addr;
+			} else {
+				continue;
+			}
+			msgs[i].msg_hdr.msg_name = addr;
+			switch(addr->ss.ss_family) {
+				case PF_INET:
+					msgs[i].msg_hdr.msg_namelen = sizeof(addr->sa4);
+					break;
+				case PF_INET6:
+					msgs[i].msg_hdr.msg_namelen = sizeof(addr->sa6);
+					break;
+				case PF_UNIX:
+					msgs[i].msg_hdr.msg_namelen = sizeof(addr->un);
+					break;
+				default:
+					msgs[i].msg_hdr.msg_namelen = sizeof(*addr);
+					break;
+			}
+		}
+
+		if ((ret = sendmmsg(sock->sock, msgs, i, MSG_NOSIGNAL)) < 0) {
+			sockstats_io(sock, SOCK_STATS_OUT, ret, 0);
+			sockio_error(sock);
+			break;
+		}
+		for(i = 0, bytes = 0; i < ret; i++) {
+			bytes += msgs[i].msg_len;
+		}
+		sockstats_io(sock, SOCK_STATS_OUT, bytes, ret);
+		sent += ret;
+		/*the kernel stops at the first error return what was sent*/
+		if (ret < i) {
+			break;
+		}
+	}
+	objunlock(sock);
+
+	return ((sent) ? sent : -1);
+}
+
+/** @brief Enable UDP segmentation offload on a socket.
+  *
+  * SOCK_FLAG_GRO is only set if the kernel accepts UDP_GRO
+  * SOCK_FLAG_GSO is used per send and is set as requested.
+  * @param sock UDP socket.
+  * @param flags SOCK_FLAG_GSO and or SOCK_FLAG_GRO.*/
+void sockio_udpoffload(struct fwsocket *sock, int flags) {
+#ifdef UDP_GRO
+	int on = 1;
+#endif
+
+	if (!sock || (sock->type != SOCK_DGRAM)) {
+		return;
+	}
+
+	objlock(sock);
+#ifdef UDP_GRO
+	if ((flags & SOCK_FLAG_GRO) && !setsockopt(sock->sock, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+		sock->flags |= SOCK_FLAG_GRO;
+	}
+#endif
+#ifdef UDP_SEGMENT
+	if (flags & SOCK_FLAG_GSO) {
+		sock->flags |= SOCK_FLAG_GSO;
+	}
+#endif
+	objunlock(sock);
+}
+
+/*send the buffer as a array of datagrams when GSO is not available*/
+static int sockio_segment(struct fwsocket *sock, const void *buf, int num, int segsize, union sockstruct *addr) {
+	struct sock_datagram dgrams[SOCK_BATCH_MAX];
+	int i, cnt, ret, sent = 0;
+
+	while(sent < num) {
+		for(cnt = 0; (cnt < SOCK_BATCH_MAX) && (sent + (cnt * segsize) < num); cnt++) {
+			i = sent + (cnt * segsize);
+			dgrams[cnt].buf = (char *)buf + i;
+			dgrams[cnt].len = ((num - i) > segsize) ? segsize : num - i;
+			if (addr) {
+				memcpy(&dgrams[cnt].addr, addr, sizeof(*addr));
+			} else {
+				dgrams[cnt].addr.ss.ss_family = 0;
+			}
+		}
+		if ((ret = socketwrite_batch(sock, dgrams, cnt)) <= 0) {
+			break;
+		}
+		for(i = 0; i < ret; i++) {
+			sent += dgrams[i].len;
+		}
+		if (ret < cnt) {
+			break;
+		}
+	}
+
+	return ((sent) ? sent : -1);
+}
+
+/** @brief Send a buffer as a number of equal sized datagrams.
+  *
+  * On a socket created with SOCK_FLAG_GSO the kernel (or NIC) splits
+  * the buffer into datagrams of segsize only the last may be shorter,
+  * without GSO or if the kernel refuses it the datagrams are sent with
+  * socketwrite_batch().
+  * @note This is not supported on SSL (DTLS) sockets.
+  * @see udpbind_flags
+  * @see udpconnect_flags
+  * @param sock UDP socket to send on.
+  * @param buf Buffer to send.
+  * @param num Length of the buffer.
+  * @param segsize Size of each datagram no larger than a UDP payload (65507).
+  * @param addr Address to send too or NULL if connected.
+  * @returns Number of bytes sent or -1 on error.*/
+extern int socketwrite_gso(struct fwsocket *sock, const void *buf, int num, int segsize, union sockstruct *addr) {
+#ifdef UDP_SEGMENT
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int len, ret, sent = 0;
+#endif
+
+	if (!sock || !buf || (num <= 0) || (segsize <= 0) || (segsize > SOCK_GSO_MAX) ||
+			sock->ssl || testflag(sock, SOCK_FLAG_SSL)) {
+		return (-1);
+	}
+
+#ifdef UDP_SEGMENT
+	if (!testflag(sock, SOCK_FLAG_GSO) || (num <= segsize)) {
+		return (sockio_segment(sock, buf, num, segsize, addr));
+	}
+
+	objlock(sock);
+	while(sent < num) {
+		/*the kernel limits the number of segments and the total size*/
+		len = segsize * SOCK_GSO_SEGS;
+		if (len > SOCK_GSO_MAX) {
+			len = SOCK_GSO_MAX - (SOCK_GSO_MAX % segsize);
+		}
+		if (len > (num - sent)) {
+			len = num - sent;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = (char *)buf + sent;
+		iov.iov_len = len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (addr && addr->ss.ss_family) {
+			msg.msg_name = addr;
+			msg.msg_namelen = (addr->ss.ss_family == PF_INET6) ? sizeof(addr->sa6) : sizeof(addr->sa4);
+		}
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cmsg) = segsize;
+
+		ret = sendmsg(sock->sock, &msg, MSG_NOSIGNAL);
+		sockstats_io(sock, SOCK_STATS_OUT, ret, (ret > 0) ? (ret + segsize - 1) / segsize : 0);
+		if (ret < 0) {
+			/*no offload on this route disable it and segment here*/
+			if ((errno == EIO) || (errno == EINVAL) || (errno == ENOPROTOOPT)) {
+				sock->flags &= ~SOCK_FLAG_GSO;
+				objunlock(sock);
+				ret = sockio_segment(sock, (char *)buf + sent, num - sent, segsize, addr);
+				return ((ret > 0) ? sent + ret : ((sent) ? sent : -1));
+			}
+			sockio_error(sock);
+			break;
+		}
+		sent += ret;
+	}
+	objunlock(sock);
+
+	return ((sent) ? sent : -1);
+#else
+	return (sockio_segment(sock, buf, num, segsize, addr));
+#endif
+}
+
+/** @brief Read from a UDP socket returning the datagram size of coalesced data.
+  *
+  * On a socket created with SOCK_FLAG_GRO the kernel may return a number
+  * of datagrams from the same source joined in one buffer, they are all
+  * segsize bytes except the last which may be shorter. If the data was not
+  * coalesced segsize is the length returned.
+  * @note This is not supported on SSL (DTLS) sockets.
+  * @param sock UDP socket to read from.
+  * @param buf Buffer to fill it should be 64k to receive the largest coalesced buffer.
+  * @param num Size of the buffer.
+  * @param addr Remote address is returned in this if not NULL.
+  * @param segsize Size of each datagram in the buffer is returned in this.
+  * @returns Number of bytes read or -1 on error.*/
+extern int socketread_gro(struct fwsocket *sock, void *buf, int num, union sockstruct *addr, int *segsize) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int ret, seg;
+
+	if (!sock || !buf || (num <= 0) || sock->ssl || testflag(sock, SOCK_FLAG_SSL)) {
+		return (-1);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = num;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (addr) {
+		msg.msg_name = addr;
+		msg.msg_namelen = sizeof(*addr);
+	}
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	objlock(sock);
+	if ((ret = recvmsg(sock->sock, &msg, 0)) < 0) {
+		sockio_error(sock);
+	}
+	objunlock(sock);
+
+	if (segsize) {
+		*segsize = ret;
+	}
+	if (ret <= 0) {
+		sockstats_io(sock, SOCK_STATS_IN, ret, (ret < 0) ? 0 : 1);
+		return (ret);
+	}
+
+	seg = ret;
+#ifdef UDP_GRO
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+			seg = *(int *)CMSG_DATA(cmsg);
+			break;
+		}
+	}
+#endif
+	if (segsize) {
+		*segsize = seg;
+	}
+	sockstats_io(sock, SOCK_STATS_IN, ret, (seg > 0) ? (ret + seg - 1) / seg : 1);
+
+	return (ret);
+}
+
+static void free_zerocopy(void *data) {
+	struct sock_zerocopy *zc = data;
+	struct zc_pending *zcp;
+
+	/*the socket has closed the kernel holds its own reference to the pages*/
+	while((zcp = zc->head)) {
+		zc->head = zcp->next;
+		objunref(zcp->data);
+		free(zcp);
+	}
+}
+
+#ifdef MSG_ZEROCOPY
+/*release buffers the kernel has finished with sock must be locked*/
+static void sockio_zcreap(struct fwsocket *sock) {
+	struct sock_zerocopy *zc = sock->zerocopy;
+	struct sock_extended_err *serr;
+	struct zc_pending *zcp, *prev, *next;
+	char control[CMSG_SPACE(sizeof(*serr) + sizeof(struct sockaddr_in6))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	uint32_t lo, hi;
+
+	for(;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			break;
+		}
+
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			/*the kernel copied the data anyway zero copy is only overhead*/
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				zc->enabled = 0;
+			}
+			lo = serr->ee_info;
+			hi = serr->ee_data;
+			prev = NULL;
+			for(zcp = zc->head; zcp; zcp = next) {
+				next = zcp->next;
+				if ((int32_t)(zcp->seq - lo) < 0 || (int32_t)(zcp->seq - hi) > 0) {
+					prev = zcp;
+					continue;
+				}
+				if (prev) {
+					prev->next = next;
+				} else {
+					zc->head = next;
+				}
+				if (zc->tail == zcp) {
+					zc->tail = prev;
+				}
+				objunref(zcp->data);
+				free(zcp);
+			}
+		}
+	}
+}
+#endif
+
+/** @brief Process zero copy completions on a socket that is ready.
+  *
+  * Completions wake the socket up as a error, this releases the buffers
+  * and checks if there is data to be read.
+  * @param sock Socket that is ready.
+  * @returns 0 if there is no data to read.*/
+int sockio_zcready(struct fwsocket *sock) {
+	struct pollfd pfd;
+
+#ifdef MSG_ZEROCOPY
+	objlock(sock);
+	sockio_zcreap(sock);
+	objunlock(sock);
+#endif
+
+	pfd.fd = sock->sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	/*errors are reported by the read that follows*/
+	return ((poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLIN | POLLHUP | POLLERR)));
+}
+
+/** @brief Write a referenced buffer to a socket without copying it.
+  *
+  * The buffer is sent with MSG_ZEROCOPY a reference is held until the
+  * kernel reports it is done with the pages, completions are processed
+  * on later writes and when the socket is woken up.
+  * If zero copy is not available or the kernel copied previous buffers
+  * the data is sent with socketwrite().
+  * @warning The buffer must not be modified until the kernel releases it.
+  * @note Zero copy only pays off for large buffers (10k or more).
+  * @param sock Socket to write too (SSL sockets are written with socketwrite()).
+  * @param buf Referenced buffer to send.
+  * @param num Number of bytes to send.
+  * @returns Number of bytes written or -1 on error.*/
+extern int socketwrite_zc(struct fwsocket *sock, void *buf, int num) {
+#ifdef MSG_ZEROCOPY
+	struct sock_zerocopy *zc;
+	struct zc_pending *zcp;
+	int ret, on = 1;
+#endif
+
+	if (!sock || !buf) {
+		return (-1);
+	}
+
+#ifdef MSG_ZEROCOPY
+	if (sock->ssl || testflag(sock, SOCK_FLAG_SSL) || !objref(buf)) {
+		return (socketwrite(sock, buf, num));
+	}
+
+	objlock(sock);
+	if (!sock->zerocopy) {
+		if (!(sock->zerocopy = objalloc(sizeof(*sock->zerocopy), free_zerocopy))) {
+			objunlock(sock);
+			objunref(buf);
+			return (socketwrite(sock, buf, num));
+		}
+		sock->zerocopy->enabled = !setsockopt(sock->sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+	}
+	zc = sock->zerocopy;
+
+	sockio_zcreap(sock);
+	if (!zc->enabled || !(zcp = malloc(sizeof(*zcp)))) {
+		objunlock(sock);
+		objunref(buf);
+		return (socketwrite(sock, buf, num));
+	}
+
+	ret = send(sock->sock, buf, num, MSG_ZEROCOPY | MSG_NOSIGNAL);
+	sockstats_io(sock, SOCK_STATS_OUT, ret, 1);
+	if (ret <= 0) {
+		free(zcp);
+		objunref(buf);
+		/*out of option memory for pinned pages*/
+		if ((ret < 0) && (errno == ENOBUFS)) {
+			objunlock(sock);
+			return (socketwrite(sock, buf, num));
+		}
+		sockio_error(sock);
+		objunlock(sock);
+		return (ret);
+	}
+
+	zcp->seq = zc->next++;
+	zcp->data = buf;
+	zcp->next = NULL;
+	if (zc->tail) {
+		zc->tail->next = zcp;
+	} else {
+		zc->head = zcp;
+	}
+	zc->tail = zcp;
+	objunlock(sock);
+
+	return (ret);
+#else
+	return (socketwrite(sock, buf, num));
+#endif
+}
+
+/** @brief Send data from a file to a socket without copying it to user space.
+  *
+  * sendfile() is used if it refuses the file (or socket) the data is
+  * spliced through a pipe.
+  * @note SSL sockets are only sent without copying when the kernel encrypts
+  * the session (ssl_ktls()) else the file is read and written a record at a time.
+  * @param sock Socket to write too.
+  * @param fd File descriptor to send from.
+  * @param offset Offset to start at updated with the new offset if NULL the file offset is used and updated.
+  * @param count Number of bytes to send.
+  * @returns Number of bytes sent or -1 on error.*/
+extern ssize_t socket_sendfile(struct fwsocket *sock, int fd, off_t *offset, size_t count) {
+	ssize_t ret, len, sent = 0;
+	loff_t off, *poff = NULL;
+	int pfd[2], err = 0;
+
+	if (!sock || (fd < 0)) {
+		return (-1);
+	}
+
+	if (sock->ssl || testflag(sock, SOCK_FLAG_SSL)) {
+		return (ssl_sendfile(sock, fd, offset, count));
+	}
+
+	objlock(sock);
+	/*0 is the end of the file errno is only set on error*/
+	while(sent < (ssize_t)count) {
+		if ((ret = sendfile(sock->sock, fd, offset, count - sent)) < 0) {
+			err = errno;
+			break;
+		} else if (!ret) {
+			break;
+		}
+		sent += ret;
+	}
+
+	if ((sent < (ssize_t)count) && ((err == EINVAL) || (err == ENOSYS)) && !pipe(pfd)) {
+		if (offset) {
+			off = *offset;
+			poff = &off;
+		}
+		err = 0;
+		while(sent < (ssize_t)count) {
+			if ((len = splice(fd, poff, pfd[1], NULL, count - sent, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+				err = (len < 0) ? errno : 0;
+				break;
+			}
+			while(len > 0) {
+				if ((ret = splice(pfd[0], NULL, sock->sock, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+					err = (ret < 0) ? errno : 0;
+					break;
+				}
+				len -= ret;
+				sent += ret;
+			}
+			/*data is stuck in the pipe*/
+			if (len) {
+				break;
+			}
+		}
+		close(pfd[0]);
+		close(pfd[1]);
+		if (offset) {
+			*offset = off;
+		}
+	}
+
+	if ((sent < (ssize_t)count) && (sent <= 0) && err) {
+		errno = err;
+		sockio_error(sock);
+	}
+	sockstats_io(sock, SOCK_STATS_OUT, (sent > 0) ? sent : -1, 1);
+	objunlock(sock);
+
+	return ((sent) ? sent : -1);
+}
+
+/*splice only returns EAGAIN from a socket that is non blocking*/
+static void sockproxy_nonblock(struct fwsocket *sock, int on) {
+	int flags;
+
+	if ((sock->sock < 0) || ((flags = fcntl(sock->sock, F_GETFL)) < 0)) {
+		return;
+	}
+	fcntl(sock->sock, F_SETFL, (on) ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+static void free_sock_proxy(void *data) {
+	struct sock_proxy *proxy = data;
+	int i;
+
+	for(i = 0; i < 2; i++) {
+		if (proxy->dir[i].pipe[0] >= 0) {
+			close(proxy->dir[i].pipe[0]);
+			close(proxy->dir[i].pipe[1]);
+		}
+		if (proxy->sock[i]) {
+			sockproxy_nonblock(proxy->sock[i], 0);
+			objunref(proxy->sock[i]);
+		}
+	}
+}
+
+/*stop both sides this removes them from there handlers*/
+static void sockproxy_close(struct sock_proxy *proxy) {
+	setflag(proxy, SOCK_FLAG_CLOSE);
+	setflag(proxy->sock[0], SOCK_FLAG_CLOSE);
+	setflag(proxy->sock[1], SOCK_FLAG_CLOSE);
+}
+
+/*move the data in the pipe to the peer
+ * returns 1 if the peer can not take more now*/
+static int sockproxy_drain(struct proxy_dir *dir, struct fwsocket *dst) {
+	ssize_t ret;
+
+	while(dir->pending) {
+		if ((ret = splice(dir->pipe[0], NULL, dst->sock, NULL, dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+			dir->pending -= ret;
+			sockstats_io(dst, SOCK_STATS_OUT, ret, 1);
+			continue;
+		}
+
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((ret < 0) && (errno == EAGAIN)) {
+			return (1);
+		}
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*move what is waiting on src to dst must hold the proxy lock
+ * returns 1 if dst is full 2 once src has closed and -1 on error*/
+static int sockproxy_pump(struct proxy_dir *dir, struct fwsocket *src, struct fwsocket *dst) {
+	ssize_t ret;
+	int res;
+
+	for(;;) {
+		/*the pipe is empty before reading so EAGAIN is from the source*/
+		if ((res = sockproxy_drain(dir, dst)) || dir->eof) {
+			return (res);
+		}
+
+		ret = splice(src->sock, NULL, dir->pipe[1], NULL, SOCK_PROXY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((ret < 0) && (errno == EAGAIN)) {
+			sockstats_io(src, SOCK_STATS_IN, ret, 1);
+			return (0);
+		} else if (ret < 0) {
+			return (-1);
+		} else if (!ret) {
+			return (2);
+		}
+
+		sockstats_io(src, SOCK_STATS_IN, ret, 1);
+		dir->pending += ret;
+	}
+}
+
+/*act on the result of sockproxy_pump() must hold the proxy lock
+ * a full peer stops the source been read until it can be written
+ * returns 1 if the proxy is to be closed*/
+static int sockproxy_state(struct sock_proxy *proxy, int idx, int res) {
+	struct proxy_dir *dir = &proxy->dir[idx];
+	struct fwsocket *src = proxy->sock[idx];
+	struct fwsocket *dst = proxy->sock[!idx];
+
+	switch(res) {
+		case 0:
+			if (!dir->eof) {
+				clearflag(src, SOCK_FLAG_NOREAD);
+			}
+			break;
+		case 1:
+			setflag(src, SOCK_FLAG_NOREAD);
+			setflag(dst, SOCK_FLAG_POLLOUT);
+			socketloop_pollout(dst);
+			break;
+		case 2:
+			/*pass on the half close and stop reading the source
+			 * it stays open to the other direction*/
+			shutdown(dst->sock, SHUT_WR);
+			setflag(src, SOCK_FLAG_NOREAD);
+			dir->eof = 1;
+			return (proxy->dir[!idx].eof);
+		default:
+			return (1);
+	}
+
+	return (0);
+}
+
+/*callback for both sides first move the data waiting for the socket if
+ * it has been waiting to be written then what is waiting on the socket*/
+static void sockproxy_read(struct fwsocket *sock, void *data) {
+	struct sock_proxy *proxy = data;
+	int idx, done = 0;
+
+	idx = (sock == proxy->sock[0]) ? 0 : 1;
+
+	objlock(proxy);
+	if (testflag(sock, SOCK_FLAG_POLLOUT)) {
+		clearflag(sock, SOCK_FLAG_POLLOUT);
+		done = sockproxy_state(proxy, !idx, sockproxy_pump(&proxy->dir[!idx], proxy->sock[!idx], sock));
+	}
+	if (!done && !proxy->dir[idx].eof) {
+		done = sockproxy_state(proxy, idx, sockproxy_pump(&proxy->dir[idx], sock, proxy->sock[!idx]));
+	}
+	objunlock(proxy);
+
+	if (done) {
+		sockproxy_close(proxy);
+	}
+}
+
+/** @brief Relay data between two sockets in the kernel.
+  *
+  * Data read on either socket is spliced through a pipe to the other
+  * without been copied to user space. When one side closes its write side
+  * the other is shut down for writing (half close) and data continues to
+  * flow the other way until it closes too or either socket fails.
+  * Both sockets are serviced by the event loop if running else a thread each.
+  * @note Only plain stream sockets are supported not SSL sockets.
+  * @note The other socket is not read while a peer does not take data.
+  * @note The sockets are non blocking while the proxy runs.
+  * @warning Release your reference with objunref() close_socket() stops the proxy.
+  * @param a Socket to relay.
+  * @param b Socket to relay.
+  * @returns 0 on failure.*/
+extern int socket_proxy(struct fwsocket *a, struct fwsocket *b) {
+	struct sock_proxy *proxy;
+	int i;
+
+	if (!a || !b || (a == b) || (a->type != SOCK_STREAM) || (b->type != SOCK_STREAM) ||
+			a->ssl || b->ssl || testflag(a, SOCK_FLAG_SSL) || testflag(b, SOCK_FLAG_SSL)) {
+		return (0);
+	}
+
+	if (!(proxy = objalloc(sizeof(*proxy), free_sock_proxy))) {
+		return (0);
+	}
+
+	proxy->dir[0].pipe[0] = -1;
+	proxy->dir[1].pipe[0] = -1;
+	for(i = 0; i < 2; i++) {
+		if (pipe2(proxy->dir[i].pipe, O_CLOEXEC)) {
+			objunref(proxy);
+			return (0);
+		}
+		fcntl(proxy->dir[i].pipe[1], F_SETPIPE_SZ, SOCK_PROXY_CHUNK);
+	}
+
+	proxy->sock[0] = (objref(a)) ? a : NULL;
+	proxy->sock[1] = (objref(b)) ? b : NULL;
+	if (!proxy->sock[0] || !proxy->sock[1]) {
+		objunref(proxy);
+		return (0);
+	}
+
+	/*reads stop at EAGAIN and a full peer is run again once it can be written*/
+	sockproxy_nonblock(a, 1);
+	sockproxy_nonblock(b, 1);
+
+	socketclient(a, proxy, sockproxy_read, NULL);
+	socketclient(b, proxy, sockproxy_read, NULL);
+	objunref(proxy);
+
+	return (1);
+}
+
+static void free_outq_chain(struct outq_chunk *chunk) {
+	struct outq_chunk *next;
+
+	for(; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+static void free_outq(void *data) {
+	struct sock_outq *outq = data;
+
+	free_outq_chain(outq->head);
+}
+
+static struct outq_chunk *outq_chunk_new(int size) {
+	struct outq_chunk *chunk;
+
+	if (!(chunk = malloc(sizeof(*chunk) + size))) {
+		return NULL;
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->len = 0;
+	chunk->off = 0;
+	chunk->data = (char *)chunk + sizeof(*chunk);
+
+	return (chunk);
+}
+
+/*return the output queue of the socket creating it if needed sock must be locked*/
+static struct sock_outq *sockio_outq(struct fwsocket *sock) {
+	if (!sock->outq && (sock->outq = objalloc(sizeof(*sock->outq), free_outq))) {
+		sock->outq->hwm = SOCK_OUTQ_HWM;
+	}
+	return (sock->outq);
+}
+
+/** @brief Set the high water mark of the output queue.
+  *
+  * @see socket_queue
+  * @param sock Socket.
+  * @param hwm Number of bytes queued before the queue is reported full.*/
+extern void socket_sethwm(struct fwsocket *sock, size_t hwm) {
+	struct sock_outq *outq;
+
+	if (!sock) {
+		return;
+	}
+
+	objlock(sock);
+	if ((outq = sockio_outq(sock))) {
+		outq->hwm = hwm;
+	}
+	objunlock(sock);
+}
+
+/** @brief Add data to the output queue of a socket.
+  *
+  * The data is copied small writes are joined together and sent
+  * with socket_flush() this reduces the number of system calls and
+  * packets (or SSL records) sent.
+  * @note Only stream sockets are supported.
+  * @param sock Socket to queue the data on.
+  * @param buf Data to queue.
+  * @param num Length of data.
+  * @returns -1 on error 0 if the queue is above the high water mark and should be flushed before adding more or 1.*/
+extern int socket_queue(struct fwsocket *sock, const void *buf, int num) {
+	struct sock_outq *outq;
+	struct outq_chunk *chunk;
+	int len, ret;
+
+	if (!sock || !buf || (num < 0) || (sock->type != SOCK_STREAM)) {
+		return (-1);
+	}
+
+	objlock(sock);
+	if (!(outq = sockio_outq(sock))) {
+		objunlock(sock);
+		return (-1);
+	}
+
+	while(num > 0) {
+		if (!(chunk = outq->tail) || (chunk->len == chunk->size)) {
+			if (!(chunk = outq_chunk_new(SOCK_OUTQ_CHUNK))) {
+				objunlock(sock);
+				return (-1);
+			}
+			if (outq->tail) {
+				outq->tail->next = chunk;
+			} else {
+				outq->head = chunk;
+			}
+			outq->tail = chunk;
+		}
+		len = chunk->size - chunk->len;
+		if (len > num) {
+			len = num;
+		}
+		memcpy(chunk->data + chunk->len, buf, len);
+		chunk->len += len;
+		outq->pending += len;
+		buf = (const char *)buf + len;
+		num -= len;
+	}
+	ret = (outq->pending > outq->hwm) ? 0 : 1;
+	objunlock(sock);
+
+	return (ret);
+}
+
+/** @brief Return the number of bytes waiting in the output queue.
+  * @param sock Socket.
+  * @returns Bytes queued.*/
+extern size_t socket_queued(struct fwsocket *sock) {
+	size_t ret = 0;
+
+	if (!sock) {
+		return (0);
+	}
+
+	objlock(sock);
+	if (sock->outq) {
+		ret = sock->outq->pending;
+	}
+	objunlock(sock);
+
+	return (ret);
+}
+
+/*write the chain with writev advancing the chunks as data is written*/
+static int outq_writev(struct fwsocket *sock, struct outq_chunk *head) {
+	struct iovec iov[SOCK_OUTQ_IOV];
+	struct outq_chunk *chunk;
+	int cnt, ret, sent = 0;
+
+	while(head) {
+		for(cnt = 0, chunk = head; chunk && (cnt < SOCK_OUTQ_IOV); chunk = chunk->next) {
+			if (chunk->off == chunk->len) {
+				continue;
+			}
+			iov[cnt].iov_base = chunk->data + chunk->off;
+			iov[cnt].iov_len = chunk->len - chunk->off;
+			cnt++;
+		}
+		if (!cnt) {
+			break;
+		}
+
+		ret = writev(sock->sock, iov, cnt);
+		sockstats_io(sock, SOCK_STATS_OUT, ret, 1);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			objlock(sock);
+			sockio_error(sock);
+			objunlock(sock);
+			return ((sent) ? sent : -1);
+		}
+		sent += ret;
+
+		for(; head && ret; head = head->next) {
+			if ((head->len - head->off) > ret) {
+				head->off += ret;
+				break;
+			}
+			ret -= head->len - head->off;
+			head->off = head->len;
+		}
+		while (head && (head->off == head->len)) {
+			head = head->next;
+		}
+	}
+
+	return (sent);
+}
+
+/*SSL sockets write a record per buffer*/
+static int outq_sslwrite(struct fwsocket *sock, struct outq_chunk *head) {
+	int ret, sent = 0;
+
+	for(; head; head = head->next) {
+		while(head->off < head->len) {
+			if ((ret = socketwrite(sock, head->data + head->off, head->len - head->off)) <= 0) {
+				return ((sent) ? sent : -1);
+			}
+			head->off += ret;
+			sent += ret;
+		}
+	}
+
+	return (sent);
+}
+
+/** @brief Write the output queue to the socket.
+  *
+  * Plain sockets are corked and the queue written with writev,
+  * TCP_NODELAY is set so the last segment is sent without delay when
+  * uncorked. SSL sockets write a record for each buffer of up to 16k.
+  * @note Data not written due to a error remains queued.
+  * @param sock Socket to flush.
+  * @returns Number of bytes written or -1 on error.*/
+extern int socket_flush(struct fwsocket *sock) {
+	struct sock_outq *outq;
+	struct outq_chunk *head, *chunk;
+	int ret, ssl, on = 1, off = 0;
+
+	if (!sock) {
+		return (-1);
+	}
+
+	/*take the queue new data will be queued behind it*/
+	objlock(sock);
+	if (!(outq = sock->outq) || !outq->head || outq->flushing) {
+		objunlock(sock);
+		return (0);
+	}
+	objref(outq);
+	head = outq->head;
+	outq->head = NULL;
+	outq->tail = NULL;
+	outq->flushing = 1;
+	ssl = (sock->ssl || (sock->flags & SOCK_FLAG_SSL)) ? 1 : 0;
+	if (!ssl && !outq->nodelay) {
+		setsockopt(sock->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		outq->nodelay = 1;
+	}
+	objunlock(sock);
+
+	if (ssl) {
+		ret = outq_sslwrite(sock, head);
+	} else {
+		setsockopt(sock->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+		ret = outq_writev(sock, head);
+		setsockopt(sock->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	}
+
+	/*free what was written and put anything left back at the front*/
+	while(head && (head->off == head->len)) {
+		chunk = head;
+		head = head->next;
+		free(chunk);
+	}
+
+	objlock(sock);
+	if (ret > 0) {
+		outq->pending -= ret;
+	}
+	if (head) {
+		for(chunk = head; chunk->next; chunk = chunk->next);
+		chunk->next = outq->head;
+		if (!outq->tail) {
+			outq->tail = chunk;
+		}
+		outq->head = head;
+	}
+	outq->flushing = 0;
+	objunlock(sock);
+	objunref(outq);
+
+	return (ret);
+}
+
+/** @}*/
@@ -0,0 +1,926 @@
+/*
+Copyright (C) 2012  Gregory Nietsky <gregory@distrotetch.co.za>
+        http://www.distrotech.co.za
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @addtogroup LIB-Sock-Loop
+  * @{
+  *
+  * @file
+  * @brief Service sockets from a small number of epoll event loop threads.
+  *
+  * Once socketloop_init() has been called socketserver() and socketclient()
+  * register the socket with a loop instead of starting a thread per socket.
+  * Sockets are registered edge triggered the read callback is called until
+  * the socket has no more data or its budget is used up, a timerfd ticks
+  * each loop to handle DTLS timeouts and reap closed sockets.
+  *
+  * Loops use epoll or io_uring multishot poll requests when selected with
+  * socketloop_init_engine() and supported by the kernel.
+  *
+  * Other threads hand a socket back to its loop with a eventfd the loop
+  * runs the sockets queued on it as if they were ready.*/
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "include/dtsapp.h"
+#include "include/private.h"
+
+/** @brief Events returned per call to epoll_wait.*/
+#define SOCKLOOP_EVENTS		64
+/** @brief Number of times the callback is called for a socket before moving on.*/
+#define SOCKLOOP_BUDGET		16
+/** @brief Interval of the loop timer in ms.*/
+#define SOCKLOOP_TICK		100
+/** @brief Number of submission queue entries of a io_uring loop.*/
+#define SOCKLOOP_URING_ENTRIES	256
+/** @brief io_uring user data of the loop timer.*/
+#define SOCKLOOP_URING_TIMER	0
+/** @brief io_uring user data of the loop eventfd.*/
+#define SOCKLOOP_URING_WAKE	(UINT64_MAX - 1)
+/** @brief Size of the queue of sockets woken by other threads (bits).*/
+#define SOCKLOOP_WAKE_QUEUE	10
+/** @brief io_uring user data of requests with no completion handling.*/
+#define SOCKLOOP_URING_IGNORE	UINT64_MAX
+/** @brief io_uring user data bit marking a single shot poll.*/
+#define SOCKLOOP_URING_ONESHOT	(1ULL << 62)
+/** @brief io_uring user data bit marking a single shot poll standing in for a failed multishot.*/
+#define SOCKLOOP_URING_REARM	(1ULL << 61)
+/** @brief io_uring user data bit marking a single shot poll for the socket to be written.*/
+#define SOCKLOOP_URING_POLLOUT	(1ULL << 60)
+
+/** @brief Event loop flags.*/
+enum socket_loop_flags {
+	/** @brief The loop has been asked to stop.*/
+	SOCKLOOP_FLAG_STOP	= 1 << 0
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+/** @brief io_uring instance of a event loop.
+  *
+  * The submission queue is shared with threads adding sockets and
+  * is protected by the lock, completions are only read by the loop.*/
+struct sockloop_uring {
+	/** @brief io_uring FD.*/
+	int fd;
+	/** @brief Number of submission queue entries.*/
+	unsigned entries;
+	/** @brief Submission queue head.*/
+	unsigned *sq_head;
+	/** @brief Submission queue tail.*/
+	unsigned *sq_tail;
+	/** @brief Submission queue mask.*/
+	unsigned *sq_mask;
+	/** @brief Submission queue index array.*/
+	unsigned *sq_array;
+	/** @brief Completion queue head.*/
+	unsigned *cq_head;
+	/** @brief Completion queue tail.*/
+	unsigned *cq_tail;
+	/** @brief Completion queue mask.*/
+	unsigned *cq_mask;
+	/** @brief Submission queue entries.*/
+	struct io_uring_sqe *sqes;
+	/** @brief Completion queue entries.*/
+	struct io_uring_cqe *cqes;
+	/** @brief Mapping of the submission ring.*/
+	void *sq_ring;
+	/** @brief Size of the submission ring mapping.*/
+	size_t sq_len;
+	/** @brief Mapping of the completion ring may be the same as sq_ring.*/
+	void *cq_ring;
+	/** @brief Size of the completion ring mapping.*/
+	size_t cq_len;
+	/** @brief Size of the submission entry mapping.*/
+	size_t sqe_len;
+	/** @brief Lock protecting the submission queue.*/
+	pthread_mutex_t lock;
+};
+#endif
+
+/** @brief Event loop serviced by a single thread.*/
+struct socket_loop {
+	/** @brief Epoll FD.*/
+	int epfd;
+#ifdef HAVE_LINUX_IO_URING_H
+	/** @brief io_uring used in place of epoll if set.*/
+	struct sockloop_uring *uring;
+#endif
+	/** @brief Timer FD driving the loop tick.*/
+	int timerfd;
+	/** @brief Eventfd signaled when a socket is queued on wake.*/
+	int wakefd;
+	/** @brief Socket handlers to run queued by other threads.
+	  * @see socketloop_wake()*/
+	struct ring_buffer *wake;
+	/** @brief Loop flags.
+	  * @see socket_loop_flags*/
+	int flags;
+	/** @brief Socket handlers registered with this loop.*/
+	struct bucket_list *handlers;
+};
+
+/** @brief Container holding the running loops.*/
+struct socket_loops {
+	/** @brief Number of loops.*/
+	int count;
+	/** @brief Next loop to be assigned a socket.*/
+	int next;
+	/** @brief Engine used by the loops.
+	  * @see socket_loop_engine*/
+	int engine;
+	/** @brief Array of loops.*/
+	struct socket_loop **loop;
+};
+
+/*running loops set and cleared under sockloops_lock*/
+static struct socket_loops *sockloops = NULL;
+static pthread_mutex_t sockloops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*return a reference to the running loops*/
+static struct socket_loops *sockloop_get(void) {
+	struct socket_loops *sl;
+
+	pthread_mutex_lock(&sockloops_lock);
+	sl = (sockloops && objref(sockloops)) ? sockloops : NULL;
+	pthread_mutex_unlock(&sockloops_lock);
+
+	return (sl);
+}
+
+static int32_t hash_handler(const void *data, int key) {
+	const struct socket_handler *sockh = data;
+	const int *hashkey = (key) ? data : &sockh->sock->sock;
+
+	return (*hashkey);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void free_sockloop_uring(void *data) {
+	struct sockloop_uring *uring = data;
+
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqe_len);
+	}
+	if (uring->cq_ring && (uring->cq_ring != uring->sq_ring)) {
+		munmap(uring->cq_ring, uring->cq_len);
+	}
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_len);
+	}
+	if (uring->fd >= 0) {
+		close(uring->fd);
+	}
+	pthread_mutex_destroy(&uring->lock);
+}
+
+/*map the rings multishot poll needs 5.13 the first kernel with IORING_FEAT_RSRC_TAGS*/
+static struct sockloop_uring *sockloop_uring_new(unsigned entries) {
+	struct sockloop_uring *uring;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	if (!(uring = objalloc(sizeof(*uring), free_sockloop_uring))) {
+		return NULL;
+	}
+	pthread_mutex_init(&uring->lock, NULL);
+
+	memset(&p, 0, sizeof(p));
+	if (((uring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) ||
+			!(p.features & IORING_FEAT_RSRC_TAGS)) {
+		objunref(uring);
+		return NULL;
+	}
+	uring->entries = p.sq_entries;
+
+	uring->sq_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+	uring->cq_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring->sq_len = uring->cq_len = (uring->sq_len > uring->cq_len) ? uring->sq_len : uring->cq_len;
+	}
+
+	uring->sq_ring = mmap(NULL, uring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		objunref(uring);
+		return NULL;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring->cq_ring = uring->sq_ring;
+	} else if ((uring->cq_ring = mmap(NULL, uring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					uring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		uring->cq_ring = NULL;
+		objunref(uring);
+		return NULL;
+	}
+
+	uring->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((uring->sqes = mmap(NULL, uring->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				uring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		uring->sqes = NULL;
+		objunref(uring);
+		return NULL;
+	}
+
+	sq = uring->sq_ring;
+	uring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	uring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	uring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = uring->cq_ring;
+	uring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return (uring);
+}
+
+/*queue a request and submit it now*/
+static int sockloop_uring_submit(struct sockloop_uring *uring, int op, int fd, uint64_t addr, uint32_t len, uint64_t data) {
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	pthread_mutex_lock(&uring->lock);
+	tail = *uring->sq_tail;
+	if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->entries) {
+		pthread_mutex_unlock(&uring->lock);
+		return (-1);
+	}
+
+	idx = tail & *uring->sq_mask;
+	sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->user_data = data;
+	if (op == IORING_OP_POLL_ADD) {
+		/*the wake eventfd user data has all the bits set*/
+		sqe->poll32_events = ((data != SOCKLOOP_URING_WAKE) && (data & SOCKLOOP_URING_POLLOUT)) ? EPOLLOUT : (EPOLLIN | EPOLLRDHUP);
+	}
+	uring->sq_array[idx] = idx;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&uring->lock);
+
+	return (syscall(__NR_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0) < 0) ? -1 : 0;
+}
+
+/*multishot poll for the socket the user data is the FD plus one
+ * oneshot is 1 for a extra single shot, 2 for one replacing the multishot
+ * and 3 for one waiting for the socket to be written*/
+static int sockloop_uring_arm(struct sockloop_uring *uring, int fd, int oneshot) {
+	uint64_t data = (uint64_t)fd + 1;
+
+	if (oneshot) {
+		data |= (oneshot == 2) ? SOCKLOOP_URING_REARM : 0;
+		data |= (oneshot == 3) ? SOCKLOOP_URING_POLLOUT : 0;
+		return sockloop_uring_submit(uring, IORING_OP_POLL_ADD, fd, 0, 0, data | SOCKLOOP_URING_ONESHOT);
+	}
+	return sockloop_uring_submit(uring, IORING_OP_POLL_ADD, fd, 0, IORING_POLL_ADD_MULTI, data);
+}
+
+/*cancel the polls or io_uring keeps the file open*/
+static void sockloop_uring_disarm(struct sockloop_uring *uring, int fd) {
+	uint64_t data = (uint64_t)fd + 1;
+
+	sockloop_uring_submit(uring, IORING_OP_POLL_REMOVE, -1, data, 0, SOCKLOOP_URING_IGNORE);
+	sockloop_uring_submit(uring, IORING_OP_POLL_REMOVE, -1, data | SOCKLOOP_URING_ONESHOT, 0, SOCKLOOP_URING_IGNORE);
+	sockloop_uring_submit(uring, IORING_OP_POLL_REMOVE, -1, data | SOCKLOOP_URING_ONESHOT | SOCKLOOP_URING_REARM, 0, SOCKLOOP_URING_IGNORE);
+	sockloop_uring_submit(uring, IORING_OP_POLL_REMOVE, -1, data | SOCKLOOP_URING_ONESHOT | SOCKLOOP_URING_POLLOUT, 0, SOCKLOOP_URING_IGNORE);
+}
+#endif
+
+static void free_socket_loop(void *data) {
+	struct socket_loop *loop = data;
+	struct socket_handler *sockh;
+
+	if (loop->wake) {
+		while((sockh = ringbuffer_pop(loop->wake))) {
+			objunref(sockh);
+		}
+		objunref(loop->wake);
+	}
+	if (loop->wakefd >= 0) {
+		close(loop->wakefd);
+	}
+	if (loop->handlers) {
+		objunref(loop->handlers);
+	}
+#ifdef HAVE_LINUX_IO_URING_H
+	if (loop->uring) {
+		objunref(loop->uring);
+	}
+#endif
+	if (loop->timerfd >= 0) {
+		close(loop->timerfd);
+	}
+	if (loop->epfd >= 0) {
+		close(loop->epfd);
+	}
+}
+
+static void free_socket_loops(void *data) {
+	struct socket_loops *loops = data;
+	int cnt;
+
+	for(cnt = 0; cnt < loops->count; cnt++) {
+		if (loops->loop[cnt]) {
+			objunref(loops->loop[cnt]);
+		}
+	}
+}
+
+/*the handler has been removed from the loop list close it down*/
+static void sockloop_release(struct socket_loop *loop, struct socket_handler *sockh) {
+#ifdef HAVE_LINUX_IO_URING_H
+	if (loop->uring) {
+		sockloop_uring_disarm(loop->uring, sockh->sock->sock);
+	} else
+#endif
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sockh->sock->sock, NULL);
+	socket_handler_close(sockh);
+	socket_handler_clean(sockh);
+}
+
+static void sockloop_remove(struct socket_loop *loop, struct socket_handler *sockh) {
+	objref(sockh);
+	remove_bucket_item(loop->handlers, sockh);
+	sockloop_release(loop, sockh);
+	objunref(sockh);
+}
+
+/*edge triggered events of the socket*/
+static uint32_t sockloop_events(struct fwsocket *sock) {
+	return (testflag(sock, SOCK_FLAG_POLLOUT)) ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : (EPOLLIN | EPOLLRDHUP | EPOLLET);
+}
+
+/*check for data without blocking including data buffered by SSL*/
+static int sockloop_readable(struct fwsocket *sock) {
+	struct pollfd pfd;
+
+	/*the worker wakes the loop when it is done*/
+	if (ssl_offloaded(sock) || testflag(sock, SOCK_FLAG_NOREAD)) {
+		return (0);
+	} else if (ssl_pending(sock)) {
+		return (1);
+	}
+
+	pfd.fd = sock->sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return ((poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLIN | POLLHUP | POLLERR)));
+}
+
+static void sockloop_run(struct socket_loop *loop, struct socket_handler *sockh) {
+	struct fwsocket *sock = sockh->sock;
+	struct epoll_event ev;
+	int cnt;
+
+	for(cnt = 0; cnt < SOCKLOOP_BUDGET; cnt++) {
+		if (testflag(sock, SOCK_FLAG_CLOSE)) {
+			sockloop_remove(loop, sockh);
+			return;
+		}
+
+		socket_handler_read(sockh);
+
+		if (testflag(sock, SOCK_FLAG_CLOSE)) {
+			sockloop_remove(loop, sockh);
+			return;
+		} else if (!sockloop_readable(sock)) {
+			return;
+		}
+	}
+
+	/*out of budget modifying the registration queues a new event if still ready*/
+#ifdef HAVE_LINUX_IO_URING_H
+	if (loop->uring) {
+		sockloop_uring_arm(loop->uring, sock->sock, 1);
+		return;
+	}
+#endif
+	memset(&ev, 0, sizeof(ev));
+	ev.events = sockloop_events(sock);
+	ev.data.ptr = sockh;
+	epoll_ctl(loop->epfd, EPOLL_CTL_MOD, sock->sock, &ev);
+}
+
+static void sockloop_tick(struct socket_loop *loop) {
+	struct socket_handler *sockh;
+	struct bucket_loop *bloop;
+	uint64_t expired;
+
+	if (read(loop->timerfd, &expired, sizeof(expired)) < 0) {
+		return;
+	}
+
+	bloop = init_bucket_loop(loop->handlers);
+	while(bloop && (sockh = next_bucket_loop(bloop))) {
+		if (testflag(sockh->sock, SOCK_FLAG_CLOSE)) {
+			remove_bucket_loop(bloop);
+			sockloop_release(loop, sockh);
+		} else if ((sockh->sock->type == SOCK_DGRAM) && (sockh->flags & SOCK_FLAG_BIND)) {
+			dtlshandltimeout(sockh->sock);
+		}
+		objunref(sockh);
+	}
+	objunref(bloop);
+}
+
+/*run the sockets other threads have queued on the loop*/
+static void sockloop_wake(struct socket_loop *loop) {
+	struct socket_handler *sockh, *cur;
+	uint64_t cnt;
+
+	/*clear the eventfd first anything queued after signals again*/
+	while((read(loop->wakefd, &cnt, sizeof(cnt)) < 0) && (errno == EINTR));
+
+	while((sockh = ringbuffer_pop(loop->wake))) {
+		/*the socket may have closed and the FD been reused*/
+		if ((cur = bucket_list_find_key(loop->handlers, &sockh->sock->sock))) {
+			if (cur == sockh) {
+				sockloop_run(loop, sockh);
+			}
+			objunref(cur);
+		}
+		objunref(sockh);
+	}
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*a completion for a socket there may be several queued for a socket
+ * that has since been drained or closed so check it is readable*/
+static void sockloop_uring_event(struct socket_loop *loop, uint64_t data, int res, unsigned flags) {
+	struct socket_handler *sockh;
+	int fd = (int)((data & ~(SOCKLOOP_URING_ONESHOT | SOCKLOOP_URING_REARM | SOCKLOOP_URING_POLLOUT)) - 1);
+
+	if (data == SOCKLOOP_URING_TIMER) {
+		if (!(flags & IORING_CQE_F_MORE)) {
+			sockloop_uring_submit(loop->uring, IORING_OP_POLL_ADD, loop->timerfd, 0, IORING_POLL_ADD_MULTI, SOCKLOOP_URING_TIMER);
+		}
+		sockloop_tick(loop);
+		return;
+	} else if (data == SOCKLOOP_URING_WAKE) {
+		if (!(flags & IORING_CQE_F_MORE)) {
+			sockloop_uring_submit(loop->uring, IORING_OP_POLL_ADD, loop->wakefd, 0, IORING_POLL_ADD_MULTI, SOCKLOOP_URING_WAKE);
+		}
+		sockloop_wake(loop);
+		return;
+	}
+
+	if ((data == SOCKLOOP_URING_IGNORE) || (res == -ECANCELED) ||
+			!(sockh = bucket_list_find_key(loop->handlers, &fd))) {
+		return;
+	}
+
+	/*the multishot poll has stopped start another or a single shot on error
+	 * that starts the multishot again when it completes*/
+	if (!(data & SOCKLOOP_URING_ONESHOT) && !(flags & IORING_CQE_F_MORE)) {
+		sockloop_uring_arm(loop->uring, fd, (res < 0) ? 2 : 0);
+	} else if ((data & SOCKLOOP_URING_REARM) && (res < 0)) {
+		/*the socket can not be polled*/
+		setflag(sockh->sock, SOCK_FLAG_CLOSE);
+	} else if (data & SOCKLOOP_URING_REARM) {
+		sockloop_uring_arm(loop->uring, fd, 0);
+	}
+
+	if (((data & SOCKLOOP_URING_POLLOUT) && (res > 0)) || testflag(sockh->sock, SOCK_FLAG_CLOSE) ||
+			sockloop_readable(sockh->sock)) {
+		sockloop_run(loop, sockh);
+	}
+	objunref(sockh);
+}
+
+static void sockloop_uring_wait(struct socket_loop *loop) {
+	struct sockloop_uring *uring = loop->uring;
+	struct io_uring_cqe cqe;
+	unsigned head;
+
+	if ((syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR)) {
+		setflag(loop, SOCKLOOP_FLAG_STOP);
+		return;
+	}
+
+	head = *uring->cq_head;
+	while(head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = uring->cqes[head & *uring->cq_mask];
+		__atomic_store_n(uring->cq_head, ++head, __ATOMIC_RELEASE);
+		sockloop_uring_event(loop, cqe.user_data, cqe.res, cqe.flags);
+	}
+}
+#endif
+
+static void *sockloop_thread(void *data) {
+	struct socket_loop *loop = data;
+	struct epoll_event events[SOCKLOOP_EVENTS];
+	int cnt, evcnt;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	while(loop->uring && framework_threadok() && !testflag(loop, SOCKLOOP_FLAG_STOP)) {
+		sockloop_uring_wait(loop);
+	}
+#endif
+
+	while(framework_threadok() && !testflag(loop, SOCKLOOP_FLAG_STOP)) {
+		if ((evcnt = epoll_wait(loop->epfd, events, SOCKLOOP_EVENTS, -1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for(cnt = 0; cnt < evcnt; cnt++) {
+			if (!events[cnt].data.ptr) {
+				sockloop_tick(loop);
+			} else if (events[cnt].data.ptr == loop) {
+				sockloop_wake(loop);
+			} else {
+				sockloop_run(loop, events[cnt].data.ptr);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*the loop is going away close all the sockets it holds*/
+static void sockloop_clean(void *data) {
+	struct socket_loop *loop = data;
+	struct socket_handler *sockh;
+	struct bucket_loop *bloop;
+
+	bloop = init_bucket_loop(loop->handlers);
+	while(bloop && (sockh = next_bucket_loop(bloop))) {
+		remove_bucket_loop(bloop);
+		sockloop_release(loop, sockh);
+		objunref(sockh);
+	}
+	objunref(bloop);
+}
+
+static struct socket_loop *sockloop_new(int idx, int engine) {
+	struct socket_loop *loop;
+	struct itimerspec its;
+	struct epoll_event ev;
+	struct thread_attr attr;
+	struct thread_pvt *thread;
+	char name[16];
+
+	if (!(loop = objalloc(sizeof(*loop), free_socket_loop))) {
+		return NULL;
+	}
+	loop->epfd = -1;
+	loop->timerfd = -1;
+	loop->wakefd = -1;
+
+	if (!(loop->handlers = create_bucketlist(6, hash_handler)) ||
+			!(loop->wake = create_ringbuffer(SOCKLOOP_WAKE_QUEUE, RING_BUFFER_MPSC)) ||
+			((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+			((loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) ||
+			((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)) {
+		objunref(loop);
+		return NULL;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_nsec = SOCKLOOP_TICK * 1000000;
+	its.it_value = its.it_interval;
+
+	/*the timer is the only event without a handler*/
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if (timerfd_settime(loop->timerfd, 0, &its, NULL) ||
+			epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev)) {
+		objunref(loop);
+		return NULL;
+	}
+
+	/*the eventfd is known by pointing at the loop*/
+	ev.data.ptr = loop;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev)) {
+		objunref(loop);
+		return NULL;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	/*the epoll FD is kept unused if io_uring is available*/
+	if ((engine == SOCKLOOP_ENGINE_URING) && (loop->uring = sockloop_uring_new(SOCKLOOP_URING_ENTRIES)) &&
+			(sockloop_uring_submit(loop->uring, IORING_OP_POLL_ADD, loop->timerfd, 0, IORING_POLL_ADD_MULTI, SOCKLOOP_URING_TIMER) ||
+			 sockloop_uring_submit(loop->uring, IORING_OP_POLL_ADD, loop->wakefd, 0, IORING_POLL_ADD_MULTI, SOCKLOOP_URING_WAKE))) {
+		objunref(loop->uring);
+		loop->uring = NULL;
+	}
+#endif
+
+	memset(&attr, 0, sizeof(attr));
+	/*thread names are limited to 15 characters leaving 6 digits for the index*/
+	snprintf(name, sizeof(name), "sockloop/%u", (unsigned int)idx % 1000000);
+	attr.name = name;
+
+	/*the thread holds its own reference to the loop*/
+	if (!(thread = framework_mkthread_attr(sockloop_thread, sockloop_clean, NULL, loop, THREAD_OPTION_RETURN, &attr))) {
+		objunref(loop);
+		return NULL;
+	}
+	objunref(thread);
+
+	return (loop);
+}
+
+/** @brief Start event loop threads to service sockets.
+  *
+  * Sockets started with socketserver() or socketclient() after this is
+  * called are added to a loop in turn instead of running in there own thread.
+  * The read callback is called from the loop thread and must not block.
+  * @note If the loops are already running the count is returned.
+  * @param loops Number of loop threads to start 0 starts one per CPU.
+  * @returns Number of loops running.*/
+extern int socketloop_init(int loops) {
+	return (socketloop_init_engine(loops, SOCKLOOP_ENGINE_EPOLL));
+}
+
+/** @brief Start event loop threads using the selected engine.
+  *
+  * If io_uring is requested but not supported by the kernel (5.13 or later)
+  * epoll is used.
+  * @see socketloop_init()
+  * @see socketloop_engine()
+  * @param loops Number of loop threads to start 0 starts one per CPU.
+  * @param engine Engine to use from socket_loop_engine.
+  * @returns Number of loops running.*/
+extern int socketloop_init_engine(int loops, int engine) {
+	struct socket_loops *sl;
+	int cnt;
+
+	/*the first caller starts the loops*/
+	pthread_mutex_lock(&sockloops_lock);
+	if (sockloops) {
+		cnt = sockloops->count;
+		pthread_mutex_unlock(&sockloops_lock);
+		return (cnt);
+	}
+
+	if (loops <= 0) {
+		loops = framework_cpucount();
+	}
+
+	if (!(sl = objalloc(sizeof(*sl) + (sizeof(void *) * loops), free_socket_loops))) {
+		pthread_mutex_unlock(&sockloops_lock);
+		return (0);
+	}
+	sl->loop = (void *)((char *)sl + sizeof(*sl));
+
+	for(cnt = 0; cnt < loops; cnt++) {
+		if (!(sl->loop[sl->count] = sockloop_new(cnt, engine))) {
+			continue;
+		}
+		sl->count++;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (sl->count && sl->loop[0]->uring) {
+		sl->engine = SOCKLOOP_ENGINE_URING;
+	}
+#endif
+
+	if (!sl->count) {
+		pthread_mutex_unlock(&sockloops_lock);
+		objunref(sl);
+		return (0);
+	}
+
+	sockloops = sl;
+	cnt = sl->count;
+	pthread_mutex_unlock(&sockloops_lock);
+
+	return (cnt);
+}
+
+/** @brief Return the engine used by the event loops.
+  * @returns Engine from socket_loop_engine or -1 if the loops are not running.*/
+extern int socketloop_engine(void) {
+	struct socket_loops *sl;
+	int engine;
+
+	if (!(sl = sockloop_get())) {
+		return (-1);
+	}
+	engine = sl->engine;
+	objunref(sl);
+
+	return (engine);
+}
+
+/** @brief Stop the event loop threads.
+  *
+  * Sockets held by the loops are closed and there cleanup called as
+  * if there thread had exited, new sockets will run in there own thread.*/
+extern void socketloop_close(void) {
+	struct socket_loops *sl;
+	int cnt, drop = 0;
+
+	if (!(sl = sockloop_get())) {
+		return;
+	}
+
+	pthread_mutex_lock(&sockloops_lock);
+	if (sockloops == sl) {
+		sockloops = NULL;
+		drop = 1;
+	}
+	pthread_mutex_unlock(&sockloops_lock);
+
+	/*drop the reference held by sockloops*/
+	if (drop) {
+		objunref(sl);
+	}
+
+	for(cnt = 0; cnt < sl->count; cnt++) {
+		setflag(sl->loop[cnt], SOCKLOOP_FLAG_STOP);
+	}
+	objunref(sl);
+}
+
+/** @brief Add a socket handler to a event loop.
+  *
+  * The socket is added to the loops in turn.
+  * @param sockh Socket handler the loop takes a reference.
+  * @returns 0 if there is no loop to add the socket too.*/
+int socketloop_add(struct socket_handler *sockh) {
+	struct socket_loops *sl;
+	struct socket_loop *loop;
+	struct epoll_event ev;
+
+	if (!(sl = sockloop_get())) {
+		return (0);
+	}
+
+	objlock(sl);
+	loop = sl->loop[sl->next];
+	sl->next = (sl->next + 1) % sl->count;
+	objref(loop);
+	objunlock(sl);
+	objunref(sl);
+
+	sockh->flags |= SOCK_HANDLER_LOOP;
+	if (testflag(loop, SOCKLOOP_FLAG_STOP) || !addtobucket(loop->handlers, sockh)) {
+		sockh->flags &= ~SOCK_HANDLER_LOOP;
+		objunref(loop);
+		return (0);
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (loop->uring) {
+		if (sockloop_uring_arm(loop->uring, sockh->sock->sock, 0)) {
+			sockh->flags &= ~SOCK_HANDLER_LOOP;
+			remove_bucket_item(loop->handlers, sockh);
+			objunref(loop);
+			return (0);
+		}
+		objunref(loop);
+		return (1);
+	}
+#endif
+
+	/*registration reports the socket ready if data is waiting*/
+	memset(&ev, 0, sizeof(ev));
+	ev.events = sockloop_events(sockh->sock);
+	ev.data.ptr = sockh;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sockh->sock->sock, &ev)) {
+		sockh->flags &= ~SOCK_HANDLER_LOOP;
+		remove_bucket_item(loop->handlers, sockh);
+		objunref(loop);
+		return (0);
+	}
+
+	objunref(loop);
+	return (1);
+}
+
+/** @brief Run a socket handler on its loop from another thread.
+  *
+  * The handler is run by the loop even if the socket has no data.
+  * @param sockh Socket handler registered with a loop.
+  * @returns 0 if the handler is not on a loop or can not be queued.*/
+int socketloop_wake(struct socket_handler *sockh) {
+	struct socket_loops *sl;
+	struct socket_loop *loop = NULL;
+	struct socket_handler *cur;
+	uint64_t one = 1;
+	int cnt, ret;
+
+	if (!(sl = sockloop_get())) {
+		return (0);
+	}
+
+	for(cnt = 0; !loop && (cnt < sl->count); cnt++) {
+		if ((cur = bucket_list_find_key(sl->loop[cnt]->handlers, &sockh->sock->sock))) {
+			if ((cur == sockh) && objref(sl->loop[cnt])) {
+				loop = sl->loop[cnt];
+			}
+			objunref(cur);
+		}
+	}
+	objunref(sl);
+
+	if (!loop) {
+		return (0);
+	}
+
+	objref(sockh);
+	if (!ringbuffer_push(loop->wake, sockh)) {
+		objunref(sockh);
+		objunref(loop);
+		return (0);
+	}
+
+	/*a full counter has signaled the loop already*/
+	ret = (write(loop->wakefd, &one, sizeof(one)) == sizeof(one)) || (errno == EAGAIN);
+	objunref(loop);
+
+	return (ret);
+}
+
+/** @brief Run a socket handler on its loop once the socket can be written.
+  *
+  * Set SOCK_FLAG_POLLOUT on the socket first it is kept in the events
+  * of the socket until cleared.
+  * @param sock Socket serviced by a loop.
+  * @returns 0 if the socket is not on a loop.*/
+int socketloop_pollout(struct fwsocket *sock) {
+	struct socket_loops *sl;
+	struct socket_handler *sockh = NULL;
+	struct epoll_event ev;
+	int cnt, ret = 0;
+
+	if (!(sl = sockloop_get())) {
+		return (0);
+	}
+
+	for(cnt = 0; !sockh && (cnt < sl->count); cnt++) {
+		if (!(sockh = bucket_list_find_key(sl->loop[cnt]->handlers, &sock->sock))) {
+			continue;
+		} else if (sockh->sock != sock) {
+			objunref(sockh);
+			sockh = NULL;
+			continue;
+		}
+#ifdef HAVE_LINUX_IO_URING_H
+		if (sl->loop[cnt]->uring) {
+			ret = !sockloop_uring_arm(sl->loop[cnt]->uring, sock->sock, 3);
+			continue;
+		}
+#endif
+		/*modifying the registration reports the socket if it can be written now*/
+		memset(&ev, 0, sizeof(ev));
+		ev.events = sockloop_events(sock);
+		ev.data.ptr = sockh;
+		ret = !epoll_ctl(sl->loop[cnt]->epfd, EPOLL_CTL_MOD, sock->sock, &ev);
+	}
+	objunref(sl);
+
+	if (sockh) {
+		objunref(sockh);
+	}
+
+	return (ret);
+}
+
+/** @}*/
@@ -0,0 +1,387 @@
+/*
+Copyright (C) 2012  Gregory Nietsky <gregory@distrotetch.co.za>
+        http://www.distrotech.co.za
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @addtogroup LIB-Sock-Pool
+  * @{
+  *
+  * @file
+  * @brief Pool of outbound TCP/TLS connections for reuse.
+  *
+  * Connections are kept per host, port and SSL context, a socket
+  * is leased with sockpool_acquire() and returned with sockpool_release()
+  * the most recently used idle socket is handed out first and checked to
+  * be still open before it is used.*/
+
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "include/dtsapp.h"
+#include "include/private.h"
+
+/** @brief Idle socket waiting to be reused.*/
+struct sockpool_idle {
+	/** @brief Reference to the socket.*/
+	struct fwsocket *sock;
+	/** @brief Monotonic time the socket was returned.*/
+	time_t since;
+};
+
+/** @brief Connections to a single host/port/SSL context.*/
+struct sockpool_key {
+	/** @brief Key name "host/port/ssl" used for hashing.*/
+	char *name;
+	/** @brief Host to connect too.*/
+	char *host;
+	/** @brief Port to connect too.*/
+	char *port;
+	/** @brief SSL structure used as template for client sessions.*/
+	void *ssl;
+	/** @brief Number of idle sockets.*/
+	int count;
+	/** @brief Array of maxidle idle sockets last returned at the end.*/
+	struct sockpool_idle *idle;
+};
+
+/** @brief Socket handed out by the pool.*/
+struct sockpool_lease {
+	/** @brief Reference to the socket leased.*/
+	struct fwsocket *sock;
+	/** @brief Reference to the key the socket belongs to.*/
+	struct sockpool_key *key;
+};
+
+/** @brief Connection pool.*/
+struct sockpool {
+	/** @brief Bucket list of keys.*/
+	struct bucket_list *keys;
+	/** @brief Bucket list of sockets leased.*/
+	struct bucket_list *leases;
+	/** @brief Maximum number of idle sockets per key.*/
+	int maxidle;
+	/** @brief Seconds a socket may be idle before been closed.*/
+	int idletime;
+};
+
+static time_t sockpool_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+static int32_t hash_key(const void *data, int key) {
+	const struct sockpool_key *pkey = data;
+	const char *name = (key) ? data : pkey->name;
+
+	return jenhash(name, strlen(name), 0);
+}
+
+static int32_t hash_lease(const void *data, int key) {
+	const struct sockpool_lease *lease = data;
+	const int *hashkey = (key) ? data : &lease->sock->sock;
+
+	return (*hashkey);
+}
+
+static void free_key(void *data) {
+	struct sockpool_key *key = data;
+	int cnt;
+
+	for(cnt = 0; cnt < key->count; cnt++) {
+		close_socket(key->idle[cnt].sock);
+	}
+
+	if (key->name) {
+		free(key->name);
+	}
+	if (key->host) {
+		free(key->host);
+	}
+	if (key->port) {
+		free(key->port);
+	}
+	if (key->ssl) {
+		objunref(key->ssl);
+	}
+}
+
+static void free_lease(void *data) {
+	struct sockpool_lease *lease = data;
+
+	if (lease->sock) {
+		objunref(lease->sock);
+	}
+	if (lease->key) {
+		objunref(lease->key);
+	}
+}
+
+static void free_sockpool(void *data) {
+	struct sockpool *pool = data;
+
+	if (pool->leases) {
+		objunref(pool->leases);
+	}
+	if (pool->keys) {
+		objunref(pool->keys);
+	}
+}
+
+/*the socket is usable if its open and has nothing to say
+ * a idle socket that is readable or has data buffered in its SSL
+ * session has been closed or is out of sync*/
+static int sockpool_healthy(struct sockpool *pool, struct sockpool_idle *idle, time_t now) {
+	struct pollfd pfd;
+
+	if (testflag(idle->sock, SOCK_FLAG_CLOSE) || (now - idle->since > pool->idletime) ||
+			(idle->sock->ssl && ssl_pending(idle->sock))) {
+		return (0);
+	}
+
+	pfd.fd = idle->sock->sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return (!poll(&pfd, 1, 0));
+}
+
+/*close sockets idle to long must be called with the key locked
+ * the list is in order of return so the oldest are at the start*/
+static void sockpool_expire(struct sockpool *pool, struct sockpool_key *key, time_t now) {
+	int cnt;
+
+	for(cnt = 0; (cnt < key->count) && (now - key->idle[cnt].since > pool->idletime); cnt++) {
+		close_socket(key->idle[cnt].sock);
+	}
+
+	if (cnt) {
+		key->count -= cnt;
+		memmove(key->idle, &key->idle[cnt], sizeof(*key->idle) * key->count);
+	}
+}
+
+static struct sockpool_key *sockpool_getkey(struct sockpool *pool, const char *host, const char *port, void *ssl) {
+	struct sockpool_key *key;
+	char *name;
+	int len;
+
+	/*host names are not limited in length the name is sized to fit*/
+	len = snprintf(NULL, 0, "%s/%s/%p", host, port, ssl) + 1;
+	if (!(name = malloc(len))) {
+		return (NULL);
+	}
+	snprintf(name, len, "%s/%s/%p", host, port, ssl);
+
+	/*hold the pool lock so only one key is created*/
+	objlock(pool);
+	if ((key = bucket_list_find_key(pool->keys, name))) {
+		objunlock(pool);
+		free(name);
+		return (key);
+	}
+
+	if (!(key = objalloc(sizeof(*key) + (sizeof(*key->idle) * pool->maxidle), free_key))) {
+		objunlock(pool);
+		free(name);
+		return (NULL);
+	}
+	key->idle = (void *)((char *)key + sizeof(*key));
+	key->name = name;
+	key->host = strdup(host);
+	key->port = strdup(port);
+
+	if (ssl && objref(ssl)) {
+		key->ssl = ssl;
+	}
+
+	if (!key->name || !key->host || !key->port || !addtobucket(pool->keys, key)) {
+		objunlock(pool);
+		objunref(key);
+		return (NULL);
+	}
+	objunlock(pool);
+
+	return (key);
+}
+
+/** @brief Create a connection pool.
+  *
+  * @param maxidle Maximum number of idle sockets kept for each host/port/ssl.
+  * @param idletime Seconds a socket may be idle before it is closed.
+  * @returns Reference to a new pool.*/
+extern struct sockpool *sockpool_new(int maxidle, int idletime) {
+	struct sockpool *pool;
+
+	if (!(pool = objalloc(sizeof(*pool), free_sockpool))) {
+		return NULL;
+	}
+
+	pool->maxidle = (maxidle > 0) ? maxidle : 1;
+	pool->idletime = idletime;
+
+	if (!(pool->keys = create_bucketlist(4, hash_key)) ||
+			!(pool->leases = create_bucketlist(6, hash_lease))) {
+		objunref(pool);
+		return NULL;
+	}
+
+	return (pool);
+}
+
+/** @brief Get a connected socket from the pool.
+  *
+  * A idle socket is reused if one is healthy else a new connection is
+  * made with tcpconnect_timeout(), if ssl is supplied a client session
+  * is started with tlsconnect() using its context and the socket is closed
+  * if the handshake fails.
+  * @note The socket is used directly with socketread() / socketwrite()
+  * it must not be given to socketclient().
+  * @param pool Connection pool.
+  * @param host Host to connect too.
+  * @param port Port to connect too.
+  * @param ssl Optional SSL structure from tlsv1_init() shared by connections.
+  * @param timeout Connect timeout in ms or -1 to block.
+  * @returns Reference to a socket that must be returned with sockpool_release().*/
+extern struct fwsocket *sockpool_acquire(struct sockpool *pool, const char *host, const char *port, void *ssl, int timeout) {
+	struct sockpool_key *key;
+	struct sockpool_lease *lease;
+	struct fwsocket *sock = NULL;
+	struct sockpool_idle idle;
+	time_t now;
+
+	if (!pool || !host || !port || !(key = sockpool_getkey(pool, host, port, ssl))) {
+		return NULL;
+	}
+
+	now = sockpool_now();
+	objlock(key);
+	while(key->count) {
+		idle = key->idle[--key->count];
+		if (sockpool_healthy(pool, &idle, now)) {
+			sock = idle.sock;
+			break;
+		}
+		close_socket(idle.sock);
+	}
+	sockpool_expire(pool, key, now);
+	objunlock(key);
+
+	if (!sock) {
+		if (!(sock = tcpconnect_timeout(host, port, NULL, timeout))) {
+			objunref(key);
+			return NULL;
+		}
+		/*a failed handshake leaves the socket unusable*/
+		if (key->ssl) {
+			tlsconnect(sock, key->ssl);
+			if (!ssl_established(sock)) {
+				objunref(key);
+				close_socket(sock);
+				return NULL;
+			}
+		}
+	}
+
+	if (!(lease = objalloc(sizeof(*lease), free_lease))) {
+		objunref(key);
+		close_socket(sock);
+		return NULL;
+	}
+
+	/*the lease takes the key reference and one on the socket*/
+	lease->key = key;
+	lease->sock = (objref(sock)) ? sock : NULL;
+	if (!lease->sock || !addtobucket(pool->leases, lease)) {
+		objunref(lease);
+		close_socket(sock);
+		return NULL;
+	}
+	objunref(lease);
+
+	return (sock);
+}
+
+/** @brief Return a socket to the pool.
+  *
+  * The socket is kept for reuse unless reuse is 0, the socket has been
+  * closed or there are already maxidle sockets idle, the caller's reference
+  * is passed to the pool.
+  * @param pool Connection pool.
+  * @param sock Socket returned by sockpool_acquire().
+  * @param reuse Set to 0 if the connection is in a unknown state.*/
+extern void sockpool_release(struct sockpool *pool, struct fwsocket *sock, int reuse) {
+	struct sockpool_lease *lease;
+	struct sockpool_key *key;
+	struct sockpool_idle *idle;
+
+	if (!pool || !sock) {
+		return;
+	}
+
+	if (!(lease = bucket_list_find_key(pool->leases, &sock->sock)) || (lease->sock != sock)) {
+		if (lease) {
+			objunref(lease);
+		}
+		close_socket(sock);
+		return;
+	}
+
+	remove_bucket_item(pool->leases, lease);
+	key = lease->key;
+	objref(key);
+	objunref(lease);
+
+	objlock(key);
+	sockpool_expire(pool, key, sockpool_now());
+	if (!reuse || testflag(sock, SOCK_FLAG_CLOSE) || (key->count >= pool->maxidle)) {
+		objunlock(key);
+		close_socket(sock);
+	} else {
+		idle = &key->idle[key->count++];
+		idle->sock = sock;
+		idle->since = sockpool_now();
+		objunlock(key);
+	}
+	objunref(key);
+}
+
+/** @brief Close all sockets that have been idle longer than the idle time.
+  *
+  * Idle sockets are checked on acquire and release of there key this
+  * can be called periodicaly to close connections to hosts no longer used.
+  * @param pool Connection pool.*/
+extern void sockpool_purge(struct sockpool *pool) {
+	struct sockpool_key *key;
+	struct bucket_loop *bloop;
+	time_t now = sockpool_now();
+
+	bloop = init_bucket_loop(pool->keys);
+	while(bloop && (key = next_bucket_loop(bloop))) {
+		objlock(key);
+		sockpool_expire(pool, key, now);
+		objunlock(key);
+		objunref(key);
+	}
+	objunref(bloop);
+}
+
+/** @}*/
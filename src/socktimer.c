@@ -0,0 +1,645 @@
+/*
+Copyright (C) 2012  Gregory Nietsky <gregory@distrotetch.co.za>
+        http://www.distrotech.co.za
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @addtogroup LIB-Sock-Timer
+  * @{
+  *
+  * @file
+  * @brief Socket timeouts and server connection limits.
+  *
+  * Sockets with timeouts are placed on a timer wheel serviced by a single
+  * thread. Reads and writes only record the current tick when a socket
+  * expires from the wheel the deadline is worked out again and the socket
+  * is put back if there has been activity so busy sockets cost nothing
+  * more than a store per read/write.*/
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "include/dtsapp.h"
+#include "include/private.h"
+
+/** @brief Interval of the timer wheel in ms.*/
+#define SOCKTIMER_TICK		100
+/** @brief Number of slots in the wheel (51.2s at 100ms).*/
+#define SOCKTIMER_SLOTS		512
+
+/** @brief Socket timer flags.*/
+enum socktimer_flags {
+	/** @brief The timer is on the wheel and holds a reference to the socket.*/
+	SOCKTIMER_FLAG_ARMED	= 1 << 0,
+	/** @brief The timer is linked into a wheel slot.*/
+	SOCKTIMER_FLAG_LINKED	= 1 << 1,
+	/** @brief The wheel thread has been asked to stop.*/
+	SOCKTIMER_FLAG_STOP	= 1 << 2
+};
+
+/** @brief Number of connections from a address.*/
+struct sock_ipcount {
+	/** @brief Address bytes.*/
+	unsigned char addr[16];
+	/** @brief Length of the address 4 or 16.*/
+	int len;
+	/** @brief Connections from the address.*/
+	int count;
+};
+
+/** @brief Timeouts of a socket and limits of a server.
+  *
+  * A server socket holds the timeouts given to each connection and the
+  * connection limits, connections hold a reference to there server.*/
+struct sock_timer {
+	/** @brief Next timer in the wheel slot.*/
+	struct sock_timer *next;
+	/** @brief Previous timer in the wheel slot.*/
+	struct sock_timer *prev;
+	/** @brief Next timer due in the slot been run.*/
+	struct sock_timer *due;
+	/** @brief Reference to the socket while armed.*/
+	struct fwsocket *sock;
+	/** @brief Reference to the data passed to the callback while armed.*/
+	void *data;
+	/** @brief Callback called before a socket is closed.*/
+	sockettimeout cb;
+	/** @brief Idle timeout in ticks.*/
+	int idle;
+	/** @brief Read timeout in ticks.*/
+	int read;
+	/** @brief Handshake timeout in ticks.*/
+	int handshake;
+	/** @brief Tick the timer was started.*/
+	uint64_t start;
+	/** @brief Tick of the last read.*/
+	uint64_t lastread;
+	/** @brief Tick of the last read or write.*/
+	uint64_t lastio;
+	/** @brief Tick the timer is due.*/
+	uint64_t expires;
+	/** @brief Data has been read the handshake timeout no longer applies.*/
+	int readseen;
+	/** @brief Timer flags.
+	  * @see socktimer_flags*/
+	int flags;
+	/** @brief Maximum number of connections to the server.*/
+	int maxchildren;
+	/** @brief Maximum number of connections from a address.*/
+	int maxperip;
+	/** @brief Number of connections to the server.*/
+	int children;
+	/** @brief Bucket list of connections per address.*/
+	struct bucket_list *ips;
+	/** @brief Reference to the server timer this connection is counted on.*/
+	struct sock_timer *server;
+	/** @brief Reference to the address count this connection is counted on.*/
+	struct sock_ipcount *ip;
+};
+
+/** @brief Timer wheel.*/
+struct socktimer_wheel {
+	/** @brief Timers due in each slot.*/
+	struct sock_timer *slots[SOCKTIMER_SLOTS];
+	/** @brief Monotonic time in ms of tick 0.*/
+	uint64_t base;
+	/** @brief Last tick run.*/
+	uint64_t tick;
+	/** @brief Flags.
+	  * @see socktimer_flags*/
+	int flags;
+};
+
+static struct socktimer_wheel *wheel = NULL;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+/*current tick read without locking by socktimer_activity()*/
+static uint64_t wheel_tick = 0;
+
+static uint64_t socktimer_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+static int socktimer_ticks(int ms) {
+	return ((ms > 0) ? (ms + SOCKTIMER_TICK - 1) / SOCKTIMER_TICK : 0);
+}
+
+static int32_t hash_ipcount(const void *data, int key) {
+	const struct sock_ipcount *ip = data;
+
+	return jenhash(ip->addr, ip->len, 0);
+}
+
+/*a connection is no longer counted on its server*/
+static void socktimer_release(struct sock_timer *server, struct sock_ipcount *ip) {
+	if (!server) {
+		return;
+	}
+
+	objlock(server);
+	server->children--;
+	if (ip && !--ip->count) {
+		remove_bucket_item(server->ips, ip);
+	}
+	objunlock(server);
+
+	if (ip) {
+		objunref(ip);
+	}
+	objunref(server);
+}
+
+static void free_sock_timer(void *data) {
+	struct sock_timer *timer = data;
+
+	socktimer_release(timer->server, timer->ip);
+	if (timer->ips) {
+		objunref(timer->ips);
+	}
+}
+
+/*link the timer into the slot of its expire time must hold the wheel lock*/
+static void socktimer_link(struct socktimer_wheel *tw, struct sock_timer *timer, uint64_t expires) {
+	struct sock_timer **slot;
+
+	if (expires <= tw->tick) {
+		expires = tw->tick + 1;
+	}
+	timer->expires = expires;
+	slot = &tw->slots[expires % SOCKTIMER_SLOTS];
+
+	timer->prev = NULL;
+	timer->next = *slot;
+	if (*slot) {
+		(*slot)->prev = timer;
+	}
+	*slot = timer;
+	timer->flags |= SOCKTIMER_FLAG_LINKED;
+}
+
+static void socktimer_unlink(struct socktimer_wheel *tw, struct sock_timer *timer) {
+	if (!(timer->flags & SOCKTIMER_FLAG_LINKED)) {
+		return;
+	}
+
+	if (timer->prev) {
+		timer->prev->next = timer->next;
+	} else {
+		tw->slots[timer->expires % SOCKTIMER_SLOTS] = timer->next;
+	}
+	if (timer->next) {
+		timer->next->prev = timer->prev;
+	}
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->flags &= ~SOCKTIMER_FLAG_LINKED;
+}
+
+/*earliest deadline of the timer and the reason it will expire*/
+static uint64_t socktimer_deadline(struct sock_timer *timer, int *reason) {
+	uint64_t deadline = UINT64_MAX, due;
+
+	if (timer->handshake && !__atomic_load_n(&timer->readseen, __ATOMIC_RELAXED)) {
+		deadline = timer->start + timer->handshake;
+		*reason = SOCK_TIMEOUT_HANDSHAKE;
+	}
+	if (timer->read && ((due = __atomic_load_n(&timer->lastread, __ATOMIC_RELAXED) + timer->read) < deadline)) {
+		deadline = due;
+		*reason = SOCK_TIMEOUT_READ;
+	}
+	if (timer->idle && ((due = __atomic_load_n(&timer->lastio, __ATOMIC_RELAXED) + timer->idle) < deadline)) {
+		deadline = due;
+		*reason = SOCK_TIMEOUT_IDLE;
+	}
+
+	return (deadline);
+}
+
+/*disarm the timer returning the socket and data references to the caller
+ * must hold the wheel lock*/
+static int socktimer_disarm(struct socktimer_wheel *tw, struct sock_timer *timer, struct fwsocket **sock, void **data) {
+	if (!(timer->flags & SOCKTIMER_FLAG_ARMED)) {
+		return (0);
+	}
+
+	socktimer_unlink(tw, timer);
+	timer->flags &= ~SOCKTIMER_FLAG_ARMED;
+	*sock = timer->sock;
+	*data = timer->data;
+	timer->sock = NULL;
+	timer->data = NULL;
+	return (1);
+}
+
+static void socktimer_expire(struct sock_timer *timer, struct fwsocket *sock, void *data, int reason) {
+	if (timer->cb) {
+		timer->cb(sock, reason, data);
+	}
+
+	/*wake the handler it will find the socket closed*/
+	setflag(sock, SOCK_FLAG_CLOSE);
+	shutdown(sock->sock, SHUT_RDWR);
+}
+
+/*run the timers in a slot, timers with activity since they were
+ * queued are put back at there new deadline*/
+static void socktimer_slot(struct socktimer_wheel *tw, uint64_t tick) {
+	struct sock_timer *timer, *next, *due = NULL;
+	struct fwsocket *sock;
+	void *data;
+	uint64_t deadline;
+	int reason = 0;
+
+	objlock(tw);
+	tw->tick = tick;
+	__atomic_store_n(&wheel_tick, tick, __ATOMIC_RELAXED);
+	for(timer = tw->slots[tick % SOCKTIMER_SLOTS]; timer; timer = next) {
+		next = timer->next;
+		if (timer->expires > tick) {
+			continue;
+		}
+		deadline = socktimer_deadline(timer, &reason);
+		socktimer_unlink(tw, timer);
+		if (deadline > tick) {
+			socktimer_link(tw, timer, deadline);
+			continue;
+		}
+		/*hold the timer while the callback is run*/
+		objref(timer);
+		timer->due = due;
+		due = timer;
+	}
+	objunlock(tw);
+
+	for(timer = due; timer; timer = next) {
+		next = timer->due;
+		timer->due = NULL;
+
+		objlock(tw);
+		deadline = socktimer_deadline(timer, &reason);
+		if ((timer->flags & SOCKTIMER_FLAG_ARMED) && (deadline > tick)) {
+			socktimer_link(tw, timer, deadline);
+			objunlock(tw);
+		} else if (socktimer_disarm(tw, timer, &sock, &data)) {
+			objunlock(tw);
+			socktimer_expire(timer, sock, data, reason);
+			objunref(sock);
+			if (data) {
+				objunref(data);
+			}
+		} else {
+			objunlock(tw);
+		}
+		objunref(timer);
+	}
+}
+
+static void *socktimer_thread(void *data) {
+	struct socktimer_wheel *tw = data;
+	struct timespec ts;
+	uint64_t tick, now;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = SOCKTIMER_TICK * 1000000;
+
+	tick = tw->tick;
+	while(framework_threadok() && !testflag(tw, SOCKTIMER_FLAG_STOP)) {
+		nanosleep(&ts, NULL);
+		/*catch up on ticks missed while busy or suspended*/
+		now = (socktimer_ms() - tw->base) / SOCKTIMER_TICK;
+		while(tick < now) {
+			socktimer_slot(tw, ++tick);
+		}
+	}
+
+	return NULL;
+}
+
+/*drop the references held by timers left on the wheel*/
+static void socktimer_clean(void *data) {
+	struct socktimer_wheel *tw = data;
+	struct sock_timer *timer;
+	struct fwsocket *sock;
+	void *tdata;
+	int i;
+
+	setflag(tw, SOCKTIMER_FLAG_STOP);
+	pthread_mutex_lock(&wheel_lock);
+	if (wheel == tw) {
+		wheel = NULL;
+		objunref(tw);
+	}
+	pthread_mutex_unlock(&wheel_lock);
+
+	for(i = 0; i < SOCKTIMER_SLOTS; i++) {
+		objlock(tw);
+		while((timer = tw->slots[i])) {
+			sock = NULL;
+			tdata = NULL;
+			/*a timer in a slot is armed drop it if not so the loop ends*/
+			if (!socktimer_disarm(tw, timer, &sock, &tdata)) {
+				socktimer_unlink(tw, timer);
+				continue;
+			}
+			objunlock(tw);
+			if (sock) {
+				objunref(sock);
+			}
+			if (tdata) {
+				objunref(tdata);
+			}
+			objlock(tw);
+		}
+		objunlock(tw);
+	}
+}
+
+/*return a reference to the wheel starting it if needed*/
+static struct socktimer_wheel *socktimer_wheel(void) {
+	struct socktimer_wheel *tw;
+	struct thread_attr attr;
+	struct thread_pvt *thread;
+
+	pthread_mutex_lock(&wheel_lock);
+	if ((tw = wheel) && objref(tw)) {
+		pthread_mutex_unlock(&wheel_lock);
+		return (tw);
+	}
+
+	if (!(tw = objalloc(sizeof(*tw), NULL))) {
+		pthread_mutex_unlock(&wheel_lock);
+		return (NULL);
+	}
+	tw->tick = __atomic_load_n(&wheel_tick, __ATOMIC_RELAXED);
+	tw->base = socktimer_ms() - (tw->tick * SOCKTIMER_TICK);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.name = "socktimer";
+
+	/*the thread holds its own reference*/
+	if (!(thread = framework_mkthread_attr(socktimer_thread, socktimer_clean, NULL, tw, THREAD_OPTION_RETURN, &attr))) {
+		pthread_mutex_unlock(&wheel_lock);
+		objunref(tw);
+		return (NULL);
+	}
+	objunref(thread);
+
+	/*one for the global and one for the caller*/
+	objref(tw);
+	wheel = tw;
+	pthread_mutex_unlock(&wheel_lock);
+
+	return (tw);
+}
+
+static struct sock_timer *socktimer_get(struct fwsocket *sock) {
+	struct sock_timer *timer;
+
+	objlock(sock);
+	if (!(timer = sock->timer) && (timer = objalloc(sizeof(*timer), free_sock_timer))) {
+		sock->timer = timer;
+	}
+	objunlock(sock);
+
+	return (timer);
+}
+
+/** @brief Set the timeouts of a socket.
+  *
+  * A socket is closed when there has been no read or write for the idle
+  * time, no data read for the read time or no data read in the handshake
+  * time after the socket was started (for SSL sockets this includes the
+  * handshake). Set on a server socket the timeouts apply to each connection.
+  * @note Timeouts start when the socket is given to socketclient() or accepted.
+  * @param sock Socket to set timeouts on.
+  * @param idle Idle timeout in ms 0 to disable.
+  * @param read Read timeout in ms 0 to disable.
+  * @param handshake Handshake timeout in ms 0 to disable.
+  * @param cb Optional callback called before the socket is closed.
+  * @returns 0 on failure.*/
+extern int socket_settimeout(struct fwsocket *sock, int idle, int read, int handshake, sockettimeout cb) {
+	struct sock_timer *timer;
+
+	if (!sock || !(timer = socktimer_get(sock))) {
+		return (0);
+	}
+
+	objlock(timer);
+	timer->idle = socktimer_ticks(idle);
+	timer->read = socktimer_ticks(read);
+	timer->handshake = socktimer_ticks(handshake);
+	timer->cb = cb;
+	objunlock(timer);
+
+	return (1);
+}
+
+/** @brief Limit the connections a server accepts.
+  *
+  * Connections over the limit are closed as soon as they are accepted.
+  * @param sock Server socket.
+  * @param maxchildren Maximum connections 0 for no limit.
+  * @param maxperip Maximum connections from a single address 0 for no limit.
+  * @returns 0 on failure.*/
+extern int socket_setlimits(struct fwsocket *sock, int maxchildren, int maxperip) {
+	struct sock_timer *timer;
+
+	if (!sock || !testflag(sock, SOCK_FLAG_BIND) || !(timer = socktimer_get(sock))) {
+		return (0);
+	}
+
+	objlock(timer);
+	if (maxperip && !timer->ips && !(timer->ips = create_bucketlist(6, hash_ipcount))) {
+		objunlock(timer);
+		return (0);
+	}
+	timer->maxchildren = maxchildren;
+	timer->maxperip = maxperip;
+	objunlock(timer);
+
+	return (1);
+}
+
+/** @brief Check the limits of a server for a new connection and pass on the timeouts.
+  * @param sock Server socket.
+  * @param newsock Connection accepted.
+  * @returns 0 if the connection must be closed.*/
+int socktimer_accept(struct fwsocket *sock, struct fwsocket *newsock) {
+	struct sock_timer *server = sock->timer;
+	struct sock_timer *timer;
+	struct sock_ipcount key, *ip = NULL;
+
+	if (!server) {
+		return (1);
+	}
+
+	memset(&key, 0, sizeof(key));
+	if (newsock->addr.sa.sa_family == AF_INET) {
+		key.len = sizeof(newsock->addr.sa4.sin_addr);
+		memcpy(key.addr, &newsock->addr.sa4.sin_addr, key.len);
+	} else if (newsock->addr.sa.sa_family == AF_INET6) {
+		key.len = sizeof(newsock->addr.sa6.sin6_addr);
+		memcpy(key.addr, &newsock->addr.sa6.sin6_addr, key.len);
+	}
+
+	if (!(timer = socktimer_get(newsock))) {
+		return (0);
+	}
+
+	/*the reference is kept by the connection if accepted*/
+	objref(server);
+	objlock(server);
+	if (server->maxchildren && (server->children >= server->maxchildren)) {
+		objunlock(server);
+		objunref(server);
+		return (0);
+	}
+
+	if (server->ips && server->maxperip && key.len) {
+		if (!(ip = bucket_list_find_key(server->ips, &key))) {
+			if (!(ip = objalloc(sizeof(*ip), NULL))) {
+				objunlock(server);
+				objunref(server);
+				return (0);
+			}
+			memcpy(ip, &key, sizeof(key));
+			addtobucket(server->ips, ip);
+		}
+		if (ip->count >= server->maxperip) {
+			objunlock(server);
+			objunref(ip);
+			objunref(server);
+			return (0);
+		}
+		ip->count++;
+	}
+
+	/*counted till the connection is freed*/
+	server->children++;
+	timer->server = server;
+	timer->ip = ip;
+	timer->idle = server->idle;
+	timer->read = server->read;
+	timer->handshake = server->handshake;
+	timer->cb = server->cb;
+	objunlock(server);
+
+	return (1);
+}
+
+/** @brief Start the timeouts of a socket when its handler starts.
+  * @param sock Socket been started.
+  * @param data Data passed to the timeout callback.*/
+void socktimer_start(struct fwsocket *sock, void *data) {
+	struct sock_timer *timer = sock->timer;
+	struct socktimer_wheel *tw;
+	int reason;
+
+	if (!timer || (!timer->idle && !timer->read && !timer->handshake) || !(tw = socktimer_wheel())) {
+		return;
+	}
+
+	objref(sock);
+	if (data) {
+		objref(data);
+	}
+
+	objlock(tw);
+	if ((timer->flags & SOCKTIMER_FLAG_ARMED) || (tw->flags & SOCKTIMER_FLAG_STOP)) {
+		objunlock(tw);
+		objunref(sock);
+		if (data) {
+			objunref(data);
+		}
+		objunref(tw);
+		return;
+	}
+	timer->sock = sock;
+	timer->data = data;
+	timer->start = tw->tick;
+	timer->lastread = tw->tick;
+	timer->lastio = tw->tick;
+	timer->flags |= SOCKTIMER_FLAG_ARMED;
+	socktimer_link(tw, timer, socktimer_deadline(timer, &reason));
+	objunlock(tw);
+	objunref(tw);
+}
+
+/** @brief Take the socket off the timer wheel and release its place on the server when its handler stops.
+  * @param sock Socket been closed.*/
+void socktimer_stop(struct fwsocket *sock) {
+	struct sock_timer *timer = sock->timer;
+	struct socktimer_wheel *tw;
+	struct sock_timer *server;
+	struct sock_ipcount *ip;
+	struct fwsocket *tsock;
+	void *data;
+	int armed;
+
+	if (!timer) {
+		return;
+	}
+
+	/*the connection is closed even if a reference is still held*/
+	objlock(timer);
+	server = timer->server;
+	ip = timer->ip;
+	timer->server = NULL;
+	timer->ip = NULL;
+	objunlock(timer);
+	socktimer_release(server, ip);
+
+	pthread_mutex_lock(&wheel_lock);
+	tw = (wheel && objref(wheel)) ? wheel : NULL;
+	pthread_mutex_unlock(&wheel_lock);
+	if (!tw) {
+		return;
+	}
+
+	objlock(tw);
+	armed = socktimer_disarm(tw, timer, &tsock, &data);
+	objunlock(tw);
+
+	if (armed) {
+		objunref(tsock);
+		if (data) {
+			objunref(data);
+		}
+	}
+	objunref(tw);
+}
+
+/** @brief Record activity on a socket.
+  * @param sock Socket read or written.
+  * @param dir SOCK_STATS_IN or SOCK_STATS_OUT.*/
+void socktimer_activity(struct fwsocket *sock, int dir) {
+	struct sock_timer *timer = sock->timer;
+	uint64_t tick = __atomic_load_n(&wheel_tick, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&timer->lastio, tick, __ATOMIC_RELAXED);
+	if (dir == SOCK_STATS_IN) {
+		__atomic_store_n(&timer->lastread, tick, __ATOMIC_RELAXED);
+		__atomic_store_n(&timer->readseen, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/** @}*/
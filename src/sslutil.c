@@ -27,7 +27,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
   *
   * @see @ref LIB-Sock*/
 
+#include "config.h"
+
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef __WIN32__
 #include <winsock2.h>
 #include <windows.h>
@@ -35,14 +43,32 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #ifndef __WIN32__
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sched.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <limits.h>
 #endif
 
 #include "include/dtsapp.h"
+#include "include/private.h"
 
 /** @brief SSL configuration flags*/
 enum SSLFLAGS {
@@ -59,7 +85,20 @@ enum SSLFLAGS {
 	/** @brief This session is server mode*/
 	SSL_SERVER	= 1 << 5,
 	/** @brief UDP connection is listening.*/
-	SSL_DTLSCON	= 1 << 6
+	SSL_DTLSCON	= 1 << 6,
+	/** @brief Server handshake is in progress on a non blocking socket.*/
+	SSL_HANDSHAKE	= 1 << 7,
+	/** @brief TLS version negotiated (TLS_method())*/
+	SSL_TLS		= 1 << 8,
+	/** @brief Early data is read from the client before the handshake
+	  * or the client has not completed the handshake after sending it.*/
+	SSL_EARLYDATA	= 1 << 9,
+	/** @brief DTLS server reading all peers on its socket or a peer of one.*/
+	SSL_DEMUX	= 1 << 10,
+	/** @brief Handshake completed by a crypto worker connect is still to be called.*/
+	SSL_CONNECTED	= 1 << 11,
+	/** @brief The context keeps client sessions for ssl_sessionreuse().*/
+	SSL_CLIENTCACHE	= 1 << 12
 };
 
 /** @brief SSL data structure for enabling encryption on sockets*/
@@ -77,21 +116,261 @@ struct ssldata {
 	const SSL_METHOD *meth;
 	/** @brief Parent structure*/
 	struct ssldata *parent;
+	/** @brief Server session cache.
+	  * @see ssl_sessioncache()*/
+	struct ssl_sesscache *cache;
+	/** @brief Session ticket keys.
+	  * @see ssl_ticketkeys()*/
+	struct ssl_tickets *tickets;
+	/** @brief Early data received by a server or sent by a client.
+	  * @see ssl_earlydata()*/
+	char *early;
+	/** @brief Length of early data held.*/
+	int earlylen;
+	/** @brief Early data passed to socketread().*/
+	int earlypos;
+	/** @brief Peers of a DTLS server sharing its socket.
+	  * @see dtls_demux()*/
+	struct dtls_demux *demux;
+	/** @brief Crypto workers running the handshakes of a server.
+	  * @see ssl_offload()*/
+	struct ssl_cryptopool *pool;
+	/** @brief Set while a crypto worker has the session (atomic).*/
+	int offload;
+	/** @brief Context with the certificates loaded by ssl_reload()
+	  * NULL if those loaded into ctx are used.*/
+	SSL_CTX *certs;
+	/** @brief Files watched for changes.
+	  * @see ssl_reloadwatch()*/
+	struct ssl_watch *watch;
+};
+
+/** @brief Largest datagram sent to a DTLS peer sharing the servers socket.*/
+#define DTLS_DEMUX_MTU		1400
+/** @brief Largest datagram read by a DTLS server sharing its socket.*/
+#define DTLS_DEMUX_DGRAM	18432
+/** @brief Length of the DTLS record header.*/
+#define DTLS_RECORD_HEADER	13
+
+/** @brief DTLS server demultiplexing its peers on one socket.*/
+struct dtls_demux {
+	/** @brief Peer sockets hashed by address.*/
+	struct bucket_list *peers;
+	/** @brief Session waiting for the next client hello.*/
+	struct ssldata *listen;
+	/** @brief Most peers allowed 0 for no limit.*/
+	int maxpeers;
+};
+
+static void dtls_demux_flush(struct ssldata *ssl, int fd, union sockstruct *addr);
+static void dtls_demux_stop(struct ssldata *ssl, int fd);
+#ifndef __WIN32__
+static void *ssl_cryptothread(void *data);
+static void ssl_cryptoclean(void *data);
+#endif
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+/** @brief Openssl can pass sessions to kernel TLS.*/
+#define HAVE_SSL_KTLS	1
+#endif
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+/** @brief Openssl supports TLSv1.3 early data.*/
+#define HAVE_SSL_EARLYDATA	1
+#endif
+
+#if defined(SSL_MODE_ASYNC) && !defined(__WIN32__)
+/** @brief Openssl can pause a handshake while a engine completes a crypto operation.*/
+#define HAVE_SSL_ASYNC	1
+#endif
+
+/** @brief Size of the file reads sent with socket_sendfile() without kernel TLS.*/
+#define SSL_SENDFILE_CHUNK	16384
+/** @brief Times a server handshake waits for the socket to drain.*/
+#define SSL_HANDSHAKE_WAIT	5
+/** @brief Size of the queue of handshakes waiting for a crypto worker (bits).*/
+#define SSL_CRYPTO_QUEUE	10
+/** @brief Most wait FD's of a paused crypto operation.*/
+#define SSL_ASYNC_FDS		4
+/** @brief Milliseconds to wait for a engine to complete a crypto operation.*/
+#define SSL_ASYNC_WAIT		1000
+/** @brief Milliseconds watched files must be unchanged before they are reloaded.*/
+#define SSL_WATCH_SETTLE	500
+/** @brief Inotify events that change a watched file.*/
+#define SSL_WATCH_MASK		(IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+/** @brief Number of shards of the session cache each with its own lock.*/
+#define SSL_CACHE_SHARDS	16
+/** @brief Number of slots in a set a session can be placed in.*/
+#define SSL_CACHE_WAYS		4
+/** @brief Largest encoded session kept.*/
+#define SSL_CACHE_SESSMAX	2048
+/** @brief Magic number of a initialised cache "SSLC".*/
+#define SSL_CACHE_MAGIC		0x53534c43
+/** @brief Session ID context of servers with a session cache.*/
+#define SSL_CACHE_SIDCTX	"dtsapp"
+
+/** @brief Crypto worker pool flags.*/
+enum ssl_cryptoflags {
+	/** @brief The workers have been asked to stop.*/
+	SSL_CRYPTO_STOP	= 1 << 0
+};
+
+/** @brief Crypto workers running server handshakes for the event loops.*/
+struct ssl_cryptopool {
+	/** @brief Handshakes waiting for a worker.*/
+	struct ring_buffer *queue;
+	/** @brief Number of workers started.*/
+	int threads;
+	/** @brief Pool flags.
+	  * @see ssl_cryptoflags*/
+	int flags;
+	/** @brief Lock used with the condition workers take jobs holding it.*/
+	pthread_mutex_t lock;
+	/** @brief Signaled when a handshake is queued.*/
+	pthread_cond_t cond;
+};
+
+/** @brief Handshake queued for a crypto worker.*/
+struct ssl_cryptojob {
+	/** @brief Reference to the connection.*/
+	struct fwsocket *sock;
+	/** @brief Reference to the handler the loop runs once the step is done.*/
+	struct socket_handler *sockh;
+};
+
+/** @brief Certificate watch flags.*/
+enum ssl_watchflags {
+	/** @brief The watch thread has been asked to stop.*/
+	SSL_WATCH_STOP	= 1 << 0,
+	/** @brief The CA certificate is a directory that is watched.*/
+	SSL_WATCH_CADIR	= 1 << 1
+};
+
+/** @brief Certificate files watched by ssl_reloadwatch()*/
+struct ssl_watch {
+	/** @brief Reference to the SSL structure reloaded.*/
+	struct ssldata *ssl;
+	/** @brief CA certificate file or directory.*/
+	char *cacert;
+	/** @brief Certificate file.*/
+	char *cert;
+	/** @brief Private key file.*/
+	char *key;
+	/** @brief Inotify FD.*/
+	int fd;
+	/** @brief Watch of the directory of the CA, certificate and key.*/
+	int wd[3];
+	/** @brief Watch flags.
+	  * @see ssl_watchflags*/
+	int flags;
+};
+
+/** @brief Session ticket key.*/
+struct ssl_ticketkey {
+	/** @brief Key name sent in the ticket.*/
+	unsigned char name[16];
+	/** @brief AES256 key.*/
+	unsigned char aes[32];
+	/** @brief HMAC SHA256 key.*/
+	unsigned char hmac[32];
+	/** @brief Time the key was made 0 if not set.*/
+	time_t created;
+};
+
+/** @brief Session ticket keys current and previous.*/
+struct ssl_tickets {
+	/** @brief Lock shared between processes if in the session cache.*/
+	pthread_mutex_t lock;
+	/** @brief Seconds between key changes.*/
+	int rotate;
+	/** @brief The keys are part of the session cache.*/
+	int shared;
+	/** @brief Current key and the previous key.*/
+	struct ssl_ticketkey keys[2];
+};
+
+/** @brief Cached session.*/
+struct ssl_cacheslot {
+	/** @brief Time the session expires.*/
+	time_t expires;
+	/** @brief Length of the session ID 0 if the slot is free.*/
+	uint32_t idlen;
+	/** @brief Length of the encoded session.*/
+	uint32_t len;
+	/** @brief Session ID.*/
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	/** @brief DER encoded session.*/
+	unsigned char data[SSL_CACHE_SESSMAX];
+};
+
+/** @brief Start of the session cache memory followed by the slots.*/
+struct ssl_cachehdr {
+	/** @brief Set to SSL_CACHE_MAGIC once set up.*/
+	uint32_t magic;
+	/** @brief Number of sets in each shard.*/
+	uint32_t sets;
+	/** @brief Size of a slot.*/
+	uint32_t slotsize;
+	/** @brief Lock of each shard.*/
+	pthread_mutex_t locks[SSL_CACHE_SHARDS];
+	/** @brief Ticket keys shared by processes using the cache.*/
+	struct ssl_tickets tickets;
+};
+
+/** @brief Server session cache.*/
+struct ssl_sesscache {
+	/** @brief Shared memory holding the cache.*/
+	struct ssl_cachehdr *hdr;
+	/** @brief Size of the memory.*/
+	size_t size;
+	/** @brief File the cache is mapped from or -1.*/
+	int fd;
+};
+
+/** @brief Client session kept for a server.*/
+struct ssl_clientsess {
+	/** @brief Server address and port.*/
+	char peer[64];
+	/** @brief Time the session expires.*/
+	time_t expires;
+	/** @brief Length of the encoded session.*/
+	int len;
+	/** @brief DER encoded session allocated after the structure.*/
+	unsigned char *data;
 };
 
+/*index of the ssldata in the SSL_CTX extra data*/
+static int ssl_ctxidx = -1;
+/*client sessions and the maximum number kept swapped under ssl_clientlock*/
+static struct bucket_list *ssl_clients = NULL;
+static int ssl_clientmax = 0;
+static pthread_mutex_t ssl_clientlock = PTHREAD_MUTEX_INITIALIZER;
+
 /** @brief length of cookie secret using SHA2-256 HMAC*/
 #define COOKIE_SECRET_LENGTH 32
 static unsigned char *cookie_secret = NULL;
 
+/*peers of a demultiplexed server use memory BIO's the address is held in the app data*/
+static void dtls_cookiepeer(SSL *ssl, union sockstruct *peer) {
+	union sockstruct *addr;
+
+	if ((addr = SSL_get_app_data(ssl))) {
+		memcpy(peer, addr, sizeof(*peer));
+	} else {
+		BIO_dgram_get_peer(SSL_get_rbio(ssl), peer);
+	}
+}
+
 static int generate_cookie(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len) {
 	union sockstruct peer;
 
-	if (!ssl || !cookie_secret || (*cookie_len < COOKIE_SECRET_LENGTH)) {
+	/*cookie_len is not set on input the buffer always holds DTLS1_COOKIE_LENGTH*/
+	if (!ssl || !cookie_secret) {
 		return (0);
 	}
 
 	memset(&peer, 0, sizeof(peer));
-	BIO_dgram_get_peer(SSL_get_rbio(ssl), &peer);
+	dtls_cookiepeer(ssl, &peer);
 	sha256hmac(cookie, &peer, sizeof(peer), cookie_secret, COOKIE_SECRET_LENGTH);
 	*cookie_len = COOKIE_SECRET_LENGTH;
 
@@ -107,7 +386,7 @@ static int verify_cookie(SSL *ssl, unsigned char *cookie, unsigned int cookie_le
 	}
 
 	memset(&peer, 0, sizeof(peer));
-	BIO_dgram_get_peer(SSL_get_rbio(ssl), &peer);
+	dtls_cookiepeer(ssl, &peer);
 	sha256hmac(hmac, &peer, sizeof(peer), cookie_secret, COOKIE_SECRET_LENGTH);
 
 	if (!sha256cmp(hmac, cookie)) {
@@ -117,6 +396,481 @@ static int verify_cookie(SSL *ssl, unsigned char *cookie, unsigned int cookie_le
 	return (0);
 }
 
+/** @brief Create a session cache and attach it to a server.
+  *
+  * Sessions are kept in a fixed number of slots split into shards each
+  * with its own lock, the oldest session in a set is replaced when full.
+  * The cache is in shared memory so it is shared with processes forked
+  * after this call or with other processes using the same file.
+  * @param size Number of sessions.
+  * @param path Optional file to map the cache from.
+  * @returns New cache or NULL on failure.*/
+static struct ssl_sesscache *sslcache_new(int size, const char *path) {
+	struct ssl_sesscache *cache;
+	struct ssl_cachehdr *hdr;
+	uint32_t sets;
+	int i;
+#ifndef __WIN32__
+	pthread_mutexattr_t attr;
+	struct stat finfo;
+#endif
+
+	if (!(cache = calloc(1, sizeof(*cache)))) {
+		return NULL;
+	}
+
+	sets = (size + (SSL_CACHE_SHARDS * SSL_CACHE_WAYS) - 1) / (SSL_CACHE_SHARDS * SSL_CACHE_WAYS);
+	sets = (sets) ? sets : 1;
+	cache->size = sizeof(*hdr) + (sizeof(struct ssl_cacheslot) * SSL_CACHE_SHARDS * SSL_CACHE_WAYS * sets);
+	cache->fd = -1;
+
+#ifndef __WIN32__
+	if (path) {
+		if ((cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+			free(cache);
+			return NULL;
+		}
+		/*only one process sets up the file*/
+		flock(cache->fd, LOCK_EX);
+		if (fstat(cache->fd, &finfo) || ((finfo.st_size != (off_t)cache->size) && ftruncate(cache->fd, cache->size))) {
+			flock(cache->fd, LOCK_UN);
+			close(cache->fd);
+			free(cache);
+			return NULL;
+		}
+		hdr = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	} else {
+		hdr = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	}
+	if (hdr == MAP_FAILED) {
+		if (cache->fd >= 0) {
+			flock(cache->fd, LOCK_UN);
+			close(cache->fd);
+		}
+		free(cache);
+		return NULL;
+	}
+#else
+	if (!(hdr = calloc(1, cache->size))) {
+		free(cache);
+		return NULL;
+	}
+#endif
+	cache->hdr = hdr;
+
+	/*a existing cache of the same layout is used as is*/
+	if ((hdr->magic != SSL_CACHE_MAGIC) || (hdr->sets != sets) || (hdr->slotsize != sizeof(struct ssl_cacheslot))) {
+		memset(hdr, 0, cache->size);
+#ifndef __WIN32__
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		for(i = 0; i < SSL_CACHE_SHARDS; i++) {
+			pthread_mutex_init(&hdr->locks[i], &attr);
+		}
+		pthread_mutex_init(&hdr->tickets.lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+#else
+		for(i = 0; i < SSL_CACHE_SHARDS; i++) {
+			pthread_mutex_init(&hdr->locks[i], NULL);
+		}
+		pthread_mutex_init(&hdr->tickets.lock, NULL);
+#endif
+		hdr->tickets.shared = 1;
+		hdr->sets = sets;
+		hdr->slotsize = sizeof(struct ssl_cacheslot);
+		hdr->magic = SSL_CACHE_MAGIC;
+	}
+
+#ifndef __WIN32__
+	if (cache->fd >= 0) {
+		flock(cache->fd, LOCK_UN);
+	}
+#endif
+
+	return (cache);
+}
+
+static void sslcache_free(struct ssl_sesscache *cache) {
+#ifndef __WIN32__
+	munmap(cache->hdr, cache->size);
+	if (cache->fd >= 0) {
+		close(cache->fd);
+	}
+#else
+	free(cache->hdr);
+#endif
+	free(cache);
+}
+
+/*a process holding the lock died the slots may be half written but
+ * a bad session fails to decode and is replaced*/
+static void sslcache_lock(pthread_mutex_t *lock) {
+#ifndef __WIN32__
+	if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(lock);
+	}
+#else
+	pthread_mutex_lock(lock);
+#endif
+}
+
+/*return the set of slots the id belongs in and the lock of its shard*/
+static struct ssl_cacheslot *sslcache_set(struct ssl_sesscache *cache, const unsigned char *id, unsigned int idlen, pthread_mutex_t **lock) {
+	struct ssl_cachehdr *hdr = cache->hdr;
+	struct ssl_cacheslot *slots = (struct ssl_cacheslot *)((char *)hdr + sizeof(*hdr));
+	uint32_t hash, shard;
+
+	hash = jenhash(id, idlen, 0);
+	shard = hash % SSL_CACHE_SHARDS;
+	*lock = &hdr->locks[shard];
+
+	return (&slots[((shard * hdr->sets) + ((hash / SSL_CACHE_SHARDS) % hdr->sets)) * SSL_CACHE_WAYS]);
+}
+
+static struct ssldata *ssl_ctxdata(SSL_CTX *ctx) {
+	return ((ssl_ctxidx < 0) ? NULL : SSL_CTX_get_ex_data(ctx, ssl_ctxidx));
+}
+
+static int sslcache_newsess(SSL *s, SSL_SESSION *sess) {
+	struct ssldata *ssl = ssl_ctxdata(SSL_get_SSL_CTX(s));
+	struct ssl_cacheslot *set, *slot = NULL;
+	pthread_mutex_t *lock;
+	const unsigned char *id;
+	unsigned char *der;
+	unsigned int idlen;
+	time_t now = time(NULL);
+	int len, i;
+
+	if (!ssl || !ssl->cache) {
+		return (0);
+	}
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (!idlen || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH) || (len <= 0) || (len > SSL_CACHE_SESSMAX)) {
+		return (0);
+	}
+
+	set = sslcache_set(ssl->cache, id, idlen, &lock);
+	sslcache_lock(lock);
+	/*the same session a free slot or the one expiring first*/
+	for(i = 0; i < SSL_CACHE_WAYS; i++) {
+		if ((set[i].idlen == idlen) && !memcmp(set[i].id, id, idlen)) {
+			slot = &set[i];
+			break;
+		}
+		if (!slot || (set[i].expires < slot->expires) || (set[i].expires <= now)) {
+			slot = &set[i];
+		}
+	}
+
+	der = slot->data;
+	slot->len = i2d_SSL_SESSION(sess, &der);
+	slot->idlen = idlen;
+	memcpy(slot->id, id, idlen);
+	slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	pthread_mutex_unlock(lock);
+
+	/*the session is copied no reference is kept*/
+	return (0);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *sslcache_getsess(SSL *s, const unsigned char *id, int idlen, int *copy) {
+#else
+static SSL_SESSION *sslcache_getsess(SSL *s, unsigned char *id, int idlen, int *copy) {
+#endif
+	struct ssldata *ssl = ssl_ctxdata(SSL_get_SSL_CTX(s));
+	struct ssl_cacheslot *set;
+	pthread_mutex_t *lock;
+	SSL_SESSION *sess = NULL;
+	const unsigned char *der;
+	time_t now = time(NULL);
+	int i;
+
+	*copy = 0;
+	if (!ssl || !ssl->cache || (idlen <= 0) || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH)) {
+		return NULL;
+	}
+
+	set = sslcache_set(ssl->cache, id, idlen, &lock);
+	sslcache_lock(lock);
+	for(i = 0; i < SSL_CACHE_WAYS; i++) {
+		if ((set[i].idlen == (unsigned int)idlen) && !memcmp(set[i].id, id, idlen)) {
+			der = set[i].data;
+			if ((set[i].expires <= now) || !(sess = d2i_SSL_SESSION(NULL, &der, set[i].len))) {
+				set[i].idlen = 0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
+
+	return (sess);
+}
+
+static void sslcache_delsess(SSL_CTX *ctx, SSL_SESSION *sess) {
+	struct ssldata *ssl = ssl_ctxdata(ctx);
+	struct ssl_cacheslot *set;
+	pthread_mutex_t *lock;
+	const unsigned char *id;
+	unsigned int idlen;
+	int i;
+
+	if (!ssl || !ssl->cache) {
+		return;
+	}
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (!idlen || (idlen > SSL_MAX_SSL_SESSION_ID_LENGTH)) {
+		return;
+	}
+
+	set = sslcache_set(ssl->cache, id, idlen, &lock);
+	sslcache_lock(lock);
+	for(i = 0; i < SSL_CACHE_WAYS; i++) {
+		if ((set[i].idlen == idlen) && !memcmp(set[i].id, id, idlen)) {
+			set[i].idlen = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
+}
+
+/*new current key the old one is kept to decrypt tickets issued with it
+ * must hold the ticket lock*/
+static void sslticket_rotate(struct ssl_tickets *tickets) {
+	memcpy(&tickets->keys[1], &tickets->keys[0], sizeof(tickets->keys[1]));
+	if ((RAND_bytes(tickets->keys[0].name, sizeof(tickets->keys[0].name)) <= 0) ||
+			(RAND_bytes(tickets->keys[0].aes, sizeof(tickets->keys[0].aes)) <= 0) ||
+			(RAND_bytes(tickets->keys[0].hmac, sizeof(tickets->keys[0].hmac)) <= 0)) {
+		/*dont issue tickets with a weak key*/
+		tickets->keys[0].created = 0;
+		return;
+	}
+	tickets->keys[0].created = time(NULL);
+}
+
+/*find the key for the ticket and set up the cipher the caller sets up the MAC with key*/
+static int sslticket_key(SSL *s, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, struct ssl_ticketkey *keyp, int enc) {
+	struct ssldata *ssl = ssl_ctxdata(SSL_get_SSL_CTX(s));
+	struct ssl_tickets *tickets;
+	struct ssl_ticketkey key;
+	time_t now = time(NULL);
+	int idx;
+
+	if (!ssl || !(tickets = ssl->tickets)) {
+		return (0);
+	}
+
+	sslcache_lock(&tickets->lock);
+	/*rotate on use a key older than 2 periods is gone*/
+	if (!tickets->keys[0].created || (tickets->rotate && (now - tickets->keys[0].created >= tickets->rotate))) {
+		sslticket_rotate(tickets);
+		if (tickets->rotate && (now - tickets->keys[1].created >= tickets->rotate)) {
+			tickets->keys[1].created = 0;
+		}
+	}
+	if (enc) {
+		memcpy(&key, &tickets->keys[0], sizeof(key));
+		pthread_mutex_unlock(&tickets->lock);
+
+		if (!key.created || (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)) {
+			return (-1);
+		}
+		memcpy(name, key.name, sizeof(key.name));
+		EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+		memcpy(keyp, &key, sizeof(key));
+		return (1);
+	}
+
+	for(idx = 0; idx < 2; idx++) {
+		if (tickets->keys[idx].created && !memcmp(name, tickets->keys[idx].name, sizeof(key.name))) {
+			break;
+		}
+	}
+	if (idx < 2) {
+		memcpy(&key, &tickets->keys[idx], sizeof(key));
+	}
+	pthread_mutex_unlock(&tickets->lock);
+
+	/*unknown or expired key do a full handshake*/
+	if (idx == 2) {
+		return (0);
+	}
+
+	EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+	memcpy(keyp, &key, sizeof(key));
+
+	/*issue a new ticket with the current key*/
+	return ((idx) ? 2 : 1);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int sslticket_cb(SSL *s, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *mctx, int enc) {
+	struct ssl_ticketkey key;
+	OSSL_PARAM params[3];
+	int ret;
+
+	if ((ret = sslticket_key(s, name, iv, ectx, &key, enc)) <= 0) {
+		return (ret);
+	}
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	ret = (EVP_MAC_CTX_set_params(mctx, params)) ? ret : -1;
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return (ret);
+}
+#else
+static int sslticket_cb(SSL *s, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+	struct ssl_ticketkey key;
+	int ret;
+
+	if ((ret = sslticket_key(s, name, iv, ectx, &key, enc)) <= 0) {
+		return (ret);
+	}
+
+	HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL);
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return (ret);
+}
+#endif
+
+static int32_t hash_clientsess(const void *data, int key) {
+	const struct ssl_clientsess *ent = data;
+	const char *peer = (key) ? data : ent->peer;
+
+	return jenhash(peer, strlen(peer), 0);
+}
+
+/*sessions are kept per remote address and port*/
+static int sslclient_peer(int fd, char *buf, int len) {
+	union sockstruct addr;
+	socklen_t salen = sizeof(addr);
+	char ip[INET6_ADDRSTRLEN];
+
+	memset(&addr, 0, sizeof(addr));
+	if ((fd < 0) || getpeername(fd, &addr.sa, &salen) || !sockaddr2ip(&addr, ip, sizeof(ip))) {
+		return (0);
+	}
+
+	snprintf(buf, len, "%s/%i", ip, ntohs((addr.sa.sa_family == AF_INET6) ? addr.sa6.sin6_port : addr.sa4.sin_port));
+	return (1);
+}
+
+/*drop expired sessions to make space*/
+static void sslclient_expire(struct bucket_list *store) {
+	struct ssl_clientsess *ent;
+	struct bucket_loop *bloop;
+	time_t now = time(NULL);
+
+	bloop = init_bucket_loop(store);
+	while(bloop && (ent = next_bucket_loop(bloop))) {
+		if (ent->expires <= now) {
+			remove_bucket_loop(bloop);
+		}
+		objunref(ent);
+	}
+	objunref(bloop);
+}
+
+/*reference the client session store and its size*/
+static struct bucket_list *sslclient_store(int *max) {
+	struct bucket_list *store;
+
+	pthread_mutex_lock(&ssl_clientlock);
+	store = (objref(ssl_clients)) ? ssl_clients : NULL;
+	if (max) {
+		*max = ssl_clientmax;
+	}
+	pthread_mutex_unlock(&ssl_clientlock);
+
+	return (store);
+}
+
+static int sslclient_newsess(SSL *s, SSL_SESSION *sess) {
+	struct bucket_list *store;
+	struct ssl_clientsess *ent, *old;
+	unsigned char *der;
+	char peer[64];
+	int len, max;
+
+	if (!(store = sslclient_store(&max))) {
+		return (0);
+	}
+
+	len = i2d_SSL_SESSION(sess, NULL);
+	if ((len <= 0) || (len > SSL_CACHE_SESSMAX) || !sslclient_peer(SSL_get_fd(s), peer, sizeof(peer)) ||
+			!(ent = objalloc(sizeof(*ent) + len, NULL))) {
+		objunref(store);
+		return (0);
+	}
+
+	ent->data = (unsigned char *)ent + sizeof(*ent);
+	der = ent->data;
+	ent->len = i2d_SSL_SESSION(sess, &der);
+	ent->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	snprintf(ent->peer, sizeof(ent->peer), "%s", peer);
+
+	if ((old = bucket_list_find_key(store, peer))) {
+		remove_bucket_item(store, old);
+		objunref(old);
+	} else if (bucket_list_cnt(store) >= max) {
+		sslclient_expire(store);
+	}
+
+	if (bucket_list_cnt(store) < max) {
+		addtobucket(store, ent);
+	}
+	objunref(ent);
+	objunref(store);
+
+	return (0);
+}
+
+/*a context used by servers and clients has one callback for new sessions*/
+static int ssl_newsess_cb(SSL *s, SSL_SESSION *sess) {
+	return (SSL_is_server(s)) ? sslcache_newsess(s, sess) : sslclient_newsess(s, sess);
+}
+
+/*keep client sessions of the context once a server cache on it is kept
+ * must hold the lock of the context's ssl*/
+static void sslclient_cache(struct ssldata *ssl) {
+	long mode = SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL;
+
+	if (ssl->flags & SSL_CLIENTCACHE) {
+		return;
+	}
+	if (ssl->cache) {
+		mode |= SSL_SESS_CACHE_SERVER;
+	}
+	SSL_CTX_set_session_cache_mode(ssl->ctx, mode);
+	SSL_CTX_sess_set_new_cb(ssl->ctx, ssl_newsess_cb);
+	ssl->flags |= SSL_CLIENTCACHE;
+}
+
+/*offer the last session used with the server must hold the ssl lock*/
+static void sslclient_resume(struct ssldata *ssl, struct bucket_list *store, int fd) {
+	struct ssl_clientsess *ent;
+	SSL_SESSION *sess;
+	const unsigned char *der;
+	char peer[64];
+
+	if (sslclient_peer(fd, peer, sizeof(peer)) && (ent = bucket_list_find_key(store, peer))) {
+		der = ent->data;
+		if ((ent->expires > time(NULL)) && (sess = d2i_SSL_SESSION(NULL, &der, ent->len))) {
+			SSL_set_session(ssl->ssl, sess);
+			SSL_SESSION_free(sess);
+		}
+		objunref(ent);
+	}
+}
+
 static int _ssl_shutdown(struct ssldata *ssl) {
 	int err, ret = 0;
 
@@ -184,6 +938,10 @@ extern void ssl_shutdown(void *data, int sock) {
 		return;
 	}
 
+	if (ssl->demux) {
+		dtls_demux_stop(ssl, sock);
+	}
+
 	objlock(ssl);
 
 	while (ssl->ssl &&  (ret = _ssl_shutdown(ssl) && (cnt < 3))) {
@@ -201,6 +959,14 @@ extern void ssl_shutdown(void *data, int sock) {
 	objunlock(ssl);
 }
 
+/*tell the workers to exit they hold a reference to the pool*/
+static void ssl_cryptostop(struct ssl_cryptopool *pool) {
+	setflag(pool, SSL_CRYPTO_STOP);
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
 static void free_ssldata(void *data) {
 	struct ssldata *ssl = data;
 
@@ -208,6 +974,32 @@ static void free_ssldata(void *data) {
 		objunref(ssl->parent);
 	}
 
+	if (ssl->tickets && !ssl->tickets->shared) {
+		pthread_mutex_destroy(&ssl->tickets->lock);
+		free(ssl->tickets);
+	}
+	if (ssl->cache) {
+		sslcache_free(ssl->cache);
+	}
+	if (ssl->early) {
+		free(ssl->early);
+	}
+	if (ssl->demux) {
+		objunref(ssl->demux);
+	}
+	if (ssl->pool) {
+		ssl_cryptostop(ssl->pool);
+		objunref(ssl->pool);
+	}
+	if (ssl->ssl) {
+		SSL_free(ssl->ssl);
+		ssl->ssl = NULL;
+	}
+
+	if (ssl->certs) {
+		SSL_CTX_free(ssl->certs);
+		ssl->certs = NULL;
+	}
 	if (ssl->ctx) {
 		SSL_CTX_free(ssl->ctx);
 		ssl->ctx = NULL;
@@ -218,42 +1010,61 @@ static int verify_callback (int ok, X509_STORE_CTX *ctx) {
 	return (1);
 }
 
-static struct ssldata *sslinit(const char *cacert, const char *cert, const char *key, int verify, const SSL_METHOD *meth, int flags) {
-	struct ssldata *ssl;
+/*DTLSv1_listen() uses the callbacks of the context the session has
+ * which is the one loaded by ssl_reload() if there is one*/
+static void ssl_dtlscookies(SSL_CTX *ctx) {
+	SSL_CTX_set_cookie_generate_cb(ctx, generate_cookie);
+	SSL_CTX_set_cookie_verify_cb(ctx, verify_cookie);
+}
+
+/*load the CA certificate and key into a context returns 0 on failure*/
+static int ssl_loadcerts(SSL_CTX *ctx, const char *cacert, const char *cert, const char *key) {
 	struct stat finfo;
 	int ret = -1;
 
-	if (!(ssl = objalloc(sizeof(*ssl), free_ssldata))) {
-		return NULL;
-	}
-
-	ssl->flags = flags;
-	ssl->meth = meth;
-	if (!(ssl->ctx = SSL_CTX_new(meth))) {
-		objunref(ssl);
-		return NULL;
-	}
-
 	if (!stat(cacert, &finfo)) {
-		if (S_ISDIR(finfo.st_mode) && (SSL_CTX_load_verify_locations(ssl->ctx, NULL, cacert) == 1)) {
+		if (S_ISDIR(finfo.st_mode) && (SSL_CTX_load_verify_locations(ctx, NULL, cacert) == 1)) {
 			ret = 0;
 		} else
-			if (SSL_CTX_load_verify_locations(ssl->ctx, cacert, NULL) == 1) {
+			if (SSL_CTX_load_verify_locations(ctx, cacert, NULL) == 1) {
 				ret = 0;
 			}
 	}
 
-	if (!ret && (SSL_CTX_use_certificate_file(ssl->ctx, cert, SSL_FILETYPE_PEM) == 1)) {
+	if (!ret && (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) == 1)) {
 		ret = 0;
 	}
-	if (!ret && (SSL_CTX_use_PrivateKey_file(ssl->ctx, key, SSL_FILETYPE_PEM) == 1)) {
+	if (!ret && (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) == 1)) {
 		ret = 0;
 	}
 
-	if (!ret && (SSL_CTX_check_private_key (ssl->ctx) == 1)) {
+	if (!ret && (SSL_CTX_check_private_key (ctx) == 1)) {
 		ret= 0;
 	}
 
+	return (!ret);
+}
+
+static struct ssldata *sslinit(const char *cacert, const char *cert, const char *key, int verify, const SSL_METHOD *meth, int flags) {
+	struct ssldata *ssl;
+	int ret;
+
+	if (!(ssl = objalloc(sizeof(*ssl), free_ssldata))) {
+		return NULL;
+	}
+
+	ssl->flags = flags;
+	ssl->meth = meth;
+	if (!(ssl->ctx = SSL_CTX_new(meth))) {
+		objunref(ssl);
+		return NULL;
+	}
+	if (ssl_ctxidx >= 0) {
+		SSL_CTX_set_ex_data(ssl->ctx, ssl_ctxidx, ssl);
+	}
+
+	ret = !ssl_loadcerts(ssl->ctx, cacert, cert, key);
+
 	/*XXX	Should create a tmp 512 bit rsa key for RSA ciphers also need DH
 		http://www.openssl.org/docs/ssl/SSL_CTX_set_cipher_list.html
 		SSL_CTX_set_cipher_list*/
@@ -290,6 +1101,40 @@ extern void *tlsv1_init(const char *cacert, const char *cert, const char *key, i
 	return (sslinit(cacert, cert, key, verify, meth, SSL_TLSV1));
 }
 
+/** @brief Create a SSL structure for TLS negotiating the highest version both support.
+  *
+  * Unlike tlsv1_init() the version is not fixed TLSv1.3 is used where
+  * available allowing 1-RTT handshakes and with ssl_earlydata() 0-RTT resumption.
+  * @see ssl_ciphers() ssl_curves() ssl_earlydata()
+  * @param cacert Path to the CA certificate[s].
+  * @param cert Public certificate to use.
+  * @param key Private key file.
+  * @param verify OpenSSL flags.
+  * @param minver Lowest version allowed (TLS1_2_VERSION) 0 for the lowest supported.
+  * @param maxver Highest version allowed (TLS1_3_VERSION) 0 for the highest supported.*/
+extern void *tls_init(const char *cacert, const char *cert, const char *key, int verify, int minver, int maxver) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	const SSL_METHOD *meth = TLS_method();
+#else
+	const SSL_METHOD *meth = SSLv23_method();
+#endif
+	struct ssldata *ssl;
+
+	if (!(ssl = sslinit(cacert, cert, key, verify, meth, SSL_TLS))) {
+		return (NULL);
+	}
+
+#ifdef SSL_CTX_set_min_proto_version
+	if ((minver && !SSL_CTX_set_min_proto_version(ssl->ctx, minver)) ||
+			(maxver && !SSL_CTX_set_max_proto_version(ssl->ctx, maxver))) {
+		objunref(ssl);
+		return (NULL);
+	}
+#endif
+
+	return (ssl);
+}
+
 /** @brief Create a SSL structure for SSLv2 (If available)
   * @param cacert Path to the CA certificate[s].
   * @param cert Public certificate to use.
@@ -333,8 +1178,35 @@ extern void *dtlsv1_init(const char *cacert, const char *cert, const char *key,
 	return (ssl);
 }
 
+static void ssl_nonblock(int fd, int on) {
+#ifndef __WIN32__
+	if (on) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	} else {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	}
+#else
+	unsigned long mode = on;
+	ioctlsocket(fd, FIONBIO, &mode);
+#endif
+}
+
+/*new session using the certificates last loaded with ssl_reload() the
+ * context is referenced by the session so it keeps them after a reload
+ * must be called with ssl locked*/
+static SSL *ssl_newsess(struct ssldata *ssl) {
+	SSL *s;
+
+	if ((s = SSL_new(ssl->ctx)) && ssl->certs) {
+		SSL_set_SSL_CTX(s, ssl->certs);
+	}
+	return (s);
+}
+
+/*accept is 0 for clients 1 to accept blocking and 2 to leave the handshake to ssl_handshake()*/
 static void sslsockstart(struct fwsocket *sock, struct ssldata *orig,int accept) {
 	struct ssldata *ssl = sock->ssl;
+	struct bucket_list *store;
 
 	if (!ssl) {
 		return;
@@ -344,21 +1216,47 @@ static void sslsockstart(struct fwsocket *sock, struct ssldata *orig,int accept)
 	objlock(ssl);
 	if (orig) {
 		objlock(orig);
-		ssl->ssl = SSL_new(orig->ctx);
+		ssl->ssl = ssl_newsess(orig);
 		objunlock(orig);
 	} else {
-		ssl->ssl = SSL_new(ssl->ctx);
+		ssl->ssl = ssl_newsess(ssl);
 	}
 
 	if (ssl->ssl) {
 		ssl->bio = BIO_new_socket(sock->sock, BIO_NOCLOSE);
 		objunlock(sock);
 		SSL_set_bio(ssl->ssl, ssl->bio, ssl->bio);
-		if (accept) {
+		if ((accept == 2) && (sock->type == SOCK_STREAM)) {
+			/*the handshake is run by ssl_handshake() as the client sends data*/
+			ssl_nonblock(sock->sock, 1);
+			SSL_set_accept_state(ssl->ssl);
+			ssl->flags |= SSL_SERVER | SSL_HANDSHAKE;
+#ifdef HAVE_SSL_EARLYDATA
+			if (SSL_get_max_early_data(ssl->ssl) > 0) {
+				ssl->flags |= SSL_EARLYDATA;
+			}
+#endif
+		} else if (accept) {
 			SSL_accept(ssl->ssl);
 			ssl->flags |= SSL_SERVER;
 		} else {
-			SSL_connect(ssl->ssl);
+			if ((store = sslclient_store(NULL))) {
+				if (orig) {
+					objlock(orig);
+					sslclient_cache(orig);
+					objunlock(orig);
+				} else {
+					sslclient_cache(ssl);
+				}
+				sslclient_resume(ssl, store, sock->sock);
+				objunref(store);
+			}
+			/*socketwrite_early() sends data before the handshake is completed*/
+			if (ssl->flags & SSL_EARLYDATA) {
+				SSL_set_connect_state(ssl->ssl);
+			} else {
+				SSL_connect(ssl->ssl);
+			}
 			ssl->flags |= SSL_CLIENT;
 		}
 		if (orig) {
@@ -384,11 +1282,978 @@ extern void tlsaccept(struct fwsocket *sock, struct ssldata *orig) {
 	if ((sock->ssl = objalloc(sizeof(*sock->ssl), free_ssldata))) {
 		sslsockstart(sock, orig, 1);
 	}
-}
+}
+
+/*the socket handler runs the handshake as data arrives*/
+void tlsaccept_defer(struct fwsocket *sock, struct ssldata *orig) {
+	setflag(sock, SOCK_FLAG_SSL);
+	if ((sock->ssl = objalloc(sizeof(*sock->ssl), free_ssldata))) {
+		sslsockstart(sock, orig, 2);
+	}
+}
+
+/** @brief Create SSL session for a new client connection
+  *
+  * The session uses the context of orig allowing a number of client
+  * connections to share one SSL structure created with tlsv1_init().
+  * @param sock Reference too the connected socket.
+  * @param orig SSL structure to clone.*/
+extern void tlsconnect(struct fwsocket *sock, struct ssldata *orig) {
+	setflag(sock, SOCK_FLAG_SSL);
+	if ((sock->ssl = objalloc(sizeof(*sock->ssl), free_ssldata))) {
+		sslsockstart(sock, orig, 0);
+	}
+}
+
+/** @brief Keep sessions of a server in a shared cache for resumption.
+  *
+  * OpenSSL's internal cache is replaced by a fixed size cache split into
+  * shards so connections resuming sessions do not contend on one lock.
+  * Processes forked after this call share the cache, if a file is given
+  * unrelated processes mapping the same file share it too.
+  * @note Call before the server is started.
+  * @param data SSL structure of the server.
+  * @param size Number of sessions to keep.
+  * @param timeout Seconds a session can be resumed.
+  * @param path Optional file the cache is kept in.
+  * @returns 0 on failure.*/
+extern int ssl_sessioncache(void *data, int size, int timeout, const char *path) {
+	struct ssldata *ssl = data;
+	struct ssl_sesscache *cache;
+
+	if (!ssl || !ssl->ctx || (size <= 0) || !(cache = sslcache_new(size, path))) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (ssl->cache) {
+		objunlock(ssl);
+		sslcache_free(cache);
+		return (0);
+	}
+	ssl->cache = cache;
+	SSL_CTX_set_session_id_context(ssl->ctx, (const unsigned char *)SSL_CACHE_SIDCTX, strlen(SSL_CACHE_SIDCTX));
+	SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL |
+								   ((ssl->flags & SSL_CLIENTCACHE) ? SSL_SESS_CACHE_CLIENT : 0));
+	SSL_CTX_sess_set_new_cb(ssl->ctx, ssl_newsess_cb);
+	SSL_CTX_sess_set_get_cb(ssl->ctx, sslcache_getsess);
+	SSL_CTX_sess_set_remove_cb(ssl->ctx, sslcache_delsess);
+	if (timeout > 0) {
+		SSL_CTX_set_timeout(ssl->ctx, timeout);
+	}
+	objunlock(ssl);
+
+	return (1);
+}
+
+/** @brief Issue session tickets with keys that are rotated.
+  *
+  * A new key is made every rotate seconds tickets made with the previous
+  * key are accepted and replaced so a ticket is valid for up to twice the
+  * period. If the server has a session cache (ssl_sessioncache()) the keys
+  * are kept in it and shared by all processes using it.
+  * @param data SSL structure of the server.
+  * @param rotate Seconds a key is used 0 to never rotate.
+  * @returns 0 on failure.*/
+extern int ssl_ticketkeys(void *data, int rotate) {
+	struct ssldata *ssl = data;
+	struct ssl_tickets *tickets;
+
+	if (!ssl || !ssl->ctx) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (!(tickets = ssl->tickets)) {
+		if (ssl->cache) {
+			tickets = &ssl->cache->hdr->tickets;
+		} else if ((tickets = calloc(1, sizeof(*tickets)))) {
+			pthread_mutex_init(&tickets->lock, NULL);
+		} else {
+			objunlock(ssl);
+			return (0);
+		}
+		ssl->tickets = tickets;
+	}
+
+	sslcache_lock(&tickets->lock);
+	tickets->rotate = rotate;
+	pthread_mutex_unlock(&tickets->lock);
+
+	SSL_CTX_clear_options(ssl->ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl->ctx, sslticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ssl->ctx, sslticket_cb);
+#endif
+	objunlock(ssl);
+
+	return (1);
+}
+
+/** @brief Replace the session ticket key now.
+  *
+  * Tickets made with the previous key are still accepted.
+  * @param data SSL structure of the server set up with ssl_ticketkeys().*/
+extern void ssl_ticketrotate(void *data) {
+	struct ssldata *ssl = data;
+	struct ssl_tickets *tickets;
+
+	if (!ssl || !(tickets = ssl->tickets)) {
+		return;
+	}
+
+	sslcache_lock(&tickets->lock);
+	sslticket_rotate(tickets);
+	pthread_mutex_unlock(&tickets->lock);
+}
+
+/** @brief Resume sessions of client connections.
+  *
+  * The last session of each server address and port is kept and offered
+  * when a new TLS connection is made to it (tcpconnect(), tlsconnect()).
+  * @param size Number of servers to keep sessions for 0 to stop.
+  * @returns 0 on failure.*/
+extern int ssl_sessionreuse(int size) {
+	struct bucket_list *store = NULL, *old;
+
+	if ((size > 0) && !(store = create_bucketlist(5, hash_clientsess))) {
+		return (0);
+	}
+
+	pthread_mutex_lock(&ssl_clientlock);
+	old = ssl_clients;
+	ssl_clients = store;
+	ssl_clientmax = size;
+	pthread_mutex_unlock(&ssl_clientlock);
+	if (old) {
+		objunref(old);
+	}
+
+	return (1);
+}
+
+/** @brief Hand record encryption of established sessions to the kernel.
+  *
+  * Once the handshake is done the keys are passed to the socket (kernel TLS)
+  * reads and writes no longer copy through user space and socket_sendfile()
+  * sends files encrypted by the kernel. If the kernel or cipher does not
+  * support it the session is encrypted by openssl as before.
+  * @see socket_ktls()
+  * @note Call before connections are made.
+  * @param data SSL structure of the server or client.
+  * @param enable Set to 0 to turn it off.
+  * @returns 0 if kernel TLS is not available.*/
+extern int ssl_ktls(void *data, int enable) {
+#ifdef HAVE_SSL_KTLS
+	struct ssldata *ssl = data;
+
+	if (!ssl) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (enable) {
+		SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+	} else {
+		SSL_CTX_clear_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+	}
+	objunlock(ssl);
+
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+/** @brief Set the ciphers allowed.
+  * @param data SSL structure.
+  * @param ciphers Openssl cipher list for TLSv1.2 and lower NULL to leave unchanged.
+  * @param suites TLSv1.3 cipher suites seperated by : NULL to leave unchanged.
+  * @returns 0 if a list is invalid.*/
+extern int ssl_ciphers(void *data, const char *ciphers, const char *suites) {
+	struct ssldata *ssl = data;
+	int ret = 1;
+
+	if (!ssl) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (ciphers && !SSL_CTX_set_cipher_list(ssl->ctx, ciphers)) {
+		ret = 0;
+	}
+#ifdef TLS1_3_VERSION
+	if (suites && !SSL_CTX_set_ciphersuites(ssl->ctx, suites)) {
+		ret = 0;
+	}
+#endif
+	objunlock(ssl);
+
+	return (ret);
+}
+
+/** @brief Set the key exchange curves (groups) in order of preference.
+  *
+  * Placing the curve clients are most likely to send a key share for
+  * first (X25519) avoids a extra round trip in TLSv1.3.
+  * @param data SSL structure.
+  * @param curves List of curves seperated by : (X25519:P-256).
+  * @returns 0 if the list is invalid.*/
+extern int ssl_curves(void *data, const char *curves) {
+	struct ssldata *ssl = data;
+	int ret;
+
+	if (!ssl || !curves) {
+		return (0);
+	}
+
+	objlock(ssl);
+	ret = SSL_CTX_set1_curves_list(ssl->ctx, curves);
+	objunlock(ssl);
+
+	return ((ret == 1) ? 1 : 0);
+}
+
+/** @brief Allow TLSv1.3 early (0-RTT) data on resumed sessions.
+  *
+  * Servers accept up to size bytes sent by the client with its hello
+  * this is returned by socketread() once the handshake completes. Clients
+  * send it with socketwrite_early().
+  * @warning Early data can be replayed by a attacker only use it for
+  * requests that are safe to repeat.
+  * @param data SSL structure.
+  * @param size Largest amount of early data 0 to disable.
+  * @returns 0 if early data is not supported.*/
+extern int ssl_earlydata(void *data, int size) {
+#ifdef HAVE_SSL_EARLYDATA
+	struct ssldata *ssl = data;
+
+	if (!ssl || (size < 0)) {
+		return (0);
+	}
+
+	objlock(ssl);
+	SSL_CTX_set_max_early_data(ssl->ctx, size);
+	SSL_CTX_set_recv_max_early_data(ssl->ctx, size);
+	objunlock(ssl);
+
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+static void free_cryptopool(void *data) {
+	struct ssl_cryptopool *pool = data;
+
+	if (pool->queue) {
+		objunref(pool->queue);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/** @brief Run the handshakes of a TLS server on crypto worker threads.
+  *
+  * Connections on a event loop pass each step of there handshake to a
+  * worker so the key exchange and signing for a new client does not hold
+  * up the other sockets on the loop, when the step is done the worker hands
+  * the connection back to the loop. SSL_MODE_ASYNC is set a engine that
+  * completes crypto operations asynchronously is waited on by the worker.
+  * @note Call before the server is started, connections with there own
+  * thread run the handshake in it.
+  * @see socketloop_init()
+  * @param data SSL structure of the server.
+  * @param threads Number of workers 0 starts one per CPU.
+  * @returns Number of workers running.*/
+extern int ssl_offload(void *data, int threads) {
+#ifndef __WIN32__
+	struct ssldata *ssl = data;
+	struct ssl_cryptopool *pool;
+
+	if (!ssl || !ssl->ctx) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if ((pool = ssl->pool)) {
+		objunlock(ssl);
+		return (pool->threads);
+	}
+	objunlock(ssl);
+
+	if (threads <= 0) {
+		threads = framework_cpucount();
+	}
+
+	if (!(pool = objalloc(sizeof(*pool), free_cryptopool))) {
+		return (0);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	/*the workers hold there own reference*/
+	if (!(pool->queue = create_ringbuffer(SSL_CRYPTO_QUEUE, RING_BUFFER_MPSC)) ||
+			!(pool->threads = framework_mkthread_spread(threads, ssl_cryptothread, ssl_cryptoclean, NULL, pool, 0, "sslcrypto"))) {
+		ssl_cryptostop(pool);
+		objunref(pool);
+		return (0);
+	}
+
+	objlock(ssl);
+#ifdef HAVE_SSL_ASYNC
+	SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ASYNC);
+#endif
+	ssl->pool = pool;
+	objunlock(ssl);
+
+	return (pool->threads);
+#else
+	return (0);
+#endif
+}
+
+/** @brief Load new certificates for sessions started from now on.
+  *
+  * The files are loaded into a new context the sessions of connections
+  * already made keep a reference to the one they were started with, other
+  * settings remain those of the SSL structure. If the files can not be
+  * loaded or the key does not match the certificates in use are kept.
+  * @see ssl_reloadwatch()
+  * @param data SSL structure of a server or client.
+  * @param cacert CA certificate file or directory.
+  * @param cert Certificate file.
+  * @param key Private key file.
+  * @returns 0 on failure.*/
+extern int ssl_reload(void *data, const char *cacert, const char *cert, const char *key) {
+	struct ssldata *ssl = data;
+	SSL_CTX *ctx, *old;
+
+	if (!ssl || !ssl->meth || !cacert || !cert || !key || !(ctx = SSL_CTX_new(ssl->meth))) {
+		return (0);
+	}
+
+	/*a certificate and matching key are required here*/
+	if (!ssl_loadcerts(ctx, cacert, cert, key) || (SSL_CTX_check_private_key(ctx) != 1)) {
+		SSL_CTX_free(ctx);
+		return (0);
+	}
+
+	/*the session callbacks find the server from the context of the session*/
+	if (ssl_ctxidx >= 0) {
+		SSL_CTX_set_ex_data(ctx, ssl_ctxidx, ssl);
+	}
+	if (ssl->cache) {
+		SSL_CTX_set_session_id_context(ctx, (const unsigned char *)SSL_CACHE_SIDCTX, strlen(SSL_CACHE_SIDCTX));
+	}
+	/*the session takes the certificate settings from this context*/
+	SSL_CTX_set_security_level(ctx, SSL_CTX_get_security_level(ssl->ctx));
+	if (ssl->flags & SSL_DTLSV1) {
+		ssl_dtlscookies(ctx);
+	}
+
+	objlock(ssl);
+	old = ssl->certs;
+	ssl->certs = ctx;
+	objunlock(ssl);
+
+	if (old) {
+		SSL_CTX_free(old);
+	}
+	return (1);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static const char *ssl_basename(const char *path) {
+	const char *sep;
+
+	return ((sep = strrchr(path, '/'))) ? sep + 1 : path;
+}
+
+/*watch the directory the file is in so replacing it or a link to it is seen*/
+static int ssl_watchfile(int fd, const char *path) {
+	char dir[PATH_MAX];
+	const char *sep;
+
+	if (!(sep = strrchr(path, '/'))) {
+		return (inotify_add_watch(fd, ".", SSL_WATCH_MASK));
+	}
+	snprintf(dir, sizeof(dir), "%.*s", (sep == path) ? 1 : (int)(sep - path), path);
+	return (inotify_add_watch(fd, dir, SSL_WATCH_MASK));
+}
+
+static int ssl_watchmatch(struct ssl_watch *watch, struct inotify_event *ev) {
+	const char *file[3];
+	int i;
+
+	file[0] = watch->cacert;
+	file[1] = watch->cert;
+	file[2] = watch->key;
+
+	for(i = 0; i < 3; i++) {
+		if (ev->wd != watch->wd[i]) {
+			continue;
+		}
+		if (!i && (watch->flags & SSL_WATCH_CADIR)) {
+			return (1);
+		}
+		if (ev->len && !strcmp(ev->name, ssl_basename(file[i]))) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+static void *ssl_watchthread(void *data) {
+	struct ssl_watch *watch = data;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	ssize_t len, pos;
+	int ret, changed = 0;
+
+	pfd.fd = watch->fd;
+	pfd.events = POLLIN;
+
+	while(framework_threadok() && !testflag(watch, SSL_WATCH_STOP)) {
+		/*the certificate and key are often written one after the other
+		 * reload once they have been left alone for a while*/
+		pfd.revents = 0;
+		if ((ret = poll(&pfd, 1, (changed) ? SSL_WATCH_SETTLE : 1000)) < 0) {
+			continue;
+		} else if (!ret) {
+			if (changed) {
+				ssl_reload(watch->ssl, watch->cacert, watch->cert, watch->key);
+				changed = 0;
+			}
+			continue;
+		}
+
+		if ((len = read(watch->fd, buf, sizeof(buf))) <= 0) {
+			continue;
+		}
+		for(pos = 0; pos < len; pos += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)(buf + pos);
+			if (ssl_watchmatch(watch, ev)) {
+				changed = 1;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*the SSL structure no longer holds the watch once the thread exits
+ * this breaks the references each holds to the other*/
+static void ssl_watchclean(void *data) {
+	struct ssl_watch *watch = data;
+	struct ssldata *ssl = watch->ssl;
+	int drop = 0;
+
+	if (!ssl) {
+		return;
+	}
+
+	objlock(ssl);
+	if (ssl->watch == watch) {
+		ssl->watch = NULL;
+		drop = 1;
+	}
+	objunlock(ssl);
+
+	if (drop) {
+		objunref(watch);
+	}
+}
+
+static void free_sslwatch(void *data) {
+	struct ssl_watch *watch = data;
+
+	if (watch->fd >= 0) {
+		close(watch->fd);
+	}
+	if (watch->cacert) {
+		free(watch->cacert);
+	}
+	if (watch->cert) {
+		free(watch->cert);
+	}
+	if (watch->key) {
+		free(watch->key);
+	}
+	if (watch->ssl) {
+		objunref(watch->ssl);
+	}
+}
+#endif
+
+/** @brief Reload the certificates when the files change.
+  *
+  * A thread watches the directories holding the files with inotify and
+  * calls ssl_reload() once they have not changed for SSL_WATCH_SETTLE ms,
+  * files replaced by renaming them or changing a link are seen. A CA
+  * directory is reloaded when any file in it changes.
+  * @note The thread holds a reference to the SSL structure it is not freed
+  * till the watch is stopped by calling this with no files or the framework
+  * stopping its threads (Linux only).
+  * @param data SSL structure of a server or client.
+  * @param cacert CA certificate file or directory.
+  * @param cert Certificate file.
+  * @param key Private key file.
+  * @returns 0 on failure or if the files are no longer watched.*/
+extern int ssl_reloadwatch(void *data, const char *cacert, const char *cert, const char *key) {
+#ifdef HAVE_SYS_INOTIFY_H
+	struct ssldata *ssl = data;
+	struct ssl_watch *watch;
+	struct thread_attr attr;
+	struct thread_pvt *thread;
+	struct stat finfo;
+
+	if (!ssl) {
+		return (0);
+	}
+
+	/*stop watching the files watched before*/
+	objlock(ssl);
+	watch = ssl->watch;
+	ssl->watch = NULL;
+	objunlock(ssl);
+	if (watch) {
+		setflag(watch, SSL_WATCH_STOP);
+		objunref(watch);
+	}
+
+	if (!cacert || !cert || !key || !(watch = objalloc(sizeof(*watch), free_sslwatch))) {
+		return (0);
+	}
+	watch->fd = -1;
+	watch->ssl = (objref(ssl)) ? ssl : NULL;
+
+	if (!(watch->cacert = strdup(cacert)) || !(watch->cert = strdup(cert)) || !(watch->key = strdup(key)) ||
+			((watch->fd = inotify_init1(IN_CLOEXEC)) < 0)) {
+		objunref(watch);
+		return (0);
+	}
+
+	if (!stat(cacert, &finfo) && S_ISDIR(finfo.st_mode)) {
+		watch->flags |= SSL_WATCH_CADIR;
+		watch->wd[0] = inotify_add_watch(watch->fd, cacert, SSL_WATCH_MASK);
+	} else {
+		watch->wd[0] = ssl_watchfile(watch->fd, cacert);
+	}
+	watch->wd[1] = ssl_watchfile(watch->fd, cert);
+	watch->wd[2] = ssl_watchfile(watch->fd, key);
+
+	if ((watch->wd[0] < 0) || (watch->wd[1] < 0) || (watch->wd[2] < 0)) {
+		objunref(watch);
+		return (0);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.name = "sslwatch";
+
+	/*set before the thread starts so its cleanup always finds it*/
+	objlock(ssl);
+	ssl->watch = watch;
+	objunlock(ssl);
+
+	/*the thread holds its own reference*/
+	if (!(thread = framework_mkthread_attr(ssl_watchthread, ssl_watchclean, NULL, watch, THREAD_OPTION_RETURN, &attr))) {
+		ssl_watchclean(watch);
+		return (0);
+	}
+	objunref(thread);
+
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+/** @}
+  * @addtogroup LIB-Sock
+  * @{*/
+
+#ifdef HAVE_SSL_EARLYDATA
+/*read early data sent with the client hello returns 1 once all is read*/
+static int ssl_readearly(struct ssldata *ssl) {
+	size_t len;
+	int ret, max;
+
+	max = SSL_get_max_early_data(ssl->ssl);
+	if (!ssl->early && (max > 0)) {
+		ssl->early = malloc(max + 1);
+	}
+	if (!ssl->early) {
+		ssl->flags &= ~SSL_EARLYDATA;
+		return (1);
+	}
+
+	do {
+		len = 0;
+		ret = SSL_read_early_data(ssl->ssl, ssl->early + ssl->earlylen, max + 1 - ssl->earlylen, &len);
+		ssl->earlylen += len;
+	} while (ret == SSL_READ_EARLY_DATA_SUCCESS);
+
+	if (ret == SSL_READ_EARLY_DATA_FINISH) {
+		ssl->flags &= ~SSL_EARLYDATA;
+		return (1);
+	}
+	return (0);
+}
+#endif
+
+#ifdef HAVE_SSL_ASYNC
+/*wait for a engine to complete the crypto operation the handshake is paused on*/
+static int ssl_asyncwait(SSL *s) {
+	OSSL_ASYNC_FD fds[SSL_ASYNC_FDS];
+	struct pollfd pfd[SSL_ASYNC_FDS];
+	size_t cnt, i;
+
+	if (!SSL_get_all_async_fds(s, NULL, &cnt) || (cnt > SSL_ASYNC_FDS) ||
+			!SSL_get_all_async_fds(s, fds, &cnt)) {
+		return (0);
+	}
+
+	/*nothing to wait on try again*/
+	if (!cnt) {
+		return (1);
+	}
+
+	for(i = 0; i < cnt; i++) {
+		pfd[i].fd = fds[i];
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+	return (poll(pfd, cnt, SSL_ASYNC_WAIT) > 0);
+}
+#endif
+
+/** @brief Continue the handshake of a TLS connection accepted by a server.
+  *
+  * The socket is non blocking while the handshake runs so a slow or silent
+  * peer can not hold up the thread or loop handling it, each call takes the
+  * handshake as far as the data that has arrived allows. Output is small
+  * enough to fit in the socket buffer waiting for it to drain is limited to
+  * SSL_HANDSHAKE_WAIT tries. Once complete the socket is blocking again.
+  * A handshake paused by a asynchronous engine is waited on.
+  * @note A failed handshake sets SOCK_FLAG_CLOSE on the socket.
+  * @param sock Socket to run the handshake on.
+  * @returns 1 if there is no handshake pending, 2 if it completed now,
+  * 0 if waiting for the peer or -1 if it failed.*/
+int ssl_handshake(struct fwsocket *sock) {
+	struct ssldata *ssl = sock->ssl;
+	int ret, err, cnt = 0;
+
+	if (!ssl) {
+		return (1);
+	}
+
+	objlock(ssl);
+	if (!(ssl->flags & SSL_HANDSHAKE)) {
+		objunlock(ssl);
+		return (1);
+	}
+
+	while(ssl->ssl) {
+#ifdef HAVE_SSL_EARLYDATA
+		/*early data is read before the handshake continues*/
+		ret = ((ssl->flags & SSL_EARLYDATA) && !ssl_readearly(ssl)) ? 0 : SSL_do_handshake(ssl->ssl);
+#else
+		ret = SSL_do_handshake(ssl->ssl);
+#endif
+		if (ret == 1) {
+			ssl->flags &= ~SSL_HANDSHAKE;
+			if (ssl->early && !ssl->earlylen) {
+				free(ssl->early);
+				ssl->early = NULL;
+			}
+			objunlock(ssl);
+			ssl_nonblock(sock->sock, 0);
+#ifndef __WIN32__
+			if (sock->timer) {
+				socktimer_activity(sock, SOCK_STATS_IN);
+			}
+#endif
+			return (2);
+		}
+
+		err = SSL_get_error(ssl->ssl, ret);
+		if (err == SSL_ERROR_WANT_READ) {
+			objunlock(ssl);
+			return (0);
+		} else if ((err == SSL_ERROR_WANT_WRITE) && (cnt++ < SSL_HANDSHAKE_WAIT) &&
+				(socket_select(sock->sock, 0) > 0)) {
+			continue;
+#ifdef HAVE_SSL_ASYNC
+		} else if ((err == SSL_ERROR_WANT_ASYNC) && ssl_asyncwait(ssl->ssl)) {
+			continue;
+		} else if ((err == SSL_ERROR_WANT_ASYNC_JOB) && (cnt++ < SSL_HANDSHAKE_WAIT)) {
+			sched_yield();
+			continue;
+#endif
+		}
+		break;
+	}
+	objunlock(ssl);
+
+	setflag(sock, SOCK_FLAG_CLOSE);
+	return (-1);
+}
+
+#ifndef __WIN32__
+/*check for data without waiting*/
+static int ssl_readable(int fd) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return (poll(&pfd, 1, 0) > 0);
+}
+
+/*run a step of the handshake and give the session back to the loop
+ * waking it with nothing to read would hand the socket straight back*/
+static void ssl_cryptojob(struct ssl_cryptojob *job, int run) {
+	struct fwsocket *sock = job->sock;
+	struct ssldata *ssl = sock->ssl;
+	int ret = 0;
+
+	if (run && ((ret = ssl_handshake(sock)) == 2)) {
+		objlock(ssl);
+		ssl->flags |= SSL_CONNECTED;
+		objunlock(ssl);
+	}
+	__atomic_store_n(&ssl->offload, 0, __ATOMIC_RELEASE);
+
+	if ((ret || !run || ssl_readable(sock->sock)) && !socketloop_wake(job->sockh)) {
+		setflag(sock, SOCK_FLAG_CLOSE);
+	}
+}
+
+static void *ssl_cryptothread(void *data) {
+	struct ssl_cryptopool *pool = data;
+	struct ssl_cryptojob *job;
+	struct timespec ts;
+	struct timeval tv;
+
+	while(framework_threadok() && !testflag(pool, SSL_CRYPTO_STOP)) {
+		pthread_mutex_lock(&pool->lock);
+		if (!(job = ringbuffer_pop(pool->queue)) && !testflag(pool, SSL_CRYPTO_STOP)) {
+			/*wake at least once a second to check if we must stop*/
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec + 1;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+			job = ringbuffer_pop(pool->queue);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (job) {
+			ssl_cryptojob(job, 1);
+			objunref(job);
+		}
+	}
+
+	return NULL;
+}
+
+/*hand what is queued back to the loops to run there*/
+static void ssl_cryptoclean(void *data) {
+	struct ssl_cryptopool *pool = data;
+	struct ssl_cryptojob *job;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		job = ringbuffer_pop(pool->queue);
+		pthread_mutex_unlock(&pool->lock);
+		if (!job) {
+			break;
+		}
+		ssl_cryptojob(job, 0);
+		objunref(job);
+	}
+}
+
+static void free_cryptojob(void *data) {
+	struct ssl_cryptojob *job = data;
+
+	objunref(job->sock);
+	objunref(job->sockh);
+}
+#endif
+
+/** @brief Continue the handshake of a connection on a event loop.
+  *
+  * If the server has crypto workers the step is queued for one and the
+  * loop is woken when it is done, 2 is returned then so connect is called
+  * from the loop. Without workers this is ssl_handshake().
+  * @see ssl_offload()
+  * @param sock Socket to run the handshake on.
+  * @param sockh Socket handler on the loop.
+  * @returns As ssl_handshake() 0 while a worker has the session.*/
+int ssl_handshake_offload(struct fwsocket *sock, struct socket_handler *sockh) {
+#ifndef __WIN32__
+	struct ssldata *ssl = sock->ssl;
+	struct ssl_cryptopool *pool;
+	struct ssl_cryptojob *job;
+	int busy = 0, ret;
+
+	if (!ssl || !ssl->parent || !(pool = ssl->parent->pool) || testflag(pool, SSL_CRYPTO_STOP)) {
+		return (ssl_handshake(sock));
+	}
+
+	/*the session belongs to the worker till it wakes the loop*/
+	if (!__atomic_compare_exchange_n(&ssl->offload, &busy, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (ssl->flags & SSL_CONNECTED) {
+		ssl->flags &= ~SSL_CONNECTED;
+		ret = 2;
+	} else {
+		ret = (ssl->flags & SSL_HANDSHAKE) ? 0 : 1;
+	}
+	objunlock(ssl);
+
+	if (!ret && (job = objalloc(sizeof(*job), free_cryptojob))) {
+		objref(sock);
+		objref(sockh);
+		job->sock = sock;
+		job->sockh = sockh;
+		if (ringbuffer_push(pool->queue, job)) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_signal(&pool->cond);
+			pthread_mutex_unlock(&pool->lock);
+			return (0);
+		}
+		objunref(job);
+	}
+	__atomic_store_n(&ssl->offload, 0, __ATOMIC_RELEASE);
+
+	/*the workers are behind run it here*/
+	return (ret) ? ret : ssl_handshake(sock);
+#else
+	return (ssl_handshake(sock));
+#endif
+}
+
+/** @brief Check if a crypto worker has the session of a connection.
+  * @param sock Socket to check.
+  * @returns Non zero while the handshake is run by a worker.*/
+int ssl_offloaded(struct fwsocket *sock) {
+	struct ssldata *ssl = sock->ssl;
+
+	return (ssl) ? __atomic_load_n(&ssl->offload, __ATOMIC_ACQUIRE) : 0;
+}
+
+/** @brief Return if kernel TLS is used on a connection.
+  * @see ssl_ktls()
+  * @param sock Socket to check.
+  * @returns Mask of SOCK_KTLS_TX and SOCK_KTLS_RX 0 when records are encrypted by openssl.*/
+extern int socket_ktls(struct fwsocket *sock) {
+	struct ssldata *ssl;
+	int ret = 0;
+
+	if (!sock || !(ssl = sock->ssl)) {
+		return (0);
+	}
+
+#ifdef HAVE_SSL_KTLS
+	objlock(ssl);
+	if (ssl->ssl && !(ssl->flags & SSL_HANDSHAKE)) {
+		if (BIO_get_ktls_send(SSL_get_wbio(ssl->ssl))) {
+			ret |= SOCK_KTLS_TX;
+		}
+		if (BIO_get_ktls_recv(SSL_get_rbio(ssl->ssl))) {
+			ret |= SOCK_KTLS_RX;
+		}
+	}
+	objunlock(ssl);
+#endif
+
+	return (ret);
+}
+
+#ifndef __WIN32__
+#ifdef HAVE_SSL_KTLS
+/*send the file with the kernel encrypting it returns -1 if kernel TLS is not used*/
+static ssize_t ssl_ktls_sendfile(struct ssldata *ssl, int fd, off_t *off, size_t count) {
+	ssize_t ret, sent = 0;
+
+	objlock(ssl);
+	if (!ssl->ssl || !BIO_get_ktls_send(SSL_get_wbio(ssl->ssl))) {
+		objunlock(ssl);
+		return (-1);
+	}
+	while(sent < (ssize_t)count) {
+		if ((ret = SSL_sendfile(ssl->ssl, fd, *off, count - sent, 0)) <= 0) {
+			break;
+		}
+		sent += ret;
+		*off += ret;
+	}
+	objunlock(ssl);
+
+	return (sent);
+}
+#endif
+
+/*socket_sendfile() on SSL sockets the kernel encrypts the file with kernel TLS
+ * else it is read and written a record at a time*/
+ssize_t ssl_sendfile(struct fwsocket *sock, int fd, off_t *offset, size_t count) {
+	struct ssldata *ssl = sock->ssl;
+	ssize_t ret = -1, len, sent = 0;
+	off_t off;
+	char *buf;
+
+	if (!ssl || !ssl->ssl || (ssl->flags & SSL_HANDSHAKE)) {
+		return (-1);
+	}
+
+	off = (offset) ? *offset : lseek(fd, 0, SEEK_CUR);
+
+#ifdef HAVE_SSL_KTLS
+	if ((off >= 0) && ((ret = ssl_ktls_sendfile(ssl, fd, &off, count)) >= 0)) {
+		sent = ret;
+		sockstats_io(sock, SOCK_STATS_OUT, (sent > 0) ? sent : -1, 1);
+	}
+#endif
+
+	if ((ret < 0) && (buf = malloc(SSL_SENDFILE_CHUNK))) {
+		while(sent < (ssize_t)count) {
+			len = ((count - sent) > SSL_SENDFILE_CHUNK) ? SSL_SENDFILE_CHUNK : count - sent;
+			if ((len = (off >= 0) ? pread(fd, buf, len, off) : read(fd, buf, len)) <= 0) {
+				break;
+			}
+			ret = socketwrite(sock, buf, len);
+			if (ret > 0) {
+				sent += ret;
+				if (off >= 0) {
+					off += ret;
+				}
+			}
+			if (ret != len) {
+				break;
+			}
+		}
+		free(buf);
+	}
+
+	if (off >= 0) {
+		if (offset) {
+			*offset = off;
+		} else {
+			lseek(fd, off, SEEK_SET);
+		}
+	}
 
-/** @}
-  * @addtogroup LIB-Sock
-  * @{*/
+	return ((sent) ? sent : -1);
+}
+#endif
 
 /** @brief Read from a socket into a buffer.
   *
@@ -406,6 +2271,7 @@ extern void tlsaccept(struct fwsocket *sock, struct ssldata *orig) {
 extern int socketread_d(struct fwsocket *sock, void *buf, int num, union sockstruct *addr) {
 	struct ssldata *ssl = sock->ssl;
 	socklen_t salen = sizeof(*addr);
+	struct timeval start = {0, 0};
 	int ret, err, syserr;
 
 	if (!ssl && !testflag(sock, SOCK_FLAG_SSL)) {
@@ -422,6 +2288,7 @@ extern int socketread_d(struct fwsocket *sock, void *buf, int num, union sockstr
 		if (ret == 0) {
 			sock->flags |= SOCK_FLAG_CLOSE;
 		}
+		sockstats_io(sock, SOCK_STATS_IN, ret, 1);
 		objunlock(sock);
 		return (ret);
 	} else if (!ssl) {
@@ -434,12 +2301,31 @@ extern int socketread_d(struct fwsocket *sock, void *buf, int num, union sockstr
 		objunlock(ssl);
 		return (-1);
 	}
+	/*early data is read with the handshake*/
+	if (ssl->early && (ssl->flags & SSL_SERVER) && !(ssl->flags & SSL_HANDSHAKE)) {
+		ret = ssl->earlylen - ssl->earlypos;
+		ret = (ret > num) ? num : ret;
+		memcpy(buf, ssl->early + ssl->earlypos, ret);
+		ssl->earlypos += ret;
+		if (ssl->earlypos >= ssl->earlylen) {
+			free(ssl->early);
+			ssl->early = NULL;
+		}
+		objunlock(ssl);
+		sockstats_io(sock, SOCK_STATS_IN, ret, 1);
+		return (ret);
+	}
+	if (sock->stats) {
+		gettimeofday(&start, NULL);
+	}
 	ret = SSL_read(ssl->ssl, buf, num);
 	err = SSL_get_error(ssl->ssl, ret);
 	if (ret == 0) {
 		sock->flags |= SOCK_FLAG_CLOSE;
 	}
 	objunlock(ssl);
+	sockstats_ssl(sock, SOCK_STATS_IN, &start);
+	sockstats_io(sock, SOCK_STATS_IN, ret, 1);
 	switch (err) {
 		case SSL_ERROR_NONE:
 			break;
@@ -447,7 +2333,10 @@ extern int socketread_d(struct fwsocket *sock, void *buf, int num, union sockstr
 			printf("Want X509\n");
 			break;
 		case SSL_ERROR_WANT_READ:
-			printf("Read Want Read\n");
+			/*peers sharing a server socket have read all that has arrived*/
+			if (!(ssl->flags & SSL_DEMUX)) {
+				printf("Read Want Read\n");
+			}
 			break;
 		case SSL_ERROR_WANT_WRITE:
 			printf("Read Want write\n");
@@ -474,6 +2363,51 @@ extern int socketread_d(struct fwsocket *sock, void *buf, int num, union sockstr
 	return (ret);
 }
 
+/** @brief Return the number of decrypted bytes waiting to be read.
+  *
+  * Data buffered in the SSL session will not wake up the socket
+  * it must be checked for before waiting.
+  * @param sock Socket to check.
+  * @returns Number of bytes pending.*/
+extern int ssl_pending(struct fwsocket *sock) {
+	struct ssldata *ssl = sock->ssl;
+	int ret = 0;
+
+	/*a crypto worker has the session*/
+	if (!ssl || __atomic_load_n(&ssl->offload, __ATOMIC_ACQUIRE)) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (ssl->ssl) {
+		ret = SSL_pending(ssl->ssl);
+	}
+	if (ssl->early && (ssl->flags & SSL_SERVER) && !(ssl->flags & SSL_HANDSHAKE)) {
+		ret += ssl->earlylen - ssl->earlypos;
+	}
+	objunlock(ssl);
+
+	return (ret);
+}
+
+/*the session was created and the handshake completed*/
+int ssl_established(struct fwsocket *sock) {
+	struct ssldata *ssl = sock->ssl;
+	int ret = 0;
+
+	if (!ssl) {
+		return (0);
+	}
+
+	objlock(ssl);
+	if (ssl->ssl) {
+		ret = SSL_is_init_finished(ssl->ssl);
+	}
+	objunlock(ssl);
+
+	return (ret);
+}
+
 /** @brief Read from a socket into a buffer.
   *
   * There are 2 functions each for reading and writing data to a socket.
@@ -490,6 +2424,43 @@ extern int socketread(struct fwsocket *sock, void *buf, int num) {
 	return (socketread_d(sock, buf, num, NULL));
 }
 
+/** @brief Read from a socket into a pooled buffer.
+  *
+  * The buffer comes from objalloc_buf() and may be passed to other
+  * threads without copying it is returned to the pool on the last objunref().
+  * @see socketread_d()
+  * @param sock Socket structure to read from.
+  * @param size Minimum size of the buffer 0 for SOCKBUF_DEFAULT.
+  * @param len Set to the number of bytes read or the error from socketread_d().
+  * @param addr Address of the sender for datagram servers or NULL.
+  * @returns Reference to the buffer or NULL if no data was read.*/
+extern void *socketread_buf_d(struct fwsocket *sock, int size, int *len, union sockstruct *addr) {
+	void *buf;
+	int ret;
+
+	if (!(buf = objalloc_buf((size > 0) ? size : SOCKBUF_DEFAULT))) {
+		ret = -1;
+	} else if ((ret = socketread_d(sock, buf, objsize(buf), addr)) <= 0) {
+		objunref(buf);
+		buf = NULL;
+	}
+
+	if (len) {
+		*len = ret;
+	}
+	return (buf);
+}
+
+/** @brief Read from a socket into a pooled buffer.
+  * @see socketread_buf_d()
+  * @param sock Socket structure to read from.
+  * @param size Minimum size of the buffer 0 for SOCKBUF_DEFAULT.
+  * @param len Set to the number of bytes read or the error from socketread().
+  * @returns Reference to the buffer or NULL if no data was read.*/
+extern void *socketread_buf(struct fwsocket *sock, int size, int *len) {
+	return (socketread_buf_d(sock, size, len, NULL));
+}
+
 
 /** @brief Write a buffer to a socket.
   *
@@ -507,6 +2478,7 @@ extern int socketread(struct fwsocket *sock, void *buf, int num) {
   * @returns Number of bytes written or -1 on error 0 will indicate some error in SSL.*/
 extern int socketwrite_d(struct fwsocket *sock, const void *buf, int num, union sockstruct *addr) {
 	struct ssldata *ssl = (sock) ? sock->ssl : NULL;
+	struct timeval start = {0, 0};
 	int ret, err, syserr;
 
 	if (!sock) {
@@ -558,6 +2530,7 @@ extern int socketwrite_d(struct fwsocket *sock, const void *buf, int num, union
 					break;
 			}
 		}
+		sockstats_io(sock, SOCK_STATS_OUT, ret, 1);
 		objunlock(sock);
 		return (ret);
 	} else if (!ssl) {
@@ -566,13 +2539,25 @@ extern int socketwrite_d(struct fwsocket *sock, const void *buf, int num, union
 
 	if (ssl && ssl->ssl) {
 		objlock(ssl);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		if (!SSL_is_init_finished(ssl->ssl)) {
+#else
 		if (SSL_state(ssl->ssl) != SSL_ST_OK) {
+#endif
 			objunlock(ssl);
 			return (SSL_ERROR_SSL);
 		}
+		if (sock->stats) {
+			gettimeofday(&start, NULL);
+		}
 		ret = SSL_write(ssl->ssl, buf, num);
 		err = SSL_get_error(ssl->ssl, ret);
+		if ((ssl->flags & SSL_DEMUX) && sock->parent) {
+			dtls_demux_flush(ssl, sock->parent->sock, &sock->addr);
+		}
 		objunlock(ssl);
+		sockstats_ssl(sock, SOCK_STATS_OUT, &start);
+		sockstats_io(sock, SOCK_STATS_OUT, ret, 1);
 	} else {
 		return -1;
 	}
@@ -630,6 +2615,56 @@ extern int socketwrite(struct fwsocket *sock, const void *buf, int num) {
 	return (socketwrite_d(sock, buf, num, NULL));
 }
 
+/** @brief Send data with the TLSv1.3 client hello (0-RTT).
+  *
+  * Call on a TLS client socket before startsslclient() the handshake is
+  * started and the data sent with it if the session resumed (ssl_sessionreuse())
+  * allows early data (ssl_earlydata()). startsslclient() completes the
+  * handshake and sends the data again if the server refused it.
+  * @param sock Socket created with tcpconnect() not yet started.
+  * @param buf Data to send.
+  * @param num Length of data.
+  * @returns Bytes sent as early data 0 if it must be sent after startsslclient() or -1 on error.*/
+extern int socketwrite_early(struct fwsocket *sock, const void *buf, int num) {
+#ifdef HAVE_SSL_EARLYDATA
+	struct ssldata *ssl;
+	SSL_SESSION *sess;
+	size_t len = 0;
+	char *early;
+
+	if (!sock || !buf || (num <= 0) || !(ssl = sock->ssl) || (sock->type != SOCK_STREAM) || (ssl->flags & SSL_SERVER)) {
+		return (-1);
+	}
+
+	if (!ssl->ssl) {
+		ssl->flags |= SSL_EARLYDATA;
+		sslsockstart(sock, NULL, 0);
+		if (!(ssl = sock->ssl)) {
+			return (-1);
+		}
+	}
+
+	objlock(ssl);
+	if (!ssl->ssl || !(ssl->flags & SSL_EARLYDATA) || !(sess = SSL_get_session(ssl->ssl)) ||
+			(SSL_SESSION_get_max_early_data(sess) < (uint32_t)(ssl->earlylen + num)) ||
+			!(early = realloc(ssl->early, ssl->earlylen + num))) {
+		objunlock(ssl);
+		return (0);
+	}
+	ssl->early = early;
+	if (SSL_write_early_data(ssl->ssl, buf, num, &len) == 1) {
+		memcpy(ssl->early + ssl->earlylen, buf, len);
+		ssl->earlylen += len;
+	}
+	objunlock(ssl);
+	sockstats_io(sock, SOCK_STATS_OUT, len, 1);
+
+	return (len);
+#else
+	return (0);
+#endif
+}
+
 /** @}
   * @addtogroup LIB-Sock-SSL
   * @{*/
@@ -644,6 +2679,8 @@ extern void sslstartup(void) {
 	if ((cookie_secret = malloc(COOKIE_SECRET_LENGTH))) {
 		genrand(cookie_secret, COOKIE_SECRET_LENGTH);
 	}
+
+	ssl_ctxidx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 }
 
 static void dtlssetopts(struct ssldata *ssl, struct ssldata *orig, struct fwsocket *sock) {
@@ -663,7 +2700,7 @@ static void dtlssetopts(struct ssldata *ssl, struct ssldata *orig, struct fwsock
 
 	if (orig) {
 		objlock(orig);
-		if ((ssl->ssl = SSL_new(orig->ctx))) {
+		if ((ssl->ssl = ssl_newsess(orig))) {
 			objunlock(orig);
 			objref(orig);
 			ssl->parent = orig;
@@ -671,7 +2708,7 @@ static void dtlssetopts(struct ssldata *ssl, struct ssldata *orig, struct fwsock
 			objunlock(orig);
 		}
 	} else {
-		ssl->ssl = SSL_new(ssl->ctx);
+		ssl->ssl = ssl_newsess(ssl);
 	}
 	SSL_set_bio(ssl->ssl, ssl->bio, ssl->bio);
 	objunlock(ssl);
@@ -692,8 +2729,10 @@ extern void dtsl_serveropts(struct fwsocket *sock) {
 	dtlssetopts(ssl, NULL, sock);
 
 	objlock(ssl);
-	SSL_CTX_set_cookie_generate_cb(ssl->ctx, generate_cookie);
-	SSL_CTX_set_cookie_verify_cb(ssl->ctx, verify_cookie);
+	ssl_dtlscookies(ssl->ctx);
+	if (ssl->certs) {
+		ssl_dtlscookies(ssl->certs);
+	}
 	SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_OFF);
 
 	SSL_set_options(ssl->ssl, SSL_OP_COOKIE_EXCHANGE);
@@ -779,6 +2818,410 @@ extern struct fwsocket *dtls_listenssl(struct fwsocket *sock) {
 	return (newsock);
 }
 
+static void free_dtlsdemux(void *data) {
+	struct dtls_demux *demux = data;
+
+	if (demux->peers) {
+		objunref(demux->peers);
+	}
+	if (demux->listen) {
+		objunref(demux->listen);
+	}
+}
+
+static int32_t hash_dtlspeer(const void *data, int key) {
+	const struct fwsocket *sock = data;
+	const union sockstruct *addr = (key) ? data : &sock->addr;
+
+	return jenhash(addr, sizeof(*addr), 0);
+}
+
+/** @brief Receive all peers of a DTLS server on its socket.
+  *
+  * Instead of a socket and thread for each client (dtls_listenssl()) every
+  * datagram is read from the server socket and passed to the session of
+  * the peer it came from through a memory BIO, replies are sent from the
+  * server socket. Peers are passed to the connect and read callbacks
+  * of the server as sockets that can be read and written as normal.
+  * @note Call after udpbind() before socketserver().
+  * @param sock DTLS server socket.
+  * @param maxpeers Most peers allowed 0 for no limit.
+  * @returns 0 on failure.*/
+extern int dtls_demux(struct fwsocket *sock, int maxpeers) {
+	struct ssldata *ssl;
+	struct dtls_demux *demux;
+
+	if (!sock || !(ssl = sock->ssl) || (sock->type != SOCK_DGRAM) || !testflag(sock, SOCK_FLAG_BIND)) {
+		return (0);
+	}
+
+	if (!(demux = objalloc(sizeof(*demux), free_dtlsdemux))) {
+		return (0);
+	}
+	if (!(demux->peers = create_bucketlist(8, hash_dtlspeer))) {
+		objunref(demux);
+		return (0);
+	}
+	demux->maxpeers = maxpeers;
+
+	objlock(ssl);
+	if (ssl->demux) {
+		objunlock(ssl);
+		objunref(demux);
+		return (0);
+	}
+	ssl->demux = demux;
+	ssl->flags |= SSL_DEMUX;
+	objunlock(ssl);
+
+	return (1);
+}
+
+/*returns 1 if the socket is a demultiplexed DTLS server or one of its peers*/
+int dtls_demuxed(struct fwsocket *sock) {
+	return ((sock && sock->ssl && (sock->ssl->flags & SSL_DEMUX)) ? 1 : 0);
+}
+
+/*send the records written by a peer joining them into datagrams*/
+static void dtls_demux_flush(struct ssldata *ssl, int fd, union sockstruct *addr) {
+	BIO *wbio = SSL_get_wbio(ssl->ssl);
+	long len, pos = 0, start = 0, rlen;
+	unsigned char *data;
+
+	if ((len = BIO_get_mem_data(wbio, &data)) <= 0) {
+		return;
+	}
+
+	while((fd >= 0) && (pos < len)) {
+		rlen = DTLS_RECORD_HEADER;
+		if ((pos + DTLS_RECORD_HEADER) <= len) {
+			rlen += (data[pos + 11] << 8) | data[pos + 12];
+		}
+		if (rlen > (len - pos)) {
+			rlen = len - pos;
+		}
+		/*this record will not fit send what is held*/
+		if ((pos > start) && ((pos + rlen - start) > DTLS_DEMUX_MTU)) {
+			sendto(fd, data + start, pos - start, MSG_NOSIGNAL, &addr->sa, sizeof(*addr));
+			start = pos;
+		}
+		pos += rlen;
+	}
+	if ((fd >= 0) && (pos > start)) {
+		sendto(fd, data + start, pos - start, MSG_NOSIGNAL, &addr->sa, sizeof(*addr));
+	}
+	(void)BIO_reset(wbio);
+}
+
+/*new session with memory BIO's for the next client hello*/
+static struct ssldata *dtls_demux_ssl(struct ssldata *orig) {
+	struct ssldata *ssl;
+	BIO *rbio, *wbio;
+
+	if (!(ssl = objalloc(sizeof(*ssl), free_ssldata))) {
+		return (NULL);
+	}
+
+	objlock(orig);
+	ssl->ssl = ssl_newsess(orig);
+	objunlock(orig);
+	if (!ssl->ssl || !(rbio = BIO_new(BIO_s_mem()))) {
+		objunref(ssl);
+		return (NULL);
+	}
+	if (!(wbio = BIO_new(BIO_s_mem()))) {
+		BIO_free(rbio);
+		objunref(ssl);
+		return (NULL);
+	}
+	BIO_set_mem_eof_return(rbio, -1);
+	BIO_set_mem_eof_return(wbio, -1);
+	SSL_set_bio(ssl->ssl, rbio, wbio);
+	SSL_set_options(ssl->ssl, SSL_OP_NO_QUERY_MTU | SSL_OP_COOKIE_EXCHANGE);
+	SSL_set_mtu(ssl->ssl, DTLS_DEMUX_MTU);
+
+	ssl->flags = SSL_DTLSCON | SSL_SERVER | SSL_DEMUX;
+	objref(orig);
+	ssl->parent = orig;
+
+	return (ssl);
+}
+
+/** @brief Close a peer of a demultiplexed DTLS server.
+  *
+  * The peer is notified and removed from the server the socket
+  * is freed when the last reference is released.
+  * @param sock Server socket.
+  * @param peer Peer to close.*/
+void dtls_demux_close(struct fwsocket *sock, struct fwsocket *peer) {
+	struct ssldata *ssl = peer->ssl;
+	struct dtls_demux *demux = (sock->ssl) ? sock->ssl->demux : NULL;
+
+	setflag(peer, SOCK_FLAG_CLOSE);
+#ifndef __WIN32__
+	socktimer_stop(peer);
+#endif
+
+	if (ssl) {
+		objlock(ssl);
+		if (ssl->ssl) {
+			SSL_shutdown(ssl->ssl);
+			dtls_demux_flush(ssl, sock->sock, &peer->addr);
+			SSL_free(ssl->ssl);
+			ssl->ssl = NULL;
+		}
+		objunlock(ssl);
+	}
+
+	if (demux) {
+		remove_bucket_item(demux->peers, peer);
+	}
+}
+
+/*pass a datagram to a peer returns DTLS_DEMUX_NEW when the handshake completes
+ * or DTLS_DEMUX_DATA if there is data to read*/
+static int dtls_demux_input(struct fwsocket *sock, struct fwsocket *peer, const char *buf, int len) {
+	struct ssldata *ssl = peer->ssl;
+	int ret = DTLS_DEMUX_NONE, res;
+	char c;
+
+	if (!ssl) {
+		return (DTLS_DEMUX_NONE);
+	}
+
+	objlock(ssl);
+	if (!ssl->ssl) {
+		objunlock(ssl);
+		return (DTLS_DEMUX_NONE);
+	}
+
+	if (len > 0) {
+		BIO_write(SSL_get_rbio(ssl->ssl), buf, len);
+	}
+
+	if (ssl->flags & SSL_HANDSHAKE) {
+		if ((res = SSL_do_handshake(ssl->ssl)) == 1) {
+			ssl->flags &= ~SSL_HANDSHAKE;
+			/*records following the handshake*/
+			SSL_peek(ssl->ssl, &c, 1);
+			ret = DTLS_DEMUX_NEW;
+		} else if (SSL_get_error(ssl->ssl, res) != SSL_ERROR_WANT_READ) {
+			setflag(peer, SOCK_FLAG_CLOSE);
+		}
+	} else if ((res = SSL_peek(ssl->ssl, &c, 1)) > 0) {
+		ret = DTLS_DEMUX_DATA;
+	} else if ((SSL_get_shutdown(ssl->ssl) & SSL_RECEIVED_SHUTDOWN) ||
+			(SSL_get_error(ssl->ssl, res) != SSL_ERROR_WANT_READ)) {
+		setflag(peer, SOCK_FLAG_CLOSE);
+	}
+	dtls_demux_flush(ssl, sock->sock, &peer->addr);
+	objunlock(ssl);
+
+	if (testflag(peer, SOCK_FLAG_CLOSE)) {
+		dtls_demux_close(sock, peer);
+		ret = DTLS_DEMUX_NONE;
+	}
+
+	return (ret);
+}
+
+/*peers closed since the last timeout are still held by the server
+ * remove them returning the number left*/
+static int dtls_demux_reap(struct fwsocket *sock, struct dtls_demux *demux) {
+	struct bucket_loop *bloop;
+	struct fwsocket *peer;
+
+	bloop = init_bucket_loop(demux->peers);
+	while(bloop && (peer = next_bucket_loop(bloop))) {
+		if (testflag(peer, SOCK_FLAG_CLOSE)) {
+			dtls_demux_close(sock, peer);
+		}
+		objunref(peer);
+	}
+	if (bloop) {
+		objunref(bloop);
+	}
+
+	return (bucket_list_cnt(demux->peers));
+}
+
+/*a datagram from a unknown address only a client hello with a valid cookie creates a peer*/
+static int dtls_demux_listen(struct fwsocket *sock, struct dtls_demux *demux, union sockstruct *addr,
+							 const char *buf, int len, struct fwsocket **peerp) {
+	union sockstruct client;
+	struct fwsocket *peer;
+	struct ssldata *ssl;
+	int ret;
+
+	if (demux->maxpeers && (bucket_list_cnt(demux->peers) >= demux->maxpeers) &&
+			(dtls_demux_reap(sock, demux) >= demux->maxpeers)) {
+		return (DTLS_DEMUX_NONE);
+	}
+
+	if (!demux->listen && !(demux->listen = dtls_demux_ssl(sock->ssl))) {
+		return (DTLS_DEMUX_NONE);
+	}
+	ssl = demux->listen;
+
+	objlock(ssl);
+	SSL_set_app_data(ssl->ssl, addr);
+	BIO_write(SSL_get_rbio(ssl->ssl), buf, len);
+	memset(&client, 0, sizeof(client));
+	ret = DTLSv1_listen(ssl->ssl, (void *)&client);
+	dtls_demux_flush(ssl, sock->sock, addr);
+	SSL_set_app_data(ssl->ssl, NULL);
+	if (ret <= 0) {
+		(void)BIO_reset(SSL_get_rbio(ssl->ssl));
+		objunlock(ssl);
+		return (DTLS_DEMUX_NONE);
+	}
+	ssl->flags |= SSL_HANDSHAKE;
+	objunlock(ssl);
+
+	/*the session now belongs to the peer*/
+	demux->listen = NULL;
+	if (!(peer = socket_peer(sock, addr))) {
+		objunref(ssl);
+		return (DTLS_DEMUX_NONE);
+	}
+	peer->ssl = ssl;
+	setflag(peer, SOCK_FLAG_SSL);
+	objlock(ssl);
+	SSL_set_app_data(ssl->ssl, &peer->addr);
+	objunlock(ssl);
+	addtobucket(demux->peers, peer);
+
+	if ((ret = dtls_demux_input(sock, peer, NULL, 0)) == DTLS_DEMUX_NONE) {
+		objunref(peer);
+	} else {
+		*peerp = peer;
+	}
+	return (ret);
+}
+
+/** @brief Read a datagram on a demultiplexed DTLS server.
+  * @warning Do not call this directly.
+  * @param sock Server socket.
+  * @param peerp Set to a reference of the peer if there is work for the caller.
+  * @returns DTLS_DEMUX_NEW if the peer completed its handshake DTLS_DEMUX_DATA
+  * if the peer has data to read else DTLS_DEMUX_NONE.*/
+int dtls_demux_read(struct fwsocket *sock, struct fwsocket **peerp) {
+	struct ssldata *ssl = sock->ssl;
+	struct dtls_demux *demux;
+	struct fwsocket *peer;
+	union sockstruct addr;
+	socklen_t salen = sizeof(addr);
+	char buf[DTLS_DEMUX_DGRAM];
+	int len, ret;
+
+	*peerp = NULL;
+	if (!ssl || !(demux = ssl->demux)) {
+		return (DTLS_DEMUX_NONE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	if ((len = recvfrom(sock->sock, buf, sizeof(buf), 0, &addr.sa, &salen)) <= 0) {
+		return (DTLS_DEMUX_NONE);
+	}
+	sockstats_io(sock, SOCK_STATS_IN, len, 1);
+
+	if (!(peer = bucket_list_find_key(demux->peers, &addr))) {
+		return (dtls_demux_listen(sock, demux, &addr, buf, len, peerp));
+	}
+
+	/*hash collision or closed by the application*/
+	if (memcmp(&peer->addr, &addr, sizeof(addr)) || testflag(peer, SOCK_FLAG_CLOSE)) {
+		if (!memcmp(&peer->addr, &addr, sizeof(addr))) {
+			dtls_demux_close(sock, peer);
+		}
+		objunref(peer);
+		return (DTLS_DEMUX_NONE);
+	}
+
+	if ((ret = dtls_demux_input(sock, peer, buf, len)) == DTLS_DEMUX_NONE) {
+		objunref(peer);
+	} else {
+		*peerp = peer;
+	}
+	return (ret);
+}
+
+/** @brief Check a peer for more records after its read callback.
+  * @warning Do not call this directly.
+  * @param sock Server socket.
+  * @param peer Peer socket.
+  * @returns DTLS_DEMUX_DATA if there is data to read.*/
+int dtls_demux_next(struct fwsocket *sock, struct fwsocket *peer) {
+	return (dtls_demux_input(sock, peer, NULL, 0));
+}
+
+/*retransmit handshakes and remove closed peers*/
+static void dtls_demux_timeout(struct fwsocket *sock, struct dtls_demux *demux) {
+	struct bucket_loop *bloop;
+	struct fwsocket *peer;
+	struct ssldata *ssl;
+	int ret;
+
+	bloop = init_bucket_loop(demux->peers);
+	while(bloop && (peer = next_bucket_loop(bloop))) {
+		ret = 0;
+		if ((ssl = peer->ssl) && !testflag(peer, SOCK_FLAG_CLOSE)) {
+			objlock(ssl);
+			if (ssl->ssl && ((ret = DTLSv1_handle_timeout(ssl->ssl)) > 0)) {
+				dtls_demux_flush(ssl, sock->sock, &peer->addr);
+			}
+			objunlock(ssl);
+		}
+		/*closed or the handshake gave up*/
+		if (!ssl || (ret < 0) || testflag(peer, SOCK_FLAG_CLOSE)) {
+			dtls_demux_close(sock, peer);
+		}
+		objunref(peer);
+	}
+	if (bloop) {
+		objunref(bloop);
+	}
+}
+
+/*the server is closing notify and release all peers*/
+static void dtls_demux_stop(struct ssldata *ssl, int fd) {
+	struct dtls_demux *demux;
+	struct bucket_loop *bloop;
+	struct fwsocket *peer;
+	struct ssldata *pssl;
+
+	objlock(ssl);
+	demux = (ssl->demux && objref(ssl->demux)) ? ssl->demux : NULL;
+	objunlock(ssl);
+	if (!demux) {
+		return;
+	}
+
+	bloop = init_bucket_loop(demux->peers);
+	while(bloop && (peer = next_bucket_loop(bloop))) {
+		setflag(peer, SOCK_FLAG_CLOSE);
+#ifndef __WIN32__
+		socktimer_stop(peer);
+#endif
+		if ((pssl = peer->ssl)) {
+			objlock(pssl);
+			if (pssl->ssl) {
+				SSL_shutdown(pssl->ssl);
+				dtls_demux_flush(pssl, fd, &peer->addr);
+				SSL_free(pssl->ssl);
+				pssl->ssl = NULL;
+			}
+			objunlock(pssl);
+		}
+		remove_bucket_loop(bloop);
+		objunref(peer);
+	}
+	if (bloop) {
+		objunref(bloop);
+	}
+	objunref(demux);
+}
+
 static void dtlsconnect(struct fwsocket *sock) {
 	struct ssldata *ssl = sock->ssl;
 
@@ -804,12 +3247,38 @@ static void dtlsconnect(struct fwsocket *sock) {
 	objunlock(ssl);
 }
 
+#ifdef HAVE_SSL_EARLYDATA
+/*complete the handshake of a client that sent early data resending it if the server refused it*/
+static void sslclient_earlyfinish(struct ssldata *ssl) {
+	objlock(ssl);
+	ssl->flags &= ~SSL_EARLYDATA;
+	if (ssl->ssl && (SSL_connect(ssl->ssl) == 1) && ssl->early &&
+			(SSL_get_early_data_status(ssl->ssl) != SSL_EARLY_DATA_ACCEPTED)) {
+		SSL_write(ssl->ssl, ssl->early, ssl->earlylen);
+	}
+	if (ssl->early) {
+		free(ssl->early);
+		ssl->early = NULL;
+		ssl->earlylen = 0;
+	}
+	objunlock(ssl);
+}
+#endif
+
 /** @brief Start SSL on a client socket
   * @warning This should not be called directly
   * @see clientsocket()
   * @param sock Reference to client socket.*/
 extern void startsslclient(struct fwsocket *sock) {
-	if (!sock || !sock->ssl || (sock->ssl->flags & SSL_SERVER)) {
+#ifdef HAVE_SSL_EARLYDATA
+	if (sock && sock->ssl && (sock->ssl->flags & SSL_EARLYDATA) && (sock->ssl->flags & SSL_CLIENT)) {
+		sslclient_earlyfinish(sock->ssl);
+		return;
+	}
+#endif
+
+	/*sessions started with tlsconnect() are already running*/
+	if (!sock || !sock->ssl || sock->ssl->ssl || (sock->ssl->flags & SSL_SERVER)) {
 		return;
 	}
 
@@ -851,6 +3320,10 @@ extern void dtlshandltimeout(struct fwsocket *sock) {
 	objlock(sock->ssl);
 	DTLSv1_handle_timeout(sock->ssl->ssl);
 	objunlock(sock->ssl);
+
+	if (sock->ssl->demux) {
+		dtls_demux_timeout(sock, sock->ssl->demux);
+	}
 }
 
 /** @}*/
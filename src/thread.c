@@ -24,10 +24,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
   * The thread interface consists of a management thread managing
   * a hashed bucket list of threads running optional clean up when done.*/
 
+#ifndef __WIN32
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#ifndef __WIN32
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 #include "include/dtsapp.h"
 
@@ -51,9 +67,20 @@ enum threadopt {
 	TL_THREAD_CAN_CANCEL	= 1 << 16,
 	/** @brief Flag to enable pthread_cancel calls*/
 	TL_THREAD_JOINABLE	= 1 << 17,
-	TL_THREAD_RETURN	= 1 << 18
+	/** @brief Return a reference to the thread*/
+	TL_THREAD_RETURN	= 1 << 18,
+	/** @brief Bind the thread to a NUMA node*/
+	TL_THREAD_NUMA		= 1 << 19,
+	/** @brief Set the scheduling policy and priority*/
+	TL_THREAD_SCHED		= 1 << 20
 };
 
+/** @brief Maximum length of a thread name including the terminating NULL (Linux limit).*/
+#define THREAD_NAME_LEN		16
+
+/** @brief Maximum length of a thread label including the terminating NULL.*/
+#define THREAD_LABEL_LEN	32
+
 /** @brief thread struct used to create threads data needs to be first element*/
 struct thread_pvt {
 	/** @brief Reference to data held on thread creation*/
@@ -72,6 +99,28 @@ struct thread_pvt {
 	/** @brief thread options
 	  * @see threadopt_flags*/
 	enum                    threadopt flags;
+	/** @brief Thread name set with pthread_setname_np*/
+	char			name[THREAD_NAME_LEN];
+#ifndef __WIN32
+	/** @brief CPU affinity applied when the thread starts*/
+	cpu_set_t		cpus;
+	/** @brief Set if cpus is to be applied*/
+	int			affinity;
+#endif
+	/** @brief NUMA node the thread and its allocations are bound to*/
+	int			numa_node;
+	/** @brief Scheduling policy*/
+	int			policy;
+	/** @brief Scheduling priority*/
+	int			priority;
+	/** @brief Time the thread was created*/
+	struct timeval		created;
+	/** @brief Number of times the thread checked its status (framework_threadok())*/
+	uint64_t		wakeups;
+	/** @brief Number of callbacks dispatched by the thread*/
+	uint64_t		callbacks;
+	/** @brief User supplied label*/
+	char			label[THREAD_LABEL_LEN];
 };
 
 /** @brief Global threads data*/
@@ -91,6 +140,9 @@ struct threadcontainer *threads = NULL;
   * once threads have stoped this will be set to zero manually starting startthreads will be possible.*/
 int thread_can_start = 1;
 
+/*the calling thread set while threadwrap() holds its reference*/
+static __thread struct thread_pvt *thread_self = NULL;
+
 static int32_t hash_thread(const void *data, int key) {
 	const struct thread_pvt *thread = data;
 	const pthread_t *th = (key) ? data : &thread->thr;
@@ -144,6 +196,11 @@ extern int framework_threadok() {
 	struct thread_pvt *thr;
 	int ret;
 
+	if ((thr = thread_self)) {
+		__atomic_fetch_add(&thr->wakeups, 1, __ATOMIC_RELAXED);
+		return testflag(thr, TL_THREAD_RUN);
+	}
+
 	thr = get_thread_from_id();
 	ret =(thr) ? testflag(thr, TL_THREAD_RUN) : 0;
 	objunref(thr);
@@ -151,6 +208,90 @@ extern int framework_threadok() {
 	return ret;
 }
 
+/** @brief Count a callback dispatched by the current thread.
+  * @warning This is used internaly by socket threads.*/
+extern void thread_countcb(void) {
+	struct thread_pvt *thr;
+
+	if ((thr = thread_self)) {
+		__atomic_fetch_add(&thr->callbacks, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/** @brief Set a label for the current thread reported by thread_stats_dump()
+  * @param label Label to set (truncated to 31 characters).*/
+extern void thread_setlabel(const char *label) {
+	struct thread_pvt *thr;
+
+	if (!(thr = get_thread_from_id())) {
+		return;
+	}
+	objlock(thr);
+	if (label) {
+		strncpy(thr->label, label, THREAD_LABEL_LEN - 1);
+	} else {
+		thr->label[0] = '\0';
+	}
+	objunlock(thr);
+	objunref(thr);
+}
+
+/** @brief Data passed to the stats callback while iterating*/
+struct thread_statsiter {
+	/** @brief Callback to call*/
+	thread_statscb cb;
+	/** @brief Reference to user data*/
+	void *data;
+};
+
+static void thread_stats_cb(void *data, void *data2) {
+	struct thread_pvt *thread = data;
+	struct thread_statsiter *iter = data2;
+	struct thread_stats stats;
+#ifndef __WIN32
+	struct timespec ts;
+	clockid_t cid;
+#endif
+
+	memset(&stats, 0, sizeof(stats));
+	objlock(thread);
+	snprintf(stats.name, sizeof(stats.name), "%s", thread->name);
+	snprintf(stats.label, sizeof(stats.label), "%s", thread->label);
+	stats.created = thread->created;
+	stats.wakeups = __atomic_load_n(&thread->wakeups, __ATOMIC_RELAXED);
+	stats.callbacks = __atomic_load_n(&thread->callbacks, __ATOMIC_RELAXED);
+	stats.running = (thread->flags & TL_THREAD_RUN) ? 1 : 0;
+	objunlock(thread);
+
+#ifndef __WIN32
+	if (stats.running && !pthread_getcpuclockid(thread->thr, &cid) && !clock_gettime(cid, &ts)) {
+		stats.cputime = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+	}
+#endif
+
+	iter->cb(&stats, iter->data);
+}
+
+/** @brief Call a callback with the runtime statistics of each thread.
+  *
+  * This allows finding busy or stuck threads at runtime.
+  * @see thread_stats
+  * @param cb Callback called for each thread.
+  * @param data Reference to data passed to the callback.*/
+extern void thread_stats_dump(thread_statscb cb, void *data) {
+	struct thread_statsiter iter;
+	struct threadcontainer *tc;
+
+	if (!cb || !(tc = (objref(threads)) ? threads : NULL)) {
+		return;
+	}
+
+	iter.cb = cb;
+	iter.data = data;
+	bucketlist_callback(tc->list, thread_stats_cb, &iter);
+	objunref(tc);
+}
+
 /*
  * close all threads when we get SIGHUP
  */
@@ -328,6 +469,8 @@ extern void stopthreads(int join) {
 static void thread_cleanup(void *data) {
 	struct thread_pvt *thread = data;
 
+	thread_self = NULL;
+
 	/*remove from thread list manager unrefs threads in cleanup run 1st*/
 	remove_bucket_item(threads->list, thread);
 
@@ -342,6 +485,81 @@ static void thread_cleanup(void *data) {
 	objunref(thread);
 }
 
+#ifndef __WIN32
+/* parse a cpu list as used by taskset -c and sysfs ie "0-3,8,10-11"*/
+static int parse_cpulist(const char *list, cpu_set_t *cpus) {
+	const char *ptr = list;
+	char *end;
+	long first, last;
+	int cnt = 0;
+
+	CPU_ZERO(cpus);
+	while (ptr && *ptr && (*ptr != '\n')) {
+		first = strtol(ptr, &end, 10);
+		if ((end == ptr) || (first < 0)) {
+			break;
+		}
+		last = first;
+		if (*end == '-') {
+			ptr = end + 1;
+			last = strtol(ptr, &end, 10);
+			if ((end == ptr) || (last < first)) {
+				break;
+			}
+		}
+		for(; (first <= last) && (first < CPU_SETSIZE); first++) {
+			CPU_SET(first, cpus);
+			cnt++;
+		}
+		ptr = (*end == ',') ? end + 1 : NULL;
+	}
+	return cnt;
+}
+
+/* the cpu's local to a NUMA node*/
+static int numa_node_cpus(int node, cpu_set_t *cpus) {
+	char path[64], buf[1024];
+	FILE *nfile;
+	int cnt = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", node);
+	if (!(nfile = fopen(path, "r"))) {
+		return 0;
+	}
+	if (fgets(buf, sizeof(buf), nfile)) {
+		cnt = parse_cpulist(buf, cpus);
+	}
+	fclose(nfile);
+	return cnt;
+}
+
+/* the thread attributes are set from within the thread mempolicy only applies to the caller*/
+static void thread_setattr(struct thread_pvt *thread) {
+	struct sched_param param;
+	unsigned long nodemask;
+
+	if (thread->name[0]) {
+		pthread_setname_np(pthread_self(), thread->name);
+	}
+
+	if (thread->affinity) {
+		pthread_setaffinity_np(pthread_self(), sizeof(thread->cpus), &thread->cpus);
+	}
+
+	if ((thread->flags & TL_THREAD_NUMA) && (thread->numa_node >= 0) &&
+	    (thread->numa_node < (int)(sizeof(nodemask) * 8))) {
+		nodemask = 1UL << thread->numa_node;
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8);
+	}
+
+	if (thread->flags & TL_THREAD_SCHED) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = thread->priority;
+		pthread_setschedparam(pthread_self(), thread->policy, &param);
+	}
+}
+#endif
+
 static void *threadwrap(void *data) {
 	struct thread_pvt *thread = data;
 	void *ret = NULL;
@@ -357,6 +575,10 @@ static void *threadwrap(void *data) {
 		return NULL;
 	}
 
+#ifndef __WIN32
+	thread_setattr(thread);
+#endif
+
 	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 	if (!testflag(thread, TL_THREAD_CAN_CANCEL)) {
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
@@ -366,6 +588,7 @@ static void *threadwrap(void *data) {
 		pthread_detach(thread->thr);
 	}
 
+	thread_self = thread;
 	pthread_cleanup_push(thread_cleanup, thread);
 	ret = thread->func(thread->data);
 	pthread_cleanup_pop(1);
@@ -385,6 +608,27 @@ static void *threadwrap(void *data) {
   * @param flags Options of @ref thread_option_flags passed
   * @returns a thread structure that must be un referencend OR NULL depending on flags.*/
 extern struct thread_pvt *framework_mkthread(threadfunc func, threadcleanup cleanup, threadsighandler sig_handler, void *data, int flags) {
+	return (framework_mkthread_attr(func, cleanup, sig_handler, data, flags, NULL));
+}
+
+/** @brief create a thread with extended attributes result must be unreferenced
+  *
+  * This is the same as framework_mkthread() the thread name, CPU affinity,
+  * NUMA node and scheduling policy in attr are applied by the thread before
+  * func is called.
+  * @note The NUMA node is only applied with @ref THREAD_OPTION_NUMA the scheduling
+  * policy and priority with @ref THREAD_OPTION_SCHED.
+  * @note Attributes are ignored on Win32.
+  * @see thread_attr
+  * @param func Function to run thread on.
+  * @param cleanup Cleanup function to run.
+  * @param sig_handler Thread signal handler.
+  * @param data Data to pass to callbacks.
+  * @param flags Options of @ref thread_option_flags passed
+  * @param attr Thread attributes may be NULL.
+  * @returns a thread structure that must be un referencend OR NULL depending on flags.*/
+extern struct thread_pvt *framework_mkthread_attr(threadfunc func, threadcleanup cleanup, threadsighandler sig_handler, void *data, int flags,
+						  const struct thread_attr *attr) {
 	struct thread_pvt *thread;
 	struct threadcontainer *tc = NULL;
 
@@ -419,6 +663,27 @@ extern struct thread_pvt *framework_mkthread(threadfunc func, threadcleanup clea
 	thread->cleanup = cleanup;
 	thread->sighandler = sig_handler;
 	thread->func = func;
+	thread->numa_node = -1;
+	gettimeofday(&thread->created, NULL);
+	if (attr) {
+		if (attr->name) {
+			strncpy(thread->name, attr->name, THREAD_NAME_LEN - 1);
+		}
+#ifndef __WIN32
+		if (attr->cpulist && parse_cpulist(attr->cpulist, &thread->cpus)) {
+			thread->affinity = 1;
+		}
+		if (flags & THREAD_OPTION_NUMA) {
+			thread->numa_node = attr->numa_node;
+			/*keep the thread on the node unless told otherwise*/
+			if (!thread->affinity && numa_node_cpus(attr->numa_node, &thread->cpus)) {
+				thread->affinity = 1;
+			}
+		}
+#endif
+		thread->policy = attr->policy;
+		thread->priority = attr->priority;
+	}
 	objunlock(tc);
 
 	/* start thread and check it*/
@@ -443,6 +708,88 @@ extern struct thread_pvt *framework_mkthread(threadfunc func, threadcleanup clea
 	}
 }
 
+/** @brief Return the number of CPU's this process may run on.
+  * @returns Number of available CPU's (at least 1).*/
+extern int framework_cpucount(void) {
+	int cnt = 0;
+#ifndef __WIN32
+	cpu_set_t cpus;
+
+	if (!sched_getaffinity(0, sizeof(cpus), &cpus)) {
+		cnt = CPU_COUNT(&cpus);
+	}
+	if (cnt <= 0) {
+		cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+#endif
+	return (cnt > 0) ? cnt : 1;
+}
+
+/** @brief Start count threads spread across the available CPU's.
+  *
+  * Each thread is pinned to one CPU from the process affinity mask
+  * in turn wrapping when there are more threads than CPU's.
+  * The threads are named name/N where N is the thread number.
+  * @note @ref THREAD_OPTION_RETURN is ignored.
+  * @param count Number of threads to start.
+  * @param func Function to run thread on.
+  * @param cleanup Cleanup function to run.
+  * @param sig_handler Thread signal handler.
+  * @param data Data to pass to callbacks.
+  * @param flags Options of @ref thread_option_flags passed
+  * @param name Base name of the threads may be NULL.
+  * @returns Number of threads started.*/
+extern int framework_mkthread_spread(int count, threadfunc func, threadcleanup cleanup, threadsighandler sig_handler, void *data, int flags,
+				     const char *name) {
+	struct thread_pvt *thread;
+	struct thread_attr attr;
+	char tname[THREAD_NAME_LEN];
+	int cnt, started = 0;
+#ifndef __WIN32
+	char cpulist[16];
+	int cpu, ncpu = 0;
+	int *cpuid = NULL;
+	cpu_set_t cpus;
+
+	if (!sched_getaffinity(0, sizeof(cpus), &cpus) && (ncpu = CPU_COUNT(&cpus)) &&
+	    (cpuid = malloc(sizeof(*cpuid) * ncpu))) {
+		for(cpu = 0, cnt = 0; (cpu < CPU_SETSIZE) && (cnt < ncpu); cpu++) {
+			if (CPU_ISSET(cpu, &cpus)) {
+				cpuid[cnt++] = cpu;
+			}
+		}
+	}
+#endif
+
+	/*i need the reference to know the thread started*/
+	flags &= ~THREAD_OPTION_NUMA;
+	flags |= THREAD_OPTION_RETURN;
+
+	memset(&attr, 0, sizeof(attr));
+	for(cnt = 0; cnt < count; cnt++) {
+		if (name) {
+			snprintf(tname, sizeof(tname), "%s/%i", name, cnt);
+			attr.name = tname;
+		}
+#ifndef __WIN32
+		if (cpuid) {
+			snprintf(cpulist, sizeof(cpulist), "%i", cpuid[cnt % ncpu]);
+			attr.cpulist = cpulist;
+		}
+#endif
+		if ((thread = framework_mkthread_attr(func, cleanup, sig_handler, data, flags, &attr))) {
+			objunref(thread);
+			started++;
+		}
+	}
+#ifndef __WIN32
+	if (cpuid) {
+		free(cpuid);
+	}
+#endif
+	return started;
+}
+
 /** @brief Join the manager thread.
   *
   * This will be done when you have issued stopthreads and are waiting or have completed the program and want to let the threads continue.
@@ -518,4 +865,437 @@ extern int thread_signal(int sig) {
 	return ret;
 }
 
+/** @brief A continuation run when a future completes.*/
+struct future_then {
+	/** @brief Callback run with the result.*/
+	futurefunc func;
+	/** @brief Reference to data passed to func.*/
+	void *data;
+	/** @brief Future completed with the result of func.*/
+	struct future *next;
+	/** @brief Next continuation.*/
+	struct future_then *nxt;
+};
+
+/** @brief Future holding the result of a asynchronous operation.*/
+struct future {
+	/** @brief Reference to the result.*/
+	void *result;
+	/** @brief Set when the result is available.*/
+	int done;
+	/** @brief Lock used with the condition.*/
+	pthread_mutex_t lock;
+	/** @brief Condition signaled on completion.*/
+	pthread_cond_t cond;
+	/** @brief Continuations to run on completion.*/
+	struct future_then *then;
+};
+
+/** @brief Shared state of future_all() and future_any()*/
+struct future_join {
+	/** @brief Future completed when the join is satisfied.*/
+	struct future *future;
+	/** @brief Array of result references (future_all()).*/
+	void **results;
+	/** @brief Number of futures joined.*/
+	int cnt;
+	/** @brief Number of futures outstanding.*/
+	int left;
+	/** @brief Only the first result is wanted.*/
+	int any;
+};
+
+/** @brief Entry in a future_join passing the position in the array.*/
+struct future_slot {
+	/** @brief Reference to the join.*/
+	struct future_join *join;
+	/** @brief Index of the future.*/
+	int idx;
+};
+
+static void free_future(void *data) {
+	struct future *future = data;
+	struct future_then *then, *nxt;
+
+	for(then = future->then; then; then = nxt) {
+		nxt = then->nxt;
+		objunref(then->data);
+		objunref(then->next);
+		free(then);
+	}
+
+	if (future->result) {
+		objunref(future->result);
+	}
+	pthread_cond_destroy(&future->cond);
+	pthread_mutex_destroy(&future->lock);
+}
+
+/** @brief Create a future (promise) to be completed with future_set()
+  * @returns Reference to a new future.*/
+extern struct future *future_new(void) {
+	struct future *future;
+
+	if (!(future = objalloc(sizeof(*future), free_future))) {
+		return NULL;
+	}
+	pthread_mutex_init(&future->lock, NULL);
+	pthread_cond_init(&future->cond, NULL);
+	return future;
+}
+
+static void future_complete(struct future *future, void *result) {
+	struct future_then *then, *nxt;
+	void *res;
+
+	pthread_mutex_lock(&future->lock);
+	if (future->done) {
+		pthread_mutex_unlock(&future->lock);
+		objunref(result);
+		return;
+	}
+	future->result = result;
+	future->done = 1;
+	then = future->then;
+	future->then = NULL;
+	pthread_cond_broadcast(&future->cond);
+	pthread_mutex_unlock(&future->lock);
+
+	/*continuations run in the completing thread outside the lock*/
+	for(; then; then = nxt) {
+		nxt = then->nxt;
+		res = then->func(result, then->data);
+		future_complete(then->next, res);
+		objunref(then->next);
+		objunref(then->data);
+		free(then);
+	}
+}
+
+/** @brief Complete a future with a result.
+  *
+  * Waiters are woken and continuations added with future_then() are run
+  * in the calling thread. Only the first call has any effect.
+  * @param future Future to complete.
+  * @param result Result a reference is held by the future may be NULL.*/
+extern void future_set(struct future *future, void *result) {
+	if (!future) {
+		return;
+	}
+	future_complete(future, (objref(result)) ? result : NULL);
+}
+
+/** @brief Check if the future is complete.
+  * @param future Future to check.
+  * @returns Non zero if the result is available.*/
+extern int future_done(struct future *future) {
+	int ret;
+
+	if (!future) {
+		return 0;
+	}
+	pthread_mutex_lock(&future->lock);
+	ret = future->done;
+	pthread_mutex_unlock(&future->lock);
+	return ret;
+}
+
+/** @brief Wait for a future to complete.
+  * @param future Future to wait on.
+  * @returns New reference to the result that must be unreferenced.*/
+extern void *future_wait(struct future *future) {
+	void *ret;
+
+	if (!future) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&future->lock);
+	while (!future->done) {
+		pthread_cond_wait(&future->cond, &future->lock);
+	}
+	ret = (objref(future->result)) ? future->result : NULL;
+	pthread_mutex_unlock(&future->lock);
+	return ret;
+}
+
+/** @brief Wait for a future to complete for a limited time.
+  * @note Use future_done() to distinguish a timeout from a NULL result.
+  * @param future Future to wait on.
+  * @param msec Time to wait in milliseconds.
+  * @returns New reference to the result or NULL on timeout.*/
+extern void *future_wait_timeout(struct future *future, int msec) {
+	struct timespec ts;
+	struct timeval tv;
+	void *ret = NULL;
+
+	if (!future) {
+		return NULL;
+	}
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + (msec / 1000);
+	ts.tv_nsec = (tv.tv_usec * 1000) + ((msec % 1000) * 1000000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&future->lock);
+	while (!future->done) {
+		if (pthread_cond_timedwait(&future->cond, &future->lock, &ts)) {
+			break;
+		}
+	}
+	if (future->done) {
+		ret = (objref(future->result)) ? future->result : NULL;
+	}
+	pthread_mutex_unlock(&future->lock);
+	return ret;
+}
+
+/** @brief Chain a callback to run on completion of a future.
+  *
+  * The callback is run in the thread completing the future or immediately
+  * if it is already complete.
+  * @see futurefunc
+  * @param future Future to chain too.
+  * @param func Callback returning the result of the new future.
+  * @param data Reference to data passed to the callback.
+  * @returns Reference to a future completed with the return of func.*/
+extern struct future *future_then(struct future *future, futurefunc func, void *data) {
+	struct future_then *then;
+	struct future *next;
+	void *res;
+
+	if (!future || !func || !(next = future_new())) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&future->lock);
+	if (future->done) {
+		pthread_mutex_unlock(&future->lock);
+		res = func(future->result, data);
+		future_complete(next, res);
+		return next;
+	}
+
+	if (!(then = malloc(sizeof(*then)))) {
+		pthread_mutex_unlock(&future->lock);
+		objunref(next);
+		return NULL;
+	}
+	then->func = func;
+	then->data = (objref(data)) ? data : NULL;
+	then->next = (objref(next)) ? next : NULL;
+	then->nxt = future->then;
+	future->then = then;
+	pthread_mutex_unlock(&future->lock);
+
+	return next;
+}
+
+static void free_future_join(void *data) {
+	struct future_join *join = data;
+	int cnt;
+
+	if (join->results) {
+		for(cnt = 0; cnt < join->cnt; cnt++) {
+			if (join->results[cnt]) {
+				objunref(join->results[cnt]);
+			}
+		}
+	}
+	objunref(join->future);
+}
+
+static void free_future_slot(void *data) {
+	struct future_slot *slot = data;
+
+	objunref(slot->join);
+}
+
+static void free_future_results(void *data) {
+	struct future_results *res = data;
+	int cnt;
+
+	for(cnt = 0; cnt < res->cnt; cnt++) {
+		if (res->results[cnt]) {
+			objunref(res->results[cnt]);
+		}
+	}
+}
+
+static void *future_join_cb(void *result, void *data) {
+	struct future_slot *slot = data;
+	struct future_join *join = slot->join;
+	struct future_results *res = NULL;
+	int left;
+
+	objlock(join);
+	if (join->any) {
+		left = join->left;
+		join->left = 0;
+		objunlock(join);
+		if (left) {
+			future_set(join->future, result);
+		}
+		return NULL;
+	}
+
+	join->results[slot->idx] = (objref(result)) ? result : NULL;
+	left = --join->left;
+	if (!left && (res = objalloc(sizeof(*res) + sizeof(void *) * join->cnt, free_future_results))) {
+		res->cnt = join->cnt;
+		res->results = (void *)((char *)res + sizeof(*res));
+		memcpy(res->results, join->results, sizeof(void *) * join->cnt);
+		memset(join->results, 0, sizeof(void *) * join->cnt);
+	}
+	objunlock(join);
+
+	if (!left) {
+		future_complete(join->future, res);
+	}
+	return NULL;
+}
+
+static struct future *future_join(struct future **futures, int cnt, int any) {
+	struct future_join *join;
+	struct future_slot *slot, failed;
+	struct future *ret, *then;
+	int idx, waiting = 0;
+
+	if (!futures || (cnt <= 0) || !(ret = future_new())) {
+		return NULL;
+	}
+
+	if (!(join = objalloc(sizeof(*join) + ((any) ? 0 : sizeof(void *) * cnt), free_future_join))) {
+		objunref(ret);
+		return NULL;
+	}
+	join->future = (objref(ret)) ? ret : NULL;
+	join->results = (any) ? NULL : (void **)((char *)join + sizeof(*join));
+	join->cnt = cnt;
+	join->left = (any) ? 1 : cnt;
+	join->any = any;
+
+	for(idx = 0; idx < cnt; idx++) {
+		then = NULL;
+		if ((slot = objalloc(sizeof(*slot), free_future_slot))) {
+			slot->join = (objref(join)) ? join : NULL;
+			slot->idx = idx;
+			then = future_then(futures[idx], future_join_cb, slot);
+			objunref(slot);
+		}
+		if (then) {
+			objunref(then);
+			waiting++;
+			continue;
+		}
+
+		/*a future that can not be waited on completes with no result
+		 * future_any() only completes like this if none can be waited on*/
+		failed.join = join;
+		failed.idx = idx;
+		if (!any || (!waiting && (idx == cnt - 1))) {
+			future_join_cb(NULL, &failed);
+		}
+	}
+	objunref(join);
+
+	return ret;
+}
+
+/** @brief Return a future that completes when all futures complete.
+  *
+  * The result is a @ref future_results holding the results in the
+  * same order as futures, futures that can not be waited on have no result.
+  * @param futures Array of futures.
+  * @param cnt Number of futures in the array.
+  * @returns Reference to a future.*/
+extern struct future *future_all(struct future **futures, int cnt) {
+	return future_join(futures, cnt, 0);
+}
+
+/** @brief Return a future that completes when any of the futures complete.
+  *
+  * The result is the result of the first future to complete or NULL
+  * if none of them can be waited on.
+  * @param futures Array of futures.
+  * @param cnt Number of futures in the array.
+  * @returns Reference to a future.*/
+extern struct future *future_any(struct future **futures, int cnt) {
+	return future_join(futures, cnt, 1);
+}
+
+/** @brief Thread data for future_run()*/
+struct future_task {
+	/** @brief Function to run.*/
+	threadfunc func;
+	/** @brief Reference to data passed to func.*/
+	void *data;
+	/** @brief Future completed with the result.*/
+	struct future *future;
+};
+
+static void free_future_task(void *data) {
+	struct future_task *task = data;
+
+	if (task->data) {
+		objunref(task->data);
+	}
+	if (task->future) {
+		objunref(task->future);
+	}
+}
+
+static void *future_task_thread(void *data) {
+	struct future_task *task = data;
+
+	future_complete(task->future, task->func(task->data));
+	return NULL;
+}
+
+/* make sure waiters are released if the thread was stopped*/
+static void future_task_clean(void *data) {
+	struct future_task *task = data;
+
+	future_complete(task->future, NULL);
+}
+
+/** @brief Run a function in a framework thread returning a future for its result.
+  *
+  * This allows many blocking requests (LDAP/RADIUS) to be started and
+  * then joined with future_all() or future_wait().
+  * @note The return value of func must be a reference it is passed to the future.
+  * @param func Function to run.
+  * @param data Reference to data passed to func.
+  * @returns Reference to a future completed with the return of func.*/
+extern struct future *future_run(threadfunc func, void *data) {
+	struct future_task *task;
+	struct future *future;
+	struct thread_pvt *thread;
+
+	if (!func || !(future = future_new())) {
+		return NULL;
+	}
+
+	if (!(task = objalloc(sizeof(*task), free_future_task))) {
+		objunref(future);
+		return NULL;
+	}
+	task->func = func;
+	task->data = (objref(data)) ? data : NULL;
+	task->future = (objref(future)) ? future : NULL;
+
+	if ((thread = framework_mkthread(future_task_thread, future_task_clean, NULL, task, THREAD_OPTION_RETURN))) {
+		objunref(thread);
+	} else {
+		future_complete(future, NULL);
+	}
+	objunref(task);
+
+	return future;
+}
+
 /** @}*/
@@ -41,6 +41,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 
 #include "include/dtsapp.h"
+#include "include/private.h"
 
 /** @brief Unix socket server data structure*/
 struct unixserv_sockthread {
@@ -109,6 +110,7 @@ static void *unsock_client(void *data) {
 		}
 
 		if (FD_ISSET(sock->sock, &act_set) && unsock->client) {
+			thread_countcb();
 			unsock->client(sock, unsock->data);
 		}
 	}
@@ -238,6 +240,7 @@ static void *unsock_serv(void *data) {
 					}
 				}
 			} else if (unsock->read) {
+				thread_countcb();
 				unsock->read(sock, unsock->data);
 				
 			}